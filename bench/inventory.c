@@ -0,0 +1,143 @@
+// timed from inside the inventory, as a depot uses it
+#include "../inventory.c"
+#include "../intern.c"
+
+#include <stdio.h>
+#include <time.h>
+
+// Goods changed, how long each run lasts, and the most writers run
+#define BENCH_GOODS 4096
+#define RUN_NS 1000000000LL
+#define MAX_WRITERS 8
+
+// Inventories here have no replication log or change feed
+void repl_append(struct ReplLog* log, uint32_t good, int64_t amount) {
+}
+
+void feed_changed(struct ChangeFeed* feed, uint32_t good) {
+}
+
+/**
+ * A thread changing or snapshotting the inventory until told to stop, and
+ * how many times it did so.
+ */
+struct Worker {
+    pthread_t id;
+    int index;
+    unsigned long done;
+};
+
+static struct Inventory* inventory;
+static uint32_t goods[BENCH_GOODS];
+static bool stopping;
+
+/**
+ * Gets the time from a monotonic clock.
+ * @return the time, in nanoseconds
+ */
+static long long now_ns(void) {
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * Thread function which moves stock between goods, as transfers and
+ * deliveries do, until stopped.
+ *
+ * @param arg: the worker
+ * @return NULL (for thread function definition)
+ */
+static void* writer_thread(void* arg) {
+
+    struct Worker* worker = (struct Worker*)arg;
+    uint32_t next = worker->index * 7919;
+    while (!__atomic_load_n(&stopping, __ATOMIC_RELAXED)) {
+        change_stock(inventory, goods[next % BENCH_GOODS], -1);
+        change_stock(inventory, goods[(next + 1) % BENCH_GOODS], 1);
+        next += 13;
+        worker->done += 2;
+    }
+    return NULL;
+}
+
+/**
+ * Thread function which snapshots the inventory, as queries and state
+ * syncs do, until stopped.
+ *
+ * @param arg: the worker
+ * @return NULL (for thread function definition)
+ */
+static void* snapshot_thread(void* arg) {
+
+    struct Worker* worker = (struct Worker*)arg;
+    while (!__atomic_load_n(&stopping, __ATOMIC_RELAXED)) {
+        int64_t* quantities;
+        snapshot_stock(inventory, &quantities);
+        free(quantities);
+        worker->done++;
+    }
+    return NULL;
+}
+
+/**
+ * Runs writers (and a snapshotter, if asked) against the inventory for
+ * RUN_NS, printing changes and snapshots per second.
+ *
+ * @param writers: the number of writer threads
+ * @param snapshots: true to snapshot while the writers run
+ */
+static void bench_run(int writers, bool snapshots) {
+
+    struct Worker workers[MAX_WRITERS];
+    struct Worker snapshotter = {0, 0, 0};
+    stopping = false;
+
+    long long start = now_ns();
+    for (int i = 0; i < writers; i++) {
+        workers[i].index = i;
+        workers[i].done = 0;
+        pthread_create(&workers[i].id, NULL, writer_thread, &workers[i]);
+    }
+    if (snapshots) {
+        pthread_create(&snapshotter.id, NULL, snapshot_thread, &snapshotter);
+    }
+
+    struct timespec run = {RUN_NS / 1000000000, RUN_NS % 1000000000};
+    nanosleep(&run, NULL);
+    __atomic_store_n(&stopping, true, __ATOMIC_RELAXED);
+
+    unsigned long changes = 0;
+    for (int i = 0; i < writers; i++) {
+        pthread_join(workers[i].id, NULL);
+        changes += workers[i].done;
+    }
+    if (snapshots) {
+        pthread_join(snapshotter.id, NULL);
+    }
+    double seconds = (double)(now_ns() - start) / 1000000000;
+
+    printf("%d %s %.0f %.0f\n", writers, snapshots ? "yes" : "no",
+            changes / seconds, snapshotter.done / seconds);
+}
+
+int main(void) {
+
+    inventory = new_inventory();
+    for (int i = 0; i < BENCH_GOODS; i++) {
+        char name[16];
+        snprintf(name, sizeof(name), "good%d", i);
+        goods[i] = intern_good(name);
+        change_stock(inventory, goods[i], 1000000);
+    }
+
+    printf("writers snapshots changes_per_s snapshots_per_s\n");
+    for (int writers = 1; writers <= MAX_WRITERS; writers *= 2) {
+        bench_run(writers, false);
+        bench_run(writers, true);
+    }
+
+    free_inventory(inventory);
+    return 0;
+}
@@ -0,0 +1,105 @@
+// the kernels are static, so they are timed from inside simd.c
+#include "../simd.c"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+// Calls timed for each kernel and length
+#define CALLS 2000000
+
+// Longest string scanned
+#define MAX_BENCH_LENGTH 1024
+
+/**
+ * A set of kernels to time.
+ */
+struct KernelSet {
+    const char* name;
+    struct ScanKernels kernels;
+};
+
+// Where results are summed, so calls aren't optimised away
+static volatile size_t sink;
+
+/**
+ * Gets the time from a monotonic clock.
+ * @return the time, in nanoseconds
+ */
+static long long now_ns(void) {
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * Times each kernel of a set on strings of one length, printing the
+ * nanoseconds per call of each. The string is a run of digits with a ':'
+ * at the end, so every kernel reads all of it, as when checking a
+ * message's fields.
+ *
+ * @param set: the kernels to time
+ * @param string: the string to scan
+ * @param length: the number of bytes to scan
+ */
+static void bench_length(const struct KernelSet* set, const char* string,
+        size_t length) {
+
+    long long start = now_ns();
+    for (int i = 0; i < CALLS; i++) {
+        sink += set->kernels.countByte(string, length, ':');
+    }
+    double countNs = (double)(now_ns() - start) / CALLS;
+
+    start = now_ns();
+    for (int i = 0; i < CALLS; i++) {
+        sink += set->kernels.hasAnyByte(string, length, " \n\r", 3);
+    }
+    double anyNs = (double)(now_ns() - start) / CALLS;
+
+    start = now_ns();
+    for (int i = 0; i < CALLS; i++) {
+        sink += set->kernels.allDigits(string, length);
+    }
+    double digitsNs = (double)(now_ns() - start) / CALLS;
+
+    printf("%s %zu %.2f %.2f %.2f\n", set->name, length, countNs, anyNs,
+            digitsNs);
+}
+
+int main(void) {
+
+    static const size_t lengths[] = {4, 8, 16, 32, 64, 256, MAX_BENCH_LENGTH};
+    char string[MAX_BENCH_LENGTH];
+    for (size_t i = 0; i < MAX_BENCH_LENGTH; i++) {
+        string[i] = '0' + i % 10;
+    }
+
+    struct KernelSet sets[3] = {{"scalar", {count_byte_scalar,
+            has_any_byte_scalar, all_digits_scalar}}};
+    int count = 1;
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+        sets[count++] = (struct KernelSet){"sse2", {count_byte_sse2,
+                has_any_byte_sse2, all_digits_sse2}};
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        sets[count++] = (struct KernelSet){"avx2", {count_byte_avx2,
+                has_any_byte_avx2, all_digits_avx2}};
+    }
+#endif
+
+    printf("kernels length count_byte_ns has_any_byte_ns all_digits_ns\n");
+    for (size_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++) {
+        for (int i = 0; i < count; i++) {
+            // only the last byte differs, so the whole string is read
+            string[lengths[l] - 1] = ':';
+            bench_length(&sets[i], string, lengths[l]);
+            string[lengths[l] - 1] = '0' + (lengths[l] - 1) % 10;
+        }
+    }
+
+    return 0;
+}
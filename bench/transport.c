@@ -0,0 +1,210 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+// Round trips timed for latency, and lines sent one way for throughput
+#define ROUND_TRIPS 20000
+#define STREAM_LINES 1000000
+
+// The line sent, as a typical small depot message
+#define BENCH_LINE "Deliver:1:apple\n"
+
+// Longest line read back
+#define MAX_LINE_LENGTH 64
+
+/**
+ * The two ends of a connection, as stdio streams, the way depots use them.
+ */
+struct Ends {
+    FILE* clientTo;
+    FILE* clientFrom;
+    FILE* serverTo;
+    FILE* serverFrom;
+};
+
+/**
+ * Gets the time from a monotonic clock.
+ * @return the time, in nanoseconds
+ */
+static long long now_ns(void) {
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * Connects a client to a listening socket and accepts it, then opens
+ * streams on both ends (a write and a read stream each, as depots do).
+ *
+ * @param family: AF_UNIX or AF_INET
+ * @param ends: filled in with the connection's streams
+ * @return 0 on success, -1 if the connection couldn't be made
+ */
+static int open_ends(int family, struct Ends* ends) {
+
+    struct sockaddr_un local;
+    struct sockaddr_in inet;
+    struct sockaddr* address;
+    socklen_t length;
+    if (family == AF_UNIX) {
+        // an abstract name, like the depot's own Unix domain sockets
+        memset(&local, 0, sizeof(local));
+        local.sun_family = AF_UNIX;
+        int name = snprintf(local.sun_path + 1, sizeof(local.sun_path) - 1,
+                "depot-bench-%d", (int)getpid());
+        address = (struct sockaddr*)&local;
+        length = offsetof(struct sockaddr_un, sun_path) + 1 + name;
+    } else {
+        memset(&inet, 0, sizeof(inet));
+        inet.sin_family = AF_INET;
+        inet.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address = (struct sockaddr*)&inet;
+        length = sizeof(inet);
+    }
+
+    int listener = socket(family, SOCK_STREAM, 0);
+    if (listener == -1 || bind(listener, address, length) == -1 ||
+            listen(listener, 1) == -1 ||
+            getsockname(listener, address, &length) == -1) {
+        return -1;
+    }
+    int client = socket(family, SOCK_STREAM, 0);
+    if (client == -1 || connect(client, address, length) == -1) {
+        return -1;
+    }
+    int server = accept(listener, NULL, NULL);
+    close(listener);
+    if (server == -1) {
+        return -1;
+    }
+    if (family == AF_INET) {
+        int enable = 1;
+        setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(int));
+        setsockopt(server, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(int));
+    }
+
+    ends->clientTo = fdopen(client, "w");
+    ends->clientFrom = fdopen(dup(client), "r");
+    ends->serverTo = fdopen(server, "w");
+    ends->serverFrom = fdopen(dup(server), "r");
+    return 0;
+}
+
+/**
+ * Closes both ends of a connection.
+ *
+ * @param ends: the connection's streams
+ */
+static void close_ends(struct Ends* ends) {
+
+    fclose(ends->clientTo);
+    fclose(ends->clientFrom);
+    fclose(ends->serverTo);
+    fclose(ends->serverFrom);
+}
+
+/**
+ * Thread function which sends back every line read, until the stream ends.
+ *
+ * @param arg: the connection's streams
+ * @return NULL (for thread function definition)
+ */
+static void* echo_thread(void* arg) {
+
+    struct Ends* ends = (struct Ends*)arg;
+    char line[MAX_LINE_LENGTH];
+    while (fgets(line, sizeof(line), ends->serverFrom) != NULL) {
+        fputs(line, ends->serverTo);
+        fflush(ends->serverTo);
+    }
+    return NULL;
+}
+
+/**
+ * Thread function which reads lines until the stream ends.
+ *
+ * @param arg: the connection's streams
+ * @return NULL (for thread function definition)
+ */
+static void* drain_thread(void* arg) {
+
+    struct Ends* ends = (struct Ends*)arg;
+    char line[MAX_LINE_LENGTH];
+    while (fgets(line, sizeof(line), ends->serverFrom) != NULL) {
+    }
+    return NULL;
+}
+
+/**
+ * Times a transport: the mean round trip of a line sent and echoed back,
+ * flushed each way as depots do, then the rate lines can be sent one way,
+ * each flushed (as send_line does).
+ *
+ * @param family: AF_UNIX or AF_INET
+ * @param name: the transport's name, as printed
+ */
+static void bench_transport(int family, const char* name) {
+
+    struct Ends ends;
+    if (open_ends(family, &ends) == -1) {
+        printf("%s unavailable\n", name);
+        return;
+    }
+
+    pthread_t echo;
+    pthread_create(&echo, NULL, echo_thread, &ends);
+    char line[MAX_LINE_LENGTH];
+    long long start = now_ns();
+    for (int i = 0; i < ROUND_TRIPS; i++) {
+        fputs(BENCH_LINE, ends.clientTo);
+        fflush(ends.clientTo);
+        if (fgets(line, sizeof(line), ends.clientFrom) == NULL) {
+            break;
+        }
+    }
+    double roundTripUs = (now_ns() - start) / 1000.0 / ROUND_TRIPS;
+    shutdown(fileno(ends.clientTo), SHUT_WR);
+    pthread_join(echo, NULL);
+    close_ends(&ends);
+
+    if (open_ends(family, &ends) == -1) {
+        return;
+    }
+    pthread_t drain;
+    pthread_create(&drain, NULL, drain_thread, &ends);
+    start = now_ns();
+    for (int i = 0; i < STREAM_LINES; i++) {
+        fputs(BENCH_LINE, ends.clientTo);
+        fflush(ends.clientTo);
+    }
+    shutdown(fileno(ends.clientTo), SHUT_WR);
+    pthread_join(drain, NULL);
+    double seconds = (now_ns() - start) / 1e9;
+    close_ends(&ends);
+
+    printf("%s %.2f %.0f\n", name, roundTripUs, STREAM_LINES / seconds);
+}
+
+/**
+ * Compares the transports depots on the same host can use: an abstract
+ * Unix domain socket (DEPOT_UNIX_SOCKETS) and TCP over loopback. Prints
+ * "transport round_trip_us lines_per_s" for each.
+ */
+int main(int argc, char** argv) {
+
+    printf("transport round_trip_us lines_per_s\n");
+    bench_transport(AF_UNIX, "unix");
+    bench_transport(AF_INET, "tcp");
+    return 0;
+}
@@ -0,0 +1,121 @@
+#include <stdlib.h>
+#include <string.h>
+#include "budget.h"
+
+/**
+ * Header stored in front of every budgeted allocation, recording what to
+ * credit back to which budget when it is freed. Sized to keep the memory
+ * after it suitably aligned.
+ */
+struct BudgetHeader {
+    struct MemBudget* budget;
+    size_t size;
+};
+
+// Budget for the whole process, set up by main
+static struct MemBudget processBudget = {0, 0, 0, NULL};
+
+/**
+ * Sets up a new, empty budget.
+ *
+ * @param budget: the budget to set up
+ * @param limit: the most bytes which may be charged to it, or 0 for no limit
+ * @param parent: a budget every charge is also made to, or NULL
+ */
+void init_budget(struct MemBudget* budget, size_t limit,
+        struct MemBudget* parent) {
+
+    budget->used = 0;
+    budget->peak = 0;
+    budget->limit = limit;
+    budget->parent = parent;
+}
+
+/**
+ * Gets the process wide budget, the parent of every connection's budget.
+ * @return a pointer to the process wide budget
+ */
+struct MemBudget* global_budget(void) {
+    return &processBudget;
+}
+
+/**
+ * Allocates memory, charging it to a budget (and that budget's parents).
+ * Allocations are never refused for being over budget: callers check
+ * over_budget() before reading more, so that the limit is where pushback
+ * starts rather than where messages start being lost.
+ *
+ * @param budget: the budget to charge, or NULL to charge nothing
+ * @param size: the number of bytes to allocate
+ * @return a pointer to the allocated memory, to be freed with budget_free
+ */
+void* budget_alloc(struct MemBudget* budget, size_t size) {
+
+    struct BudgetHeader* header = malloc(sizeof(struct BudgetHeader) + size);
+    header->budget = budget;
+    header->size = size;
+
+    for (struct MemBudget* node = budget; node != NULL; node = node->parent) {
+        size_t used = __atomic_add_fetch(&node->used, size, __ATOMIC_RELAXED);
+        if (used > __atomic_load_n(&node->peak, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&node->peak, used, __ATOMIC_RELAXED);
+        }
+    }
+
+    return header + 1;
+}
+
+/**
+ * Duplicates a string, charging the copy to a budget.
+ *
+ * @param budget: the budget to charge, or NULL to charge nothing
+ * @param string: the string to copy
+ * @return the copy, to be freed with budget_free
+ */
+char* budget_strdup(struct MemBudget* budget, const char* string) {
+
+    size_t size = strlen(string) + 1;
+    char* copy = budget_alloc(budget, size);
+    memcpy(copy, string, size);
+
+    return copy;
+}
+
+/**
+ * Frees memory allocated with budget_alloc, crediting it back to the
+ * budget it was charged to.
+ *
+ * @param pointer: the memory to free (NULL is ignored)
+ */
+void budget_free(void* pointer) {
+
+    if (pointer == NULL) {
+        return;
+    }
+
+    struct BudgetHeader* header = (struct BudgetHeader*)pointer - 1;
+    for (struct MemBudget* node = header->budget; node != NULL;
+            node = node->parent) {
+        __atomic_sub_fetch(&node->used, header->size, __ATOMIC_RELAXED);
+    }
+
+    free(header);
+}
+
+/**
+ * Checks whether a budget, or any of its parents, is over its limit.
+ *
+ * @param budget: the budget to check
+ * @return true if over budget, false otherwise
+ */
+bool over_budget(struct MemBudget* budget) {
+
+    for (struct MemBudget* node = budget; node != NULL; node = node->parent) {
+        if (node->limit != 0 &&
+                __atomic_load_n(&node->used, __ATOMIC_RELAXED) > node->limit) {
+            return true;
+        }
+    }
+
+    return false;
+}
@@ -0,0 +1,34 @@
+#ifndef BUDGET_H
+#define BUDGET_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * A memory budget, which allocations on the message path are charged to.
+ * Each connection has its own budget, whose parent is the process wide
+ * budget, so an allocation counts against both. A limit of 0 means the
+ * budget is unlimited. Counts are updated atomically, so budgets can be
+ * shared between threads without a lock.
+ */
+struct MemBudget {
+    size_t used;
+    size_t peak;
+    size_t limit;
+    struct MemBudget* parent;
+};
+
+void init_budget(struct MemBudget* budget, size_t limit,
+        struct MemBudget* parent);
+
+struct MemBudget* global_budget(void);
+
+void* budget_alloc(struct MemBudget* budget, size_t size);
+
+char* budget_strdup(struct MemBudget* budget, const char* string);
+
+void budget_free(void* pointer);
+
+bool over_budget(struct MemBudget* budget);
+
+#endif //BUDGET_H
@@ -0,0 +1,196 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include "capture.h"
+
+// Bytes of records kept before they are written out
+#define CAPTURE_BUFFER_SIZE (64 * 1024)
+
+// Nanoseconds records may sit in the buffer before they are written out
+#define CAPTURE_FLUSH_NS 1000000000LL
+
+// The trace being written, if capturing, and its buffered records, all
+// protected by captureLock
+static pthread_mutex_t captureLock = PTHREAD_MUTEX_INITIALIZER;
+static FILE* trace = NULL;
+static uint8_t* buffer = NULL;
+static size_t used = 0;
+static long long lastNs = 0;
+static long long flushedNs = 0;
+
+// The last capture ID given out
+static uint32_t lastId = 0;
+
+/**
+ * Writes an unsigned number as a LEB128 varint.
+ *
+ * @param out: where to write it (at least CAPTURE_MAX_VARINT bytes)
+ * @param value: the number to write
+ * @return the number of bytes written
+ */
+size_t put_varint(uint8_t* out, uint64_t value) {
+
+    size_t length = 0;
+    while (value >= 0x80) {
+        out[length++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    out[length++] = (uint8_t)value;
+
+    return length;
+}
+
+/**
+ * Reads an unsigned LEB128 varint.
+ *
+ * @param in: the bytes to read from
+ * @param length: the number of bytes which may be read
+ * @param value: where to store the number read
+ * @return the number of bytes read, or 0 if the varint was cut short or
+ *      too long
+ */
+size_t get_varint(const uint8_t* in, size_t length, uint64_t* value) {
+
+    uint64_t result = 0;
+    for (size_t i = 0; i < length && i < CAPTURE_MAX_VARINT; i++) {
+        result |= (uint64_t)(in[i] & 0x7f) << (7 * i);
+        if ((in[i] & 0x80) == 0) {
+            *value = result;
+            return i + 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Gets the time from a monotonic clock.
+ * @return the time, in nanoseconds
+ */
+static long long now_ns(void) {
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * Starts capturing every line read from a neighbour into a trace file
+ * (DEPOT_CAPTURE), which 2310replay can play back. Must be called once in
+ * main, before any connections are made.
+ *
+ * @param path: the file to write the trace to (replaced if it exists)
+ * @return true if the trace was started, false if it couldn't be created
+ */
+bool start_capture(const char* path) {
+
+    trace = fopen(path, "wb");
+    if (trace == NULL) {
+        return false;
+    }
+
+    buffer = malloc(CAPTURE_BUFFER_SIZE);
+    fwrite(CAPTURE_MAGIC, 1, CAPTURE_MAGIC_LENGTH, trace);
+    fflush(trace);
+    lastNs = now_ns();
+    flushedNs = lastNs;
+    return true;
+}
+
+/**
+ * Checks whether lines are being captured.
+ * @return true if capturing, false otherwise
+ */
+bool capturing(void) {
+    return trace != NULL;
+}
+
+/**
+ * Gives out the ID a new connection's lines are captured under.
+ * @return the new connection's capture ID (never 0)
+ */
+uint32_t capture_id(void) {
+    return __atomic_add_fetch(&lastId, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Writes the buffered records to the trace. Must be called with
+ * captureLock held.
+ */
+static void write_buffer(void) {
+
+    fwrite(buffer, 1, used, trace);
+    fflush(trace);
+    used = 0;
+}
+
+/**
+ * Records an event on a connection in the trace: the connection opening or
+ * closing, or a line read from it. Records are timestamped in the order
+ * they are added, and written out once the buffer fills or has held them
+ * for a second. Does nothing if not capturing.
+ *
+ * @param connection: the connection's capture ID
+ * @param kind: CAPTURE_OPEN, CAPTURE_LINE or CAPTURE_CLOSE
+ * @param line: the line read, for CAPTURE_LINE, or NULL
+ * @param length: the length of the line
+ */
+void capture_event(uint32_t connection, int kind, const char* line,
+        size_t length) {
+
+    if (trace == NULL) {
+        return;
+    }
+
+    uint8_t header[4 * CAPTURE_MAX_VARINT];
+    size_t headerLength;
+
+    pthread_mutex_lock(&captureLock);
+    long long now = now_ns();
+    headerLength = put_varint(header, (uint64_t)(now - lastNs));
+    headerLength += put_varint(header + headerLength, connection);
+    headerLength += put_varint(header + headerLength, (uint64_t)kind);
+    if (kind != CAPTURE_LINE) {
+        length = 0;
+    } else {
+        headerLength += put_varint(header + headerLength, length);
+    }
+    lastNs = now;
+
+    if (used + headerLength + length > CAPTURE_BUFFER_SIZE) {
+        write_buffer();
+    }
+    if (headerLength + length > CAPTURE_BUFFER_SIZE) {
+        // too long to buffer, write it straight out
+        fwrite(header, 1, headerLength, trace);
+        fwrite(line, 1, length, trace);
+        fflush(trace);
+    } else {
+        memcpy(buffer + used, header, headerLength);
+        memcpy(buffer + used + headerLength, line, length);
+        used += headerLength + length;
+    }
+
+    if (now - flushedNs > CAPTURE_FLUSH_NS) {
+        write_buffer();
+        flushedNs = now;
+    }
+    pthread_mutex_unlock(&captureLock);
+}
+
+/**
+ * Writes out every record captured so far. Does nothing if not capturing.
+ */
+void flush_capture(void) {
+
+    if (trace == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&captureLock);
+    write_buffer();
+    flushedNs = now_ns();
+    pthread_mutex_unlock(&captureLock);
+}
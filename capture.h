@@ -0,0 +1,42 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * A capture trace starts with CAPTURE_MAGIC, then holds one record per
+ * event, each of which is: the nanoseconds since the previous record, the
+ * connection's capture ID, the record kind, and (for lines only) the line's
+ * length followed by the line itself, without a newline. Numbers are
+ * unsigned LEB128 varints, so most records cost a few bytes on top of the
+ * line.
+ */
+#define CAPTURE_MAGIC "DEPOTCAP1\n"
+#define CAPTURE_MAGIC_LENGTH 10
+
+// Kinds of record in a capture trace
+#define CAPTURE_OPEN 0
+#define CAPTURE_LINE 1
+#define CAPTURE_CLOSE 2
+
+// Longest a varint in a trace can be
+#define CAPTURE_MAX_VARINT 10
+
+bool start_capture(const char* path);
+
+bool capturing(void);
+
+uint32_t capture_id(void);
+
+void capture_event(uint32_t connection, int kind, const char* line,
+        size_t length);
+
+void flush_capture(void);
+
+size_t put_varint(uint8_t* out, uint64_t value);
+
+size_t get_varint(const uint8_t* in, size_t length, uint64_t* value);
+
+#endif //CAPTURE_H
@@ -1,17 +1,19 @@
 #include <pthread.h>
 #include "channel.h"
 
-// Starting length of the queue.
+// Length of the control lane's queue, and the shortest bulk lane.
 #define QUEUE_CAPACITY 50
 
 /**
  * Creates (and returns) a new, empty queue, with no data in it.
+ * @param capacity: the most data the queue can hold at once
  * @return new empty queue struct
  */
-struct Queue new_queue(void) {
+struct Queue new_queue(int capacity) {
     struct Queue output;
 
-    output.data = malloc(sizeof(void*) * QUEUE_CAPACITY);
+    output.data = malloc(sizeof(void*) * capacity);
+    output.capacity = capacity;
     output.readEnd = -1; // queue is empty
     output.writeEnd = 0; // put first piece of data at the start of the queue
 
@@ -53,7 +55,7 @@ bool write_queue(struct Queue* queue, void* data) {
         queue->readEnd = queue->writeEnd;
     }
 
-    queue->writeEnd = (queue->writeEnd + 1) % QUEUE_CAPACITY;
+    queue->writeEnd = (queue->writeEnd + 1) % queue->capacity;
 
     return true;
 }
@@ -74,7 +76,7 @@ bool read_queue(struct Queue* queue, void** output) {
 
     *output = queue->data[queue->readEnd];
 
-    queue->readEnd = (queue->readEnd + 1) % QUEUE_CAPACITY;
+    queue->readEnd = (queue->readEnd + 1) % queue->capacity;
 
     if (queue->readEnd == queue->writeEnd) {
         queue->readEnd = -1;
@@ -85,20 +87,31 @@ bool read_queue(struct Queue* queue, void** output) {
 
 /**
  * Creates a new empty channel, with no data in it.
+ * @param bulkCapacity: the most data the bulk lane may hold (at least the
+ *      control lane's capacity)
+ * @param burst: reads from the control lane allowed in a row while the bulk
+ *      lane has data waiting (at least 1)
  * @return: pointer to the newly created channel struct
  */
-struct Channel* new_channel(void) {
+struct Channel* new_channel(int bulkCapacity, int burst) {
     struct Channel* output = malloc(sizeof(struct Channel));
 
-    sem_t signal;
     pthread_mutex_t queueLock;
 
-    sem_init(&signal, 0, 1);
+    sem_init(&output->signal, 0, 1);
     pthread_mutex_init(&queueLock, NULL);
+    if (bulkCapacity < QUEUE_CAPACITY) {
+        bulkCapacity = QUEUE_CAPACITY;
+    }
+    for (int lane = 0; lane < CHANNEL_LANES; lane++) {
+        int capacity = lane == LANE_BULK ? bulkCapacity : QUEUE_CAPACITY;
+        sem_init(&output->space[lane], 0, capacity);
+        output->queues[lane] = new_queue(capacity);
+    }
 
-    output->queue = new_queue();
-    output->signal = signal;
     output->queueLock = queueLock;
+    output->burst = burst > 0 ? burst : 1;
+    output->streak = 0;
 
     return output;
 }
@@ -111,22 +124,30 @@ struct Channel* new_channel(void) {
  */
 void destroy_channel(struct Channel* channel, void (*clean)(void*)) {
 
-    destroy_queue(&channel->queue, clean);
+    for (int lane = 0; lane < CHANNEL_LANES; lane++) {
+        destroy_queue(&channel->queues[lane], clean);
+        sem_destroy(&channel->space[lane]);
+    }
     pthread_mutex_destroy(&channel->queueLock);
     sem_destroy(&channel->signal);
 }
 
 /**
- * Attempts to write a piece of data to the channel.
+ * Attempts to write a piece of data to one of the channel's lanes.
  * @param channel: a pointer to the channel to write to
+ * @param lane: the lane to write to (LANE_CONTROL or LANE_BULK)
  * @param data: the data to write to the channel
  * @return true if the writing attempt was successful, false
- *      if the channel is full, and writing is unsuccessful.
+ *      if the lane is full, and writing is unsuccessful.
  */
-bool write_channel(struct Channel* channel, void* data) {
+bool write_channel(struct Channel* channel, int lane, void* data) {
+
+    if (sem_trywait(&channel->space[lane])) {
+        return false; // full
+    }
 
     pthread_mutex_lock(&channel->queueLock);
-    bool output = write_queue(&channel->queue, data);
+    bool output = write_queue(&channel->queues[lane], data);
     pthread_mutex_unlock(&channel->queueLock);
 
     sem_post(&channel->signal);
@@ -136,7 +157,50 @@ bool write_channel(struct Channel* channel, void* data) {
 }
 
 /**
- * Attempts to read a piece of data from the channel.
+ * Writes a piece of data to one of the channel's lanes, waiting for room if
+ * the lane is full (instead of failing, like write_channel does).
+ * @param channel: a pointer to the channel to write to
+ * @param lane: the lane to write to (LANE_CONTROL or LANE_BULK)
+ * @param data: the data to write to the channel
+ */
+void write_channel_wait(struct Channel* channel, int lane, void* data) {
+
+    sem_wait(&channel->space[lane]);
+
+    pthread_mutex_lock(&channel->queueLock);
+    write_queue(&channel->queues[lane], data);
+    pthread_mutex_unlock(&channel->queueLock);
+
+    sem_post(&channel->signal);
+}
+
+/**
+ * Picks the lane to read from next: the control lane, unless it is empty
+ * or has had its burst of reads while bulk data waits. NULL (which readers
+ * write last, to the bulk lane) is never taken ahead of control data, so
+ * nothing written before it is left behind. Must be called with the queue
+ * lock held.
+ * @param channel: a pointer to the channel to read from
+ * @return the lane to read from
+ */
+static int pick_lane(struct Channel* channel) {
+
+    struct Queue* control = &channel->queues[LANE_CONTROL];
+    struct Queue* bulk = &channel->queues[LANE_BULK];
+
+    if (control->readEnd == -1) {
+        return LANE_BULK;
+    }
+    if (bulk->readEnd == -1 || channel->streak < channel->burst ||
+            bulk->data[bulk->readEnd] == NULL) {
+        return LANE_CONTROL;
+    }
+    return LANE_BULK;
+}
+
+/**
+ * Attempts to read a piece of data from the channel, from the highest
+ * priority lane with data (see pick_lane).
  * @param: a pointer to the channel to read from
  * @param: a pointer to where read data from the channel should be stored
  * @return true if read successful, sets *output to the read data. False,
@@ -148,9 +212,36 @@ bool read_channel(struct Channel* channel, void** out) {
     //fprintf(stderr, "STDERR: Past semaphore...\n");
 
     pthread_mutex_lock(&channel->queueLock);
-    bool output = read_queue(&channel->queue, out);
+    int lane = pick_lane(channel);
+    bool bulkWaiting = channel->queues[LANE_BULK].readEnd != -1;
+    bool output = read_queue(&channel->queues[lane], out);
+    if (output) {
+        channel->streak = lane == LANE_CONTROL && bulkWaiting ?
+                channel->streak + 1 : 0;
+    }
     pthread_mutex_unlock(&channel->queueLock);
+
+    if (output) {
+        sem_post(&channel->space[lane]);
+    }
     //fprintf(stderr, "STDERR: Reading from channel...\n");
 
     return output;
 }
+
+/**
+ * Checks whether a channel has data waiting to be read, in any lane.
+ * @param channel: a pointer to the channel to check
+ * @return true if the channel is not empty, false otherwise
+ */
+bool channel_pending(struct Channel* channel) {
+
+    pthread_mutex_lock(&channel->queueLock);
+    bool pending = false;
+    for (int lane = 0; lane < CHANNEL_LANES; lane++) {
+        pending = pending || channel->queues[lane].readEnd != -1;
+    }
+    pthread_mutex_unlock(&channel->queueLock);
+
+    return pending;
+}
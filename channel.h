@@ -20,9 +20,11 @@ struct Queue {
     // An offset within that array that points to the end of the queue (where
     // old data should be read).
     int readEnd;
+    // The length of the array.
+    int capacity;
 };
 
-struct Queue new_queue(void);
+struct Queue new_queue(int capacity);
 
 void destroy_queue(struct Queue* queue, void (*clean)(void*));
 
@@ -31,23 +33,45 @@ bool write_queue(struct Queue* queue, void* data);
 bool read_queue(struct Queue* queue, void** output);
 
 
+// Lanes of a channel, read in this order of priority
+#define LANE_CONTROL 0
+#define LANE_BULK 1
+#define CHANNEL_LANES 2
+
 /**
  * A threadsafe channel between two depots. Data can be written to the
  * channel or read from the channel at different times, by read/write threads
- * safely (using a semaphore and mutex).
+ * safely (using a semaphore and mutex). Data is written to one of several
+ * lanes, each a queue of its own, and lanes are read in priority order, so
+ * control messages needn't wait behind bulk ones. Order is kept within each
+ * lane. The bulk lane may be given room for more messages than the control
+ * lane, so that control messages can overtake a long backlog of bulk ones
+ * rather than wait behind it in the socket. After burst reads from the
+ * control lane in a row, one is taken from
+ * the bulk lane (if it has any), so the bulk lane keeps moving; streak
+ * counts the control reads since the last bulk one. A semaphore per lane
+ * counts the free space in its queue, so writers may wait for room rather
+ * than dropping data.
  */
 struct Channel {
     sem_t signal;
+    sem_t space[CHANNEL_LANES];
     pthread_mutex_t queueLock;
-    struct Queue queue;
+    struct Queue queues[CHANNEL_LANES];
+    int burst;
+    int streak;
 };
 
-struct Channel* new_channel(void);
+struct Channel* new_channel(int bulkCapacity, int burst);
 
 void destroy_channel(struct Channel* channel, void (*clean)(void*));
 
-bool write_channel(struct Channel* channel, void* data);
+bool write_channel(struct Channel* channel, int lane, void* data);
+
+void write_channel_wait(struct Channel* channel, int lane, void* data);
 
 bool read_channel(struct Channel* channel, void** output);
 
+bool channel_pending(struct Channel* channel);
+
 #endif //CHANNEL_H
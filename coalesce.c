@@ -0,0 +1,199 @@
+#include <limits.h>
+#include <stdlib.h>
+#include <time.h>
+#include "coalesce.h"
+#include "config.h"
+#include "linkedLists.h"
+#include "network.h"
+#include "tenant.h"
+#include "rcu.h"
+#include "neighbours.h"
+#include "intern.h"
+#include "inventory.h"
+#include "stats.h"
+#include "placement.h"
+
+// Number of goods a coalescer has room for when first used
+#define INITIAL_PENDING 8
+
+/**
+ * Checks whether transfers are being coalesced (DEPOT_COALESCE_MS is set).
+ * @return true if coalescing, false otherwise
+ */
+bool coalescing(void) {
+    return get_config()->coalesceMs > 0;
+}
+
+/**
+ * Creates an empty coalescer for a newly connected neighbour.
+ *
+ * @param inventory: the inventory transfers to the neighbour are withdrawn
+ *      from
+ * @return the new coalescer (freed with free_coalescer)
+ */
+struct Coalescer* new_coalescer(struct Inventory* inventory) {
+
+    struct Coalescer* coalescer = malloc(sizeof(struct Coalescer));
+    pthread_mutex_init(&coalescer->lock, NULL);
+    coalescer->inventory = inventory;
+    coalescer->pending = NULL;
+    coalescer->count = 0;
+    coalescer->capacity = 0;
+    coalescer->transfers = 0;
+    return coalescer;
+}
+
+/**
+ * Frees a coalescer, putting anything still waiting in it back in
+ * inventory (its neighbour having gone, there is nowhere to send it).
+ *
+ * @param coalescer: the coalescer to free
+ */
+void free_coalescer(struct Coalescer* coalescer) {
+
+    for (int i = 0; i < coalescer->count; i++) {
+        change_stock(coalescer->inventory, coalescer->pending[i].good,
+                coalescer->pending[i].quantity);
+    }
+    pthread_mutex_destroy(&coalescer->lock);
+    free(coalescer->pending);
+    free(coalescer);
+}
+
+/**
+ * Adds a transfer to the Delivers waiting to be sent to a neighbour,
+ * rather than sending its Deliver straight away. The quantity is added to
+ * the good's waiting Deliver, which is sent with the rest at the end of
+ * the window (DEPOT_COALESCE_MS), or once DEPOT_COALESCE_MAX transfers have
+ * been added, whichever is first. The good's stock must already have been
+ * withdrawn.
+ *
+ * @param depot: the neighbour the transfer is to
+ * @param good: the good being transferred
+ * @param quantity: the quantity being transferred
+ * @return true if the transfer was added, false if it must be sent by
+ *      itself (not coalescing, or its good's total would overflow)
+ */
+bool coalesce_transfer(struct Depot* depot, uint32_t good, int quantity) {
+
+    struct Coalescer* coalescer = depot->coalesced;
+    if (coalescer == NULL) {
+        return false;
+    }
+
+    pthread_mutex_lock(&coalescer->lock);
+    struct PendingDeliver* entry = NULL;
+    // few goods wait at once (at most DEPOT_COALESCE_MAX), so search
+    for (int i = 0; i < coalescer->count; i++) {
+        if (coalescer->pending[i].good == good) {
+            entry = &coalescer->pending[i];
+            break;
+        }
+    }
+    if (entry != NULL && entry->quantity > INT_MAX - quantity) {
+        pthread_mutex_unlock(&coalescer->lock);
+        return false;
+    }
+    if (entry == NULL) {
+        if (coalescer->count == coalescer->capacity) {
+            coalescer->capacity = coalescer->capacity == 0 ?
+                    INITIAL_PENDING : coalescer->capacity * 2;
+            coalescer->pending = realloc(coalescer->pending,
+                    coalescer->capacity * sizeof(struct PendingDeliver));
+        }
+        entry = &coalescer->pending[coalescer->count++];
+        entry->good = good;
+        entry->quantity = 0;
+    }
+    entry->quantity += quantity;
+    bool full = ++coalescer->transfers >= get_config()->coalesceMax;
+    pthread_mutex_unlock(&coalescer->lock);
+
+    stat_add(STAT_TRANSFERS_COALESCED, 1);
+    if (full) {
+        flush_coalescer(depot);
+    }
+    return true;
+}
+
+/**
+ * Sends a neighbour the Delivers waiting for it, one per good. They are
+ * taken from the coalescer first, so transfers can carry on being added
+ * while they are sent. Any which can't be sent, the connection having been
+ * torn down, are put back in inventory. Safe to call from any thread.
+ *
+ * @param depot: the neighbour to send to
+ */
+void flush_coalescer(struct Depot* depot) {
+
+    struct Coalescer* coalescer = depot->coalesced;
+    if (coalescer == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&coalescer->lock);
+    struct PendingDeliver* pending = coalescer->pending;
+    int count = coalescer->count;
+    coalescer->pending = NULL;
+    coalescer->count = 0;
+    coalescer->capacity = 0;
+    coalescer->transfers = 0;
+    pthread_mutex_unlock(&coalescer->lock);
+
+    for (int i = 0; i < count; i++) {
+        if (pending[i].quantity == 0) {
+            continue;
+        }
+        if (send_to_depot(depot, "Deliver:%lld:%s", pending[i].quantity,
+                good_name(pending[i].good))) {
+            stat_add(STAT_COALESCED_DELIVERS, 1);
+        } else {
+            change_stock(coalescer->inventory, pending[i].good,
+                    pending[i].quantity);
+        }
+    }
+    free(pending);
+}
+
+/**
+ * Thread function which sends every neighbour of every hosted depot the
+ * Delivers waiting for it, once every DEPOT_COALESCE_MS, so no transfer
+ * waits longer than that.
+ *
+ * @param arg: unused
+ * @return NULL (for thread function definition)
+ */
+static void* coalesce_thread(void* arg) {
+
+    place_thread(ROLE_WORKER);
+    int windowMs = get_config()->coalesceMs;
+    struct timespec pause = {windowMs / 1000, (windowMs % 1000) * 1000000L};
+    while (1) {
+        nanosleep(&pause, NULL);
+        for (struct Tenant* tenant = first_tenant(); tenant != NULL;
+                tenant = tenant->next) {
+            rcu_read_lock();
+            const struct NeighbourSet* set =
+                    read_neighbours(tenant->thisDepot);
+            for (int i = 0; i < set->count; i++) {
+                flush_coalescer(set->neighbours[i].depot);
+            }
+            rcu_read_unlock();
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Starts the thread which ends each coalescing window, if coalescing. Must
+ * be called once in main, after the hosted depots are set up.
+ */
+void start_coalescing(void) {
+
+    if (!coalescing()) {
+        return;
+    }
+    pthread_t tid;
+    pthread_create(&tid, 0, coalesce_thread, NULL);
+    pthread_detach(tid);
+}
@@ -0,0 +1,45 @@
+#ifndef COALESCE_H
+#define COALESCE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+struct Depot;
+struct Inventory;
+
+/**
+ * A quantity of a good waiting to be sent to a neighbour as one Deliver.
+ */
+struct PendingDeliver {
+    uint32_t good;
+    long long quantity;
+};
+
+/**
+ * The Delivers waiting to be sent to a neighbour, one per good, and how
+ * many transfers have been added since they were last sent, protected by
+ * lock. Stock which can't be sent is put back in inventory.
+ */
+struct Coalescer {
+    pthread_mutex_t lock;
+    struct Inventory* inventory;
+    struct PendingDeliver* pending;
+    int count;
+    int capacity;
+    int transfers;
+};
+
+void start_coalescing(void);
+
+bool coalescing(void);
+
+struct Coalescer* new_coalescer(struct Inventory* inventory);
+
+void free_coalescer(struct Coalescer* coalescer);
+
+bool coalesce_transfer(struct Depot* depot, uint32_t good, int quantity);
+
+void flush_coalescer(struct Depot* depot);
+
+#endif //COALESCE_H
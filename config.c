@@ -0,0 +1,203 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include "config.h"
+#include "util.h"
+
+#define DEFAULT_CONNECT_TIMEOUT_MS 5000
+#define DEFAULT_ACCEPTOR_THREADS 1
+#define DEFAULT_LISTEN_BACKLOG 4096
+#define DEFAULT_UNIX_SOCKETS 0
+#define DEFAULT_SHM_RINGS 0
+#define DEFAULT_CREDIT_WINDOW 0
+#define MAX_CREDIT_WINDOW 48
+#define DEFAULT_CONNECTION_MEMORY (1 << 20)
+#define DEFAULT_PROCESS_MEMORY (64 << 20)
+#define DEFAULT_REPL_LOG 0
+#define MAX_REPL_LOG (1 << 24)
+#define DEFAULT_STATE_SYNC 0
+#define DEFAULT_SYNC_MAX_GOODS 65536
+#define DEFAULT_MAX_LINE (256 * 1024)
+#define DEFAULT_SCHED_QUANTUM 0
+#define DEFAULT_SCHED_MAX_WAIT_MS 100
+#define DEFAULT_CONTROL_BURST 16
+#define DEFAULT_BULK_LANE 1024
+#define MIN_MAX_LINE 64
+#define DEFAULT_TRACE_SAMPLE 1
+#define DEFAULT_TRACE_RING 4096
+#define MIN_TRACE_RING 16
+#define DEFAULT_TRACE_FLUSH_MS 1000
+#define DEFAULT_COALESCE_MS 0
+#define DEFAULT_COALESCE_MAX 256
+#define DEFAULT_FEED_MS 100
+#define DEFAULT_FEED_MAX_GOODS 4096
+
+// Settings for this process, filled in by load_config()
+static struct Config config = {
+    .connectTimeoutMs = DEFAULT_CONNECT_TIMEOUT_MS,
+    .acceptorThreads = DEFAULT_ACCEPTOR_THREADS,
+    .listenBacklog = DEFAULT_LISTEN_BACKLOG,
+    .unixSockets = DEFAULT_UNIX_SOCKETS,
+    .shmRings = DEFAULT_SHM_RINGS,
+    .ioEngine = IO_ENGINE_THREADS,
+    .creditWindow = DEFAULT_CREDIT_WINDOW,
+    .connectionMemory = DEFAULT_CONNECTION_MEMORY,
+    .processMemory = DEFAULT_PROCESS_MEMORY,
+    .tenants = NULL,
+    .replLog = DEFAULT_REPL_LOG,
+    .follow = NULL,
+    .followState = NULL,
+    .stateSync = DEFAULT_STATE_SYNC,
+    .syncMaxGoods = DEFAULT_SYNC_MAX_GOODS,
+    .maxLine = DEFAULT_MAX_LINE,
+    .schedQuantum = DEFAULT_SCHED_QUANTUM,
+    .schedSlots = 1,
+    .schedWeights = NULL,
+    .schedMaxWaitMs = DEFAULT_SCHED_MAX_WAIT_MS,
+    .controlBurst = DEFAULT_CONTROL_BURST,
+    .bulkLane = DEFAULT_BULK_LANE,
+    .ioCpus = NULL,
+    .workerCpus = NULL,
+    .acceptorCpus = NULL,
+    .reportCpus = NULL,
+    .capture = NULL,
+    .traceFile = NULL,
+    .traceSample = DEFAULT_TRACE_SAMPLE,
+    .traceRing = DEFAULT_TRACE_RING,
+    .traceFlushMs = DEFAULT_TRACE_FLUSH_MS,
+    .coalesceMs = DEFAULT_COALESCE_MS,
+    .coalesceMax = DEFAULT_COALESCE_MAX,
+    .feedMs = DEFAULT_FEED_MS,
+    .feedMaxGoods = DEFAULT_FEED_MAX_GOODS,
+};
+
+/**
+ * Reads a non-negative integer setting from the environment.
+ *
+ * @param name: the name of the environment variable to read
+ * @param fallback: the value to use if the variable is unset or invalid
+ * @return the integer value of the variable, or fallback
+ */
+static int env_int(const char* name, int fallback) {
+
+    char* value = getenv(name);
+    if (value == NULL || strcmp(value, "") == 0 || !is_a_number(value)) {
+        return fallback;
+    }
+
+    return atoi(value);
+}
+
+/**
+ * Loads all depot settings from the environment. Must be called once in
+ * main, before any threads are started.
+ */
+void load_config(void) {
+
+    config.connectTimeoutMs = env_int("DEPOT_CONNECT_TIMEOUT_MS",
+            DEFAULT_CONNECT_TIMEOUT_MS);
+    config.acceptorThreads = env_int("DEPOT_ACCEPTORS",
+            DEFAULT_ACCEPTOR_THREADS);
+    config.listenBacklog = env_int("DEPOT_LISTEN_BACKLOG",
+            DEFAULT_LISTEN_BACKLOG);
+    config.unixSockets = env_int("DEPOT_UNIX_SOCKETS",
+            DEFAULT_UNIX_SOCKETS) != 0;
+    config.shmRings = env_int("DEPOT_SHM_RINGS", DEFAULT_SHM_RINGS) != 0;
+
+    char* engine = getenv("DEPOT_IO_ENGINE");
+    if (engine != NULL && strcmp(engine, "uring") == 0) {
+        config.ioEngine = IO_ENGINE_URING;
+    }
+
+    config.creditWindow = env_int("DEPOT_CREDIT_WINDOW",
+            DEFAULT_CREDIT_WINDOW);
+    config.connectionMemory = env_int("DEPOT_CONNECTION_MEMORY",
+            DEFAULT_CONNECTION_MEMORY);
+    config.processMemory = env_int("DEPOT_PROCESS_MEMORY",
+            DEFAULT_PROCESS_MEMORY);
+    config.tenants = getenv("DEPOT_TENANTS");
+    config.replLog = env_int("DEPOT_REPL_LOG", DEFAULT_REPL_LOG);
+    config.follow = getenv("DEPOT_FOLLOW");
+    if (config.follow != NULL && (strcmp(config.follow, "") == 0 ||
+            !is_a_number((char*)config.follow))) {
+        config.follow = NULL;
+    }
+    config.followState = getenv("DEPOT_FOLLOW_STATE");
+    config.stateSync = env_int("DEPOT_STATE_SYNC", DEFAULT_STATE_SYNC) != 0;
+    config.syncMaxGoods = env_int("DEPOT_SYNC_MAX_GOODS",
+            DEFAULT_SYNC_MAX_GOODS);
+    config.maxLine = env_int("DEPOT_MAX_LINE", DEFAULT_MAX_LINE);
+    config.schedQuantum = env_int("DEPOT_SCHED_QUANTUM",
+            DEFAULT_SCHED_QUANTUM);
+    config.schedSlots = env_int("DEPOT_SCHED_SLOTS",
+            (int)sysconf(_SC_NPROCESSORS_ONLN));
+    config.schedWeights = getenv("DEPOT_SCHED_WEIGHTS");
+    config.schedMaxWaitMs = env_int("DEPOT_SCHED_MAX_WAIT_MS",
+            DEFAULT_SCHED_MAX_WAIT_MS);
+    config.controlBurst = env_int("DEPOT_CONTROL_BURST",
+            DEFAULT_CONTROL_BURST);
+    config.bulkLane = env_int("DEPOT_BULK_LANE", DEFAULT_BULK_LANE);
+    config.ioCpus = getenv("DEPOT_CPUS_IO");
+    config.workerCpus = getenv("DEPOT_CPUS_WORKER");
+    config.acceptorCpus = getenv("DEPOT_CPUS_ACCEPTOR");
+    config.reportCpus = getenv("DEPOT_CPUS_REPORT");
+    config.capture = getenv("DEPOT_CAPTURE");
+    config.traceFile = getenv("DEPOT_TRACE_FILE");
+    config.traceSample = env_int("DEPOT_TRACE_SAMPLE", DEFAULT_TRACE_SAMPLE);
+    config.traceRing = env_int("DEPOT_TRACE_RING", DEFAULT_TRACE_RING);
+    config.traceFlushMs = env_int("DEPOT_TRACE_FLUSH_MS",
+            DEFAULT_TRACE_FLUSH_MS);
+    config.coalesceMs = env_int("DEPOT_COALESCE_MS", DEFAULT_COALESCE_MS);
+    config.coalesceMax = env_int("DEPOT_COALESCE_MAX", DEFAULT_COALESCE_MAX);
+    config.feedMs = env_int("DEPOT_FEED_MS", DEFAULT_FEED_MS);
+    config.feedMaxGoods = env_int("DEPOT_FEED_MAX_GOODS",
+            DEFAULT_FEED_MAX_GOODS);
+
+    if (config.creditWindow > MAX_CREDIT_WINDOW) {
+        config.creditWindow = MAX_CREDIT_WINDOW;
+    }
+    if (config.acceptorThreads < 1) {
+        config.acceptorThreads = 1;
+    }
+    // a partial line must fit in the budget, or its reader could never
+    // finish it
+    if (config.connectionMemory > 0 &&
+            config.maxLine > config.connectionMemory / 2) {
+        config.maxLine = config.connectionMemory / 2;
+    }
+    if (config.schedSlots < 1) {
+        config.schedSlots = 1;
+    }
+    if (config.maxLine < MIN_MAX_LINE) {
+        config.maxLine = MIN_MAX_LINE;
+    }
+    if (config.coalesceMax < 1) {
+        config.coalesceMax = 1;
+    }
+    if (config.traceSample < 1) {
+        config.traceSample = 1;
+    }
+    if (config.traceRing < MIN_TRACE_RING) {
+        config.traceRing = MIN_TRACE_RING;
+    }
+    if (config.traceFlushMs < 1) {
+        config.traceFlushMs = 1;
+    }
+    if (config.replLog > MAX_REPL_LOG) {
+        config.replLog = MAX_REPL_LOG;
+    }
+    if (config.replLog > 0) {
+        int size = 1;
+        while (size < config.replLog) {
+            size *= 2;
+        }
+        config.replLog = size;
+    }
+}
+
+/**
+ * Gets the settings loaded for this process.
+ * @return a pointer to the (read only) settings struct
+ */
+const struct Config* get_config(void) {
+    return &config;
+}
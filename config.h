@@ -0,0 +1,134 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <stdbool.h>
+
+#define IO_ENGINE_THREADS 0
+#define IO_ENGINE_URING 1
+
+/**
+ * Struct holding tunable runtime settings for this depot. Settings are read
+ * once at startup from environment variables (so the 2310depot command line
+ * format is unchanged), and fall back to defaults if unset or invalid.
+ */
+struct Config {
+    // Milliseconds an outbound connect may take before it is abandoned
+    // (DEPOT_CONNECT_TIMEOUT_MS).
+    int connectTimeoutMs;
+    // Number of threads accepting inbound connections, each with its own
+    // listening socket on the shared port (DEPOT_ACCEPTORS).
+    int acceptorThreads;
+    // Length of each listening socket's queue of pending connections
+    // (DEPOT_LISTEN_BACKLOG).
+    int listenBacklog;
+    // Whether to listen on, advertise and prefer an abstract Unix domain
+    // socket for depots on the same host (DEPOT_UNIX_SOCKETS, 0 or 1).
+    bool unixSockets;
+    // Whether depots on the same host exchange messages over shared memory
+    // rings once connected (DEPOT_SHM_RINGS, 0 or 1).
+    bool shmRings;
+    // How neighbour sockets are read and written: IO_ENGINE_THREADS (a
+    // reader thread per connection) or IO_ENGINE_URING (one io_uring
+    // engine thread for all sockets), set by DEPOT_IO_ENGINE=threads|uring.
+    int ioEngine;
+    // Messages a neighbour may send before this depot grants it more
+    // credits, or 0 (the default, so IM messages look as they always have)
+    // to turn off flow control (DEPOT_CREDIT_WINDOW). At most the capacity
+    // of a connection's channel.
+    int creditWindow;
+    // Bytes of queued messages one connection may hold before reads from
+    // it are paused, or 0 for no limit (DEPOT_CONNECTION_MEMORY).
+    int connectionMemory;
+    // Bytes of message path memory the whole process may hold before reads
+    // are paused, or 0 for no limit (DEPOT_PROCESS_MEMORY).
+    int processMemory;
+    // More depots for this process to host, separated by ';', each given
+    // as the 2310depot arguments would be, e.g. "B apple 5;C", or NULL to
+    // host only the depot on the command line (DEPOT_TENANTS).
+    const char* tenants;
+    // Changes kept in this depot's replication log for followers to stream
+    // from (rounded up to a power of 2), or 0 for no log (DEPOT_REPL_LOG).
+    int replLog;
+    // Port of the primary this depot follows as a read-only replica, or
+    // NULL if it is not a follower (DEPOT_FOLLOW).
+    const char* follow;
+    // File a follower checkpoints its copy to, so it can resume after a
+    // restart, or NULL for none (DEPOT_FOLLOW_STATE).
+    const char* followState;
+    // Whether depots send each other their stock right after the IM
+    // handshake, if both ask for it (DEPOT_STATE_SYNC, 0 or 1).
+    bool stateSync;
+    // Most goods a neighbour's state sync may list before the sync is
+    // rejected, so a neighbour can't make this depot intern and mirror
+    // goods without bound (DEPOT_SYNC_MAX_GOODS).
+    int syncMaxGoods;
+    // Longest line, in bytes, a neighbour may send; longer lines are
+    // dropped, so a neighbour can't make a reader buffer without bound
+    // (DEPOT_MAX_LINE). At most half of DEPOT_CONNECTION_MEMORY.
+    int maxLine;
+    // Messages a connection may handle per unit of weight before giving
+    // its turn to another connection with messages waiting, or 0 to let
+    // every connection's action thread run freely (DEPOT_SCHED_QUANTUM).
+    int schedQuantum;
+    // Connections which may be handling messages at once when scheduling,
+    // by default one per online CPU (DEPOT_SCHED_SLOTS).
+    int schedSlots;
+    // Weights of neighbours by name, e.g. "B=4,C=2", given turns that many
+    // times as long; others have a weight of 1 (DEPOT_SCHED_WEIGHTS).
+    const char* schedWeights;
+    // Milliseconds a connection waits for a turn before handling its
+    // message anyway (DEPOT_SCHED_MAX_WAIT_MS).
+    int schedMaxWaitMs;
+    // Control messages (IM, Connect, Defer, Execute, ...) a connection may
+    // handle in a row, ahead of its waiting bulk messages, before one bulk
+    // message is let through (DEPOT_CONTROL_BURST).
+    int controlBurst;
+    // Bulk messages a connection's channel may hold waiting to be handled,
+    // so control messages can be read past a backlog (DEPOT_BULK_LANE).
+    // Memory budgets still push back on the sender well before a full
+    // lane of long lines is queued.
+    int bulkLane;
+    // CPUs, as a list such as "0-3,8", for each role of thread to be
+    // pinned to, or NULL to leave them to the kernel: socket readers and
+    // the io_uring engine (DEPOT_CPUS_IO), message handlers
+    // (DEPOT_CPUS_WORKER), acceptors (DEPOT_CPUS_ACCEPTOR), and the main
+    // thread, which reports (DEPOT_CPUS_REPORT).
+    const char* ioCpus;
+    const char* workerCpus;
+    const char* acceptorCpus;
+    const char* reportCpus;
+    // File to capture every line read from neighbours into, for replay
+    // with 2310replay, or NULL to not capture (DEPOT_CAPTURE).
+    const char* capture;
+    // File to append message spans to, for following a message from depot
+    // to depot, or NULL to not trace (DEPOT_TRACE_FILE). One in every
+    // traceSample transfers starts a trace (DEPOT_TRACE_SAMPLE); spans wait
+    // in a ring of traceRing (DEPOT_TRACE_RING), oldest overwritten first,
+    // which is flushed every traceFlushMs (DEPOT_TRACE_FLUSH_MS).
+    const char* traceFile;
+    int traceSample;
+    int traceRing;
+    int traceFlushMs;
+    // Milliseconds transfers to the same neighbour are gathered for, then
+    // sent as one Deliver per good, or 0 to send each transfer's Deliver
+    // straight away (DEPOT_COALESCE_MS). A neighbour's Delivers are sent
+    // early once coalesceMax transfers to it are waiting
+    // (DEPOT_COALESCE_MAX).
+    int coalesceMs;
+    int coalesceMax;
+    // Milliseconds between updates sent to neighbours subscribed to stock
+    // changes, each batching every change since the last, or 0 to ignore
+    // Subscribe messages (DEPOT_FEED_MS). Only neighbours using credit flow
+    // (DEPOT_CREDIT_WINDOW) may subscribe.
+    int feedMs;
+    // Most goods a neighbour may subscribe to which this depot hadn't seen
+    // yet, so a neighbour can't make this depot intern goods without bound
+    // (DEPOT_FEED_MAX_GOODS).
+    int feedMaxGoods;
+};
+
+void load_config(void);
+
+const struct Config* get_config(void);
+
+#endif //CONFIG_H
@@ -0,0 +1,422 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "dialer.h"
+#include "network.h"
+#include "config.h"
+#include "placement.h"
+#include "simd.h"
+
+#define MAX_DIAL_EVENTS 64
+
+// Started on the first call to dial_depot()
+static pthread_once_t dialerOnce = PTHREAD_ONCE_INIT;
+static int dialPoll = -1;
+static int dialWake = -1;
+
+// Connects which are in flight, waiting on the dialer thread
+static pthread_mutex_t dialLock = PTHREAD_MUTEX_INITIALIZER;
+static struct Dial* pendingDials = NULL;
+
+// Hosts which have already been resolved, and ports' known transports
+static pthread_mutex_t cacheLock = PTHREAD_MUTEX_INITIALIZER;
+static struct CachedAddress* addressCache = NULL;
+static struct KnownTransport* knownTransports = NULL;
+
+/**
+ * Gets the current time from a monotonic clock.
+ * @return the current time in milliseconds
+ */
+static long long now_ms(void) {
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/**
+ * Builds the abstract Unix domain socket address used by the depot
+ * listening on the given TCP port.
+ *
+ * @param port: the depot's TCP port, as a string
+ * @param output: where the address is written
+ * @return the length of the address, to be passed to bind/connect
+ */
+socklen_t unix_address(const char* port, struct sockaddr_un* output) {
+
+    memset(output, 0, sizeof(struct sockaddr_un));
+    output->sun_family = AF_UNIX;
+
+    // abstract names start with a null byte, and aren't null terminated
+    int length = snprintf(output->sun_path + 1, sizeof(output->sun_path) - 1,
+            "2310depot:%s", port);
+    return offsetof(struct sockaddr_un, sun_path) + 1 + length;
+}
+
+/**
+ * Checks that a port is a TCP port number, so it fits in PORT_LENGTH
+ * without being cut short (and dialing some other port).
+ *
+ * @param port: the port, as a string
+ * @return true if the port is 1 to 65535, false otherwise
+ */
+bool valid_port(const char* port) {
+
+    size_t length = strlen(port);
+    if (length == 0 || length >= PORT_LENGTH ||
+            !scan_all_digits(port, length)) {
+        return false;
+    }
+    return atoi(port) > 0 && atoi(port) <= 65535;
+}
+
+/**
+ * Records whether the depot on a port advertised a Unix domain socket in
+ * its IM message, so later connects to it go straight to the right
+ * transport. Ports which aren't valid (see valid_port) are ignored.
+ *
+ * @param port: the depot's TCP port, as a string
+ * @param unixCapable: true if the depot advertised a Unix domain socket
+ */
+void remember_transport(const char* port, bool unixCapable) {
+
+    if (!valid_port(port)) {
+        return;
+    }
+
+    pthread_mutex_lock(&cacheLock);
+    struct KnownTransport* entry = knownTransports;
+    while (entry != NULL && strcmp(entry->port, port) != 0) {
+        entry = entry->next;
+    }
+
+    if (entry == NULL) {
+        entry = malloc(sizeof(struct KnownTransport));
+        snprintf(entry->port, sizeof(entry->port), "%s", port);
+        entry->next = knownTransports;
+        knownTransports = entry;
+    }
+    entry->unixCapable = unixCapable;
+    pthread_mutex_unlock(&cacheLock);
+}
+
+/**
+ * Checks whether a port may have a Unix domain socket worth trying. Ports
+ * which haven't been heard from yet are assumed to.
+ *
+ * @param port: the depot's TCP port, as a string
+ * @return false if the depot on the port is known not to listen on a Unix
+ *      domain socket, true otherwise
+ */
+static bool may_be_unix(const char* port) {
+
+    bool output = true;
+    pthread_mutex_lock(&cacheLock);
+    for (struct KnownTransport* entry = knownTransports; entry != NULL;
+            entry = entry->next) {
+        if (strcmp(entry->port, port) == 0) {
+            output = entry->unixCapable;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&cacheLock);
+
+    return output;
+}
+
+/**
+ * Resolves a host and port to an IPv4 address, only calling getaddrinfo
+ * the first time a host is seen. Later lookups for the same host copy the
+ * cached address and fill in the port.
+ *
+ * @param host: the host name to resolve (i.e. localhost)
+ * @param port: the port number to fill in, as a string
+ * @param output: where the resolved address is written
+ * @return true if the address was resolved, false otherwise
+ */
+bool resolve_cached(const char* host, const char* port,
+        struct sockaddr_in* output) {
+
+    pthread_mutex_lock(&cacheLock);
+    struct CachedAddress* entry = addressCache;
+    while (entry != NULL && strcmp(entry->host, host) != 0) {
+        entry = entry->next;
+    }
+
+    if (entry == NULL) { // first lookup for this host
+        struct addrinfo* ai = 0;
+        struct addrinfo hints;
+        memset(&hints, 0, sizeof(struct addrinfo));
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+
+        if (getaddrinfo(host, 0, &hints, &ai)) {
+            pthread_mutex_unlock(&cacheLock);
+            return false;
+        }
+
+        entry = malloc(sizeof(struct CachedAddress));
+        entry->host = strdup(host);
+        memcpy(&entry->address, ai->ai_addr, sizeof(struct sockaddr_in));
+        entry->next = addressCache;
+        addressCache = entry;
+        freeaddrinfo(ai);
+    }
+
+    *output = entry->address;
+    pthread_mutex_unlock(&cacheLock);
+
+    output->sin_port = htons(atoi(port));
+    return true;
+}
+
+/**
+ * Finishes an outbound connect. On success the socket is switched back to
+ * blocking mode (the connection threads use stdio streams) and connection
+ * threads are started for it, otherwise the socket is closed.
+ *
+ * @param dial: the connect attempt to finish (freed by this function)
+ * @param connected: true if the connect succeeded
+ */
+static void finish_dial(struct Dial* dial, bool connected) {
+
+    if (!connected) {
+        close(dial->fd);
+        free(dial->wrapper);
+        free(dial);
+        return;
+    }
+
+    int flags = fcntl(dial->fd, F_GETFL);
+    fcntl(dial->fd, F_SETFL, flags & ~O_NONBLOCK);
+
+    dial->wrapper->dialed = true;
+    start_communication_threads(dial->wrapper, dial->fd, dup(dial->fd));
+    free(dial);
+}
+
+/**
+ * Removes a connect attempt from the in flight list, and stops watching its
+ * socket for completion.
+ *
+ * @param dial: the connect attempt to remove
+ */
+static void remove_dial(struct Dial* dial) {
+
+    pthread_mutex_lock(&dialLock);
+    struct Dial** node = &pendingDials;
+    while (*node != NULL && *node != dial) {
+        node = &(*node)->next;
+    }
+    if (*node != NULL) {
+        *node = dial->next;
+    }
+    pthread_mutex_unlock(&dialLock);
+
+    epoll_ctl(dialPoll, EPOLL_CTL_DEL, dial->fd, NULL);
+}
+
+/**
+ * Abandons every in flight connect whose deadline has passed.
+ *
+ * @return the number of milliseconds until the next deadline, or -1 if
+ *      there are no connects in flight
+ */
+static int expire_dials(void) {
+
+    long long now = now_ms();
+    long long next = -1;
+    struct Dial* expired = NULL;
+
+    pthread_mutex_lock(&dialLock);
+    struct Dial** node = &pendingDials;
+    while (*node != NULL) {
+        struct Dial* dial = *node;
+        if (dial->deadline <= now) { // move to expired list
+            *node = dial->next;
+            dial->next = expired;
+            expired = dial;
+            continue;
+        }
+        if (next == -1 || dial->deadline - now < next) {
+            next = dial->deadline - now;
+        }
+        node = &dial->next;
+    }
+    pthread_mutex_unlock(&dialLock);
+
+    while (expired != NULL) {
+        struct Dial* dial = expired;
+        expired = dial->next;
+        epoll_ctl(dialPoll, EPOLL_CTL_DEL, dial->fd, NULL);
+        finish_dial(dial, false);
+    }
+
+    return (int)next;
+}
+
+/**
+ * Thread function which waits for in flight connects to complete (or time
+ * out), so that no connection thread ever blocks on connect() itself.
+ *
+ * @param arg: unused
+ * @return NULL (for thread function definition)
+ */
+static void* dialer_thread(void* arg) {
+
+    struct epoll_event events[MAX_DIAL_EVENTS];
+    uint64_t wakeups;
+    place_thread(ROLE_IO);
+
+    while (1) {
+        note_thread_cpu();
+        int timeout = expire_dials();
+        int count = epoll_wait(dialPoll, events, MAX_DIAL_EVENTS, timeout);
+
+        for (int i = 0; i < count; i++) {
+            struct Dial* dial = events[i].data.ptr;
+            if (dial == NULL) { // woken up for a new connect
+                // only clears the wakeup, so a failed read changes nothing
+                (void)read(dialWake, &wakeups, sizeof(uint64_t));
+                continue;
+            }
+
+            int err = 0;
+            socklen_t len = sizeof(int);
+            getsockopt(dial->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+            remove_dial(dial);
+            finish_dial(dial, err == 0);
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Sets up the dialer's epoll instance and starts the dialer thread.
+ */
+static void start_dialer(void) {
+
+    dialPoll = epoll_create1(EPOLL_CLOEXEC);
+    dialWake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    epoll_ctl(dialPoll, EPOLL_CTL_ADD, dialWake, &event);
+
+    pthread_t tid;
+    pthread_create(&tid, 0, dialer_thread, NULL);
+    pthread_detach(tid);
+}
+
+/**
+ * Starts a non-blocking connect to a depot's port over one transport. A
+ * connect which completes (or fails) straight away is finished at once,
+ * as Unix domain socket connects always are; otherwise the dialer thread
+ * watches it, and finishes it when it completes, or gives up on it after
+ * the configured timeout. A connect to a port which already has one in
+ * flight is ignored.
+ *
+ * @param port: the port number to connect to
+ * @param wrapper: the connection wrapper containing information to start
+ *      a new connection
+ * @param family: the socket's address family, AF_UNIX or AF_INET
+ * @param address: the address to connect to
+ * @param length: the length of the address
+ * @return true if the connect succeeded or is in flight, false otherwise
+ */
+static bool start_dial(const char* port, struct ConnectionWrapper* wrapper,
+        int family, const struct sockaddr* address, socklen_t length) {
+
+    pthread_mutex_lock(&dialLock);
+    for (struct Dial* node = pendingDials; node != NULL; node = node->next) {
+        if (strcmp(node->port, port) == 0 &&
+                node->wrapper->thisDepot == wrapper->thisDepot) {
+            pthread_mutex_unlock(&dialLock);
+            return false;
+        }
+    }
+
+    struct Dial* dial = malloc(sizeof(struct Dial));
+    snprintf(dial->port, sizeof(dial->port), "%s", port);
+    dial->wrapper = new_connection_wrapper(wrapper->thisDepot,
+            wrapper->inventory, wrapper->firstDeferral,
+            wrapper->dataLock);
+    dial->deadline = now_ms() + get_config()->connectTimeoutMs;
+    dial->fd = socket(family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+            0);
+
+    int status = dial->fd == -1 ? -1 : connect(dial->fd, address, length);
+    if (status == -1 && errno == EINPROGRESS) {
+        // register while still holding the lock, so the dialer thread
+        // can't expire the connect before it is being watched
+        dial->next = pendingDials;
+        pendingDials = dial;
+
+        struct epoll_event event;
+        event.events = EPOLLOUT;
+        event.data.ptr = dial;
+        epoll_ctl(dialPoll, EPOLL_CTL_ADD, dial->fd, &event);
+        pthread_mutex_unlock(&dialLock);
+
+        uint64_t wakeup = 1;
+        // a failed write means the dialer thread already has a wakeup
+        (void)write(dialWake, &wakeup, sizeof(uint64_t));
+        return true;
+    }
+    pthread_mutex_unlock(&dialLock);
+
+    if (dial->fd == -1) {
+        free(dial->wrapper);
+        free(dial);
+        return false;
+    }
+
+    // either connected straight away, or failed straight away
+    finish_dial(dial, status == 0);
+    return status == 0;
+}
+
+/**
+ * Starts an asynchronous connect to another depot on this host. The depot's
+ * Unix domain socket is preferred, falling back to TCP if it has none, or
+ * its queue of pending connections is full (a non-blocking Unix domain
+ * socket connect fails, rather than waiting for room). Neither connect
+ * blocks (see start_dial). A connect to a port which isn't valid (see
+ * valid_port) is ignored, rather than dialing it cut short.
+ *
+ * @param port: the port number to connect to
+ * @param wrapper: the connection wrapper containing information to start
+ *      a new connection
+ * @return true if the connect was started, false otherwise
+ */
+bool dial_depot(const char* port, struct ConnectionWrapper* wrapper) {
+
+    if (!valid_port(port)) {
+        return false;
+    }
+
+    pthread_once(&dialerOnce, start_dialer);
+
+    if (get_config()->unixSockets && may_be_unix(port)) {
+        struct sockaddr_un local;
+        socklen_t length = unix_address(port, &local);
+        if (start_dial(port, wrapper, AF_UNIX, (struct sockaddr*)&local,
+                length)) {
+            return true;
+        }
+    }
+
+    struct sockaddr_in address;
+    if (!resolve_cached("localhost", port, &address)) {
+        return false;
+    }
+
+    return start_dial(port, wrapper, AF_INET, (struct sockaddr*)&address,
+            sizeof(struct sockaddr_in));
+}
@@ -0,0 +1,56 @@
+#ifndef DIALER_H
+#define DIALER_H
+
+#include <stdbool.h>
+#include <netinet/in.h>
+#include <sys/un.h>
+
+struct ConnectionWrapper;
+
+// Room for the longest TCP port number, as a string
+#define PORT_LENGTH 6
+
+/**
+ * A single outbound connection attempt which is in flight. The socket is
+ * non-blocking, and the attempt is abandoned once its deadline passes.
+ */
+struct Dial {
+    char port[PORT_LENGTH];
+    int fd;
+    long long deadline;
+    struct ConnectionWrapper* wrapper;
+    struct Dial* next;
+};
+
+/**
+ * A resolved host address, kept so that repeated connects to the same host
+ * don't need to go through getaddrinfo again.
+ */
+struct CachedAddress {
+    char* host;
+    struct sockaddr_in address;
+    struct CachedAddress* next;
+};
+
+/**
+ * What is known about a port's transports, learned from the IM message of
+ * the depot listening on it.
+ */
+struct KnownTransport {
+    char port[PORT_LENGTH];
+    bool unixCapable;
+    struct KnownTransport* next;
+};
+
+bool valid_port(const char* port);
+
+socklen_t unix_address(const char* port, struct sockaddr_un* output);
+
+void remember_transport(const char* port, bool unixCapable);
+
+bool resolve_cached(const char* host, const char* port,
+        struct sockaddr_in* output);
+
+bool dial_depot(const char* port, struct ConnectionWrapper* wrapper);
+
+#endif //DIALER_H
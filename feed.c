@@ -0,0 +1,586 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "feed.h"
+#include "config.h"
+#include "linkedLists.h"
+#include "network.h"
+#include "tenant.h"
+#include "inventory.h"
+#include "intern.h"
+#include "rcu.h"
+#include "neighbours.h"
+#include "stats.h"
+#include "placement.h"
+#include "util.h"
+
+// Longest update line sent to a subscriber; longer updates are split
+#define FEED_LINE_LENGTH 1024
+
+// Number of goods a set has room for when first used
+#define INITIAL_GOOD_SET 16
+
+// Goods covered by each chunk of a GoodBits, and the number of chunks its
+// directory has room for when first used
+#define GOOD_BITS_CHUNK 4096
+#define INITIAL_GOOD_BITS_DIRECTORY 16
+
+/**
+ * Adds a good to a set, unless it is already in it.
+ *
+ * @param set: the set to add to
+ * @param good: the interned ID of the good
+ */
+static void good_set_add(struct GoodSet* set, uint32_t good) {
+
+    if (good >= set->marksSize) {
+        uint32_t size = set->marksSize == 0 ? INITIAL_GOOD_SET :
+                set->marksSize;
+        while (size <= good) {
+            size *= 2;
+        }
+        set->marks = realloc(set->marks, size);
+        memset(set->marks + set->marksSize, 0, size - set->marksSize);
+        set->marksSize = size;
+    }
+    if (set->marks[good]) {
+        return;
+    }
+
+    if (set->count == set->capacity) {
+        set->capacity = set->capacity == 0 ? INITIAL_GOOD_SET :
+                set->capacity * 2;
+        set->goods = realloc(set->goods, set->capacity * sizeof(uint32_t));
+    }
+    set->goods[set->count++] = good;
+    set->marks[good] = 1;
+}
+
+/**
+ * Checks whether a good is in a set.
+ *
+ * @param set: the set to check
+ * @param good: the interned ID of the good
+ * @return true if the good is in the set, false otherwise
+ */
+static bool good_set_has(const struct GoodSet* set, uint32_t good) {
+    return good < set->marksSize && set->marks[good];
+}
+
+/**
+ * Empties a set, keeping its memory for reuse.
+ *
+ * @param set: the set to empty
+ */
+static void good_set_clear(struct GoodSet* set) {
+
+    for (uint32_t i = 0; i < set->count; i++) {
+        set->marks[set->goods[i]] = 0;
+    }
+    set->count = 0;
+}
+
+/**
+ * Frees the memory held by a set.
+ *
+ * @param set: the set to free
+ */
+static void free_good_set(struct GoodSet* set) {
+
+    free(set->goods);
+    free(set->marks);
+}
+
+/**
+ * Finds the word holding a good's bit.
+ *
+ * @param bits: the bits to look in
+ * @param good: the interned ID of the good
+ * @return the word, or NULL if the bits have no chunk for the good yet
+ */
+static uint64_t* good_bits_word(struct GoodBits* bits, uint32_t good) {
+
+    // the count is stored after the directory covering it
+    uint32_t chunk = good / GOOD_BITS_CHUNK;
+    if (chunk >= __atomic_load_n(&bits->chunkCount, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    uint64_t** chunks = __atomic_load_n(&bits->chunks, __ATOMIC_ACQUIRE);
+    return &chunks[chunk][good % GOOD_BITS_CHUNK / 64];
+}
+
+/**
+ * Finds the word holding a good's bit, adding chunks (and growing the
+ * directory if needed) if there isn't one yet.
+ *
+ * @param feed: the feed the bits are in, whose lock guards adding chunks
+ * @param bits: the bits to look in
+ * @param good: the interned ID of the good
+ * @return the word
+ */
+static uint64_t* good_bits_grow(struct ChangeFeed* feed,
+        struct GoodBits* bits, uint32_t good) {
+
+    uint64_t* word = good_bits_word(bits, good);
+    if (word != NULL) {
+        return word;
+    }
+
+    pthread_mutex_lock(&feed->lock);
+    uint32_t needed = good / GOOD_BITS_CHUNK + 1;
+    if (needed > bits->directorySize) {
+        uint32_t size = bits->directorySize == 0 ?
+                INITIAL_GOOD_BITS_DIRECTORY : bits->directorySize;
+        while (size < needed) {
+            size *= 2;
+        }
+        uint64_t** chunks = malloc(sizeof(uint64_t*) * size);
+        if (bits->chunkCount > 0) {
+            memcpy(chunks, bits->chunks,
+                    sizeof(uint64_t*) * bits->chunkCount);
+        }
+        __atomic_store_n(&bits->chunks, chunks, __ATOMIC_RELEASE);
+        bits->directorySize = size;
+    }
+    for (uint32_t i = bits->chunkCount; i < needed; i++) {
+        bits->chunks[i] = calloc(GOOD_BITS_CHUNK / 64, sizeof(uint64_t));
+    }
+    if (needed > bits->chunkCount) {
+        __atomic_store_n(&bits->chunkCount, needed, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&feed->lock);
+
+    return good_bits_word(bits, good);
+}
+
+/**
+ * Checks whether a good's bit is set.
+ *
+ * @param bits: the bits to check
+ * @param good: the interned ID of the good
+ * @return true if the good's bit is set, false otherwise
+ */
+static bool good_bits_has(struct GoodBits* bits, uint32_t good) {
+
+    uint64_t* word = good_bits_word(bits, good);
+    return word != NULL && (__atomic_load_n(word, __ATOMIC_RELAXED) &
+            (1ULL << good % 64)) != 0;
+}
+
+/**
+ * Takes every good from a feed's dirty bits, clearing them, and adds them
+ * to its changed list. Only called by the feed thread.
+ *
+ * @param feed: the feed to take changes from
+ */
+static void take_changes(struct ChangeFeed* feed) {
+
+    uint32_t chunkCount = __atomic_load_n(&feed->dirty.chunkCount,
+            __ATOMIC_ACQUIRE);
+    uint64_t** chunks = __atomic_load_n(&feed->dirty.chunks,
+            __ATOMIC_ACQUIRE);
+    for (uint32_t chunk = 0; chunk < chunkCount; chunk++) {
+        for (uint32_t i = 0; i < GOOD_BITS_CHUNK / 64; i++) {
+            uint64_t* word = &chunks[chunk][i];
+            if (__atomic_load_n(word, __ATOMIC_RELAXED) == 0) {
+                continue;
+            }
+            uint64_t taken = __atomic_exchange_n(word, 0, __ATOMIC_SEQ_CST);
+            while (taken != 0) {
+                int bit = __builtin_ctzll(taken);
+                taken &= taken - 1;
+                good_set_add(&feed->changed,
+                        chunk * GOOD_BITS_CHUNK + i * 64 + bit);
+            }
+        }
+    }
+    // pairs with feed_changed's fence, so the stock read next is at least
+    // as new as any change whose bit was found set
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+/**
+ * Creates the change feed for a hosted depot's inventory, which its
+ * neighbours can subscribe to.
+ *
+ * @param thisDepot: the depot whose inventory the feed is for
+ * @return the new feed
+ */
+struct ChangeFeed* new_change_feed(struct LinkedList* thisDepot) {
+
+    struct ChangeFeed* feed = calloc(1, sizeof(struct ChangeFeed));
+    pthread_mutex_init(&feed->lock, NULL);
+    feed->thisDepot = thisDepot;
+    return feed;
+}
+
+/**
+ * Notes that a good's stock has changed, so subscribers are sent its new
+ * quantity at the end of the flush interval (DEPOT_FEED_MS). However often
+ * it changes in the interval, it is sent once. Does nothing while no
+ * neighbour is subscribed to the good, and only takes a lock the first
+ * time a good in a new chunk of the dirty bits changes.
+ *
+ * @param feed: the feed of the inventory which changed
+ * @param good: the interned ID of the good which changed
+ */
+void feed_changed(struct ChangeFeed* feed, uint32_t good) {
+
+    if (__atomic_load_n(&feed->subscribers, __ATOMIC_RELAXED) == 0 ||
+            (__atomic_load_n(&feed->everything, __ATOMIC_RELAXED) == 0 &&
+            !good_bits_has(&feed->wanted, good))) {
+        return;
+    }
+
+    // if the bit is still set, the feed thread hasn't taken it since the
+    // change (see take_changes), so it will read the new quantity
+    uint64_t* word = good_bits_grow(feed, &feed->dirty, good);
+    uint64_t bit = 1ULL << good % 64;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if ((__atomic_load_n(word, __ATOMIC_RELAXED) & bit) == 0) {
+        __atomic_fetch_or(word, bit, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Message handler for subscribe messages, of the format Subscribe:t, where
+ * t is the name of a good, or * for every good. The neighbour is then sent
+ * the good's quantity, and sent it again whenever it changes, as updates of
+ * the format Update:q:t[:q:t...] (named apart from Query's Stock replies,
+ * which give t before q), batched once per DEPOT_FEED_MS. A
+ * neighbour may subscribe to any number of goods. Ignored if feeds are
+ * turned off, or the neighbour doesn't use credit flow (see
+ * handle_credit_message): updates are sent to it without waiting, and a
+ * neighbour which is slow to take them is only seen as such by the
+ * messages held back for it. A good this depot hasn't seen is interned,
+ * unless the neighbour has already subscribed to DEPOT_FEED_MAX_GOODS such
+ * goods; names with invalid characters are ignored.
+ *
+ * @param message: the subscribe message to handle
+ * @param connection: the connection the message was received on
+ */
+void handle_subscribe_message(char* message,
+        struct ConnectionWrapper* connection) {
+
+    struct ChangeFeed* feed = connection->inventory->feed;
+    struct Depot* depot = &connection->connectedDepot->type.depot;
+    if (feed == NULL || !check_string_match("Subscribe:", message) ||
+            count_symbol(message, ':') != 1 || !depot->creditFlow) {
+        return;
+    }
+    char* name = message + strlen("Subscribe:");
+    bool all = strcmp(name, "*") == 0;
+
+    // only this connection's action thread sets its subscription
+    struct Subscription* subscription = depot->subscription;
+    uint32_t good = NO_GOOD;
+    bool unknown = false;
+    if (!all) {
+        if (name[0] == '\0' || !check_characters(name, " \n\r:")) {
+            return;
+        }
+        good = find_good(name);
+        if (good == NO_GOOD) {
+            // once interned a good is known, so this bounds what is interned
+            if ((subscription != NULL && subscription->unknown ==
+                    (uint32_t)get_config()->feedMaxGoods) ||
+                    (good = intern_good(name)) == NO_GOOD) {
+                return;
+            }
+            unknown = true;
+        }
+    }
+
+    bool first = subscription == NULL;
+    if (first) {
+        subscription = calloc(1, sizeof(struct Subscription));
+        pthread_mutex_init(&subscription->lock, NULL);
+    }
+
+    // note changes to the goods wanted before owing the neighbour the
+    // quantities as they are now, so none are missed in between
+    if (all && !subscription->all) {
+        __atomic_add_fetch(&feed->everything, 1, __ATOMIC_RELAXED);
+    } else if (!all) {
+        __atomic_fetch_or(good_bits_grow(feed, &feed->wanted, good),
+                1ULL << good % 64, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_lock(&subscription->lock);
+    if (all) {
+        subscription->all = true;
+        struct StockEntry* entries;
+        uint32_t count = list_stock(connection->inventory, &entries);
+        for (uint32_t i = 0; i < count; i++) {
+            good_set_add(&subscription->pending, entries[i].good);
+        }
+        free(entries);
+    } else {
+        good_set_add(&subscription->wanted, good);
+        good_set_add(&subscription->pending, good);
+        subscription->unknown += unknown;
+    }
+    pthread_mutex_unlock(&subscription->lock);
+
+    if (first) {
+        __atomic_store_n(&depot->subscription, subscription,
+                __ATOMIC_RELEASE);
+        __atomic_add_fetch(&feed->subscribers, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Stops noting changes for a connection's subscription, as its connection
+ * is torn down. The subscription itself is freed with the depot.
+ *
+ * @param connection: the connection being torn down
+ */
+void end_subscription(struct ConnectionWrapper* connection) {
+
+    struct ChangeFeed* feed = connection->inventory->feed;
+    struct Subscription* subscription =
+            connection->connectedDepot->type.depot.subscription;
+    if (feed != NULL && subscription != NULL) {
+        __atomic_sub_fetch(&feed->subscribers, 1, __ATOMIC_RELAXED);
+        if (subscription->all) {
+            __atomic_sub_fetch(&feed->everything, 1, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/**
+ * Frees a subscription, once its depot can no longer be found.
+ *
+ * @param subscription: the subscription to free
+ */
+void free_subscription(struct Subscription* subscription) {
+
+    pthread_mutex_destroy(&subscription->lock);
+    free_good_set(&subscription->wanted);
+    free_good_set(&subscription->pending);
+    free(subscription);
+}
+
+/**
+ * Adds a good's ":q:t" to the update lines being built, starting a new
+ * "Update" line if the current one is full. Lines are separated by '\0'.
+ *
+ * @param lines: the lines being built
+ * @param start: where the current line starts, updated for a new line
+ * @param fragment: the good's ":q:t"
+ * @param length: the length of the fragment
+ */
+static void add_update(struct LineBuffer* lines, size_t* start,
+        const char* fragment, size_t length) {
+
+    if (lines->length > *start &&
+            lines->length - *start + length > FEED_LINE_LENGTH) {
+        append_line(lines, "%c", '\0');
+        *start = lines->length;
+    }
+    if (lines->length == *start) {
+        append_line(lines, "Update");
+    }
+    append_line(lines, "%.*s", (int)length, fragment);
+}
+
+/**
+ * Sends update lines, as built by add_update, to a subscriber.
+ *
+ * @param depot: the subscriber to send to
+ * @param lines: the lines to send
+ */
+static void send_updates(struct Depot* depot, struct LineBuffer* lines) {
+
+    size_t at = 0;
+    while (at < lines->length) {
+        size_t length = strlen(lines->data + at);
+        send_line_to_depot(depot, lines->data + at, length);
+        stat_add(STAT_FEED_UPDATES, 1);
+        at += length + 1;
+    }
+}
+
+/**
+ * Formats updates for the goods changed in this interval, once, to be
+ * shared by every subscriber: a ":q:t" fragment per good, found by its
+ * index in changed, and lines of all of them for subscribers to every good.
+ *
+ * @param inventory: the inventory the goods are in
+ * @param changed: the goods changed in this interval
+ * @param fragments: filled in with the goods' fragments, back to back
+ * @param offsets: filled in with where each fragment starts, and one past
+ *      the end of the last
+ * @param lines: filled in with update lines of every fragment
+ */
+static void format_changes(struct Inventory* inventory,
+        const struct GoodSet* changed, struct LineBuffer* fragments,
+        size_t* offsets, struct LineBuffer* lines) {
+
+    size_t start = 0;
+    for (uint32_t i = 0; i < changed->count; i++) {
+        uint32_t good = changed->goods[i];
+        offsets[i] = fragments->length;
+        append_line(fragments, ":%lld:%s",
+                (long long)read_stock(inventory, good), good_name(good));
+        add_update(lines, &start, fragments->data + offsets[i],
+                fragments->length - offsets[i]);
+    }
+    offsets[changed->count] = fragments->length;
+    if (lines->length > start) {
+        append_line(lines, "%c", '\0');
+    }
+}
+
+/**
+ * Sends a subscriber its updates for this interval. A subscriber to every
+ * good which is up to date is sent the shared lines as they are; others are
+ * sent lines of just the fragments they want. A subscriber which hasn't
+ * taken its last updates (see has_send_room) is sent nothing, and owed the
+ * goods it wants instead; once it catches up, it is sent each good it is
+ * owed once, with its latest quantity, however often it changed meanwhile.
+ * The lines are sent once the subscription is unlocked, so a new Subscribe
+ * from the neighbour never waits on them.
+ *
+ * @param depot: the subscriber
+ * @param inventory: the inventory subscribed to
+ * @param changed: the goods changed in this interval
+ * @param fragments: the changes' fragments (see format_changes)
+ * @param offsets: where each fragment starts
+ * @param shared: the changes' shared lines
+ * @param own: lines for just this subscriber (emptied and reused)
+ */
+static void update_subscriber(struct Depot* depot,
+        struct Inventory* inventory, const struct GoodSet* changed,
+        const struct LineBuffer* fragments, const size_t* offsets,
+        struct LineBuffer* shared, struct LineBuffer* own) {
+
+    struct Subscription* subscription = __atomic_load_n(
+            &depot->subscription, __ATOMIC_ACQUIRE);
+    if (subscription == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&subscription->lock);
+    if (!has_send_room(depot)) {
+        for (uint32_t i = 0; i < changed->count; i++) {
+            uint32_t good = changed->goods[i];
+            if (subscription->all ||
+                    good_set_has(&subscription->wanted, good)) {
+                good_set_add(&subscription->pending, good);
+                stat_add(STAT_FEED_HELD, 1);
+            }
+        }
+        pthread_mutex_unlock(&subscription->lock);
+        return;
+    }
+
+    struct LineBuffer* lines = shared;
+    if (!subscription->all || subscription->pending.count != 0) {
+        lines = own;
+        own->length = 0;
+        size_t start = 0;
+        for (uint32_t i = 0; i < changed->count; i++) {
+            uint32_t good = changed->goods[i];
+            if ((subscription->all ||
+                    good_set_has(&subscription->wanted, good)) &&
+                    !good_set_has(&subscription->pending, good)) {
+                add_update(own, &start, fragments->data + offsets[i],
+                        offsets[i + 1] - offsets[i]);
+            }
+        }
+        char fragment[FEED_LINE_LENGTH];
+        for (uint32_t i = 0; i < subscription->pending.count; i++) {
+            uint32_t good = subscription->pending.goods[i];
+            int length = snprintf(fragment, sizeof(fragment), ":%lld:%s",
+                    (long long)read_stock(inventory, good), good_name(good));
+            if (length < (int)sizeof(fragment)) {
+                add_update(own, &start, fragment, length);
+            }
+        }
+        good_set_clear(&subscription->pending);
+        if (own->length > start) {
+            append_line(own, "%c", '\0');
+        }
+    }
+    pthread_mutex_unlock(&subscription->lock);
+
+    send_updates(depot, lines);
+}
+
+/**
+ * Sends every subscriber of a depot its updates for this interval (see
+ * update_subscriber). The goods changed are taken from the feed first, so
+ * changes made while updates are sent are noted for the next interval.
+ *
+ * @param feed: the feed to send updates from
+ * @param inventory: the inventory the feed is for
+ * @param buffers: the fragments, shared lines and own lines, reused
+ */
+static void flush_feed(struct ChangeFeed* feed, struct Inventory* inventory,
+        struct LineBuffer* buffers) {
+
+    take_changes(feed);
+    const struct GoodSet* changed = &feed->changed;
+
+    size_t* offsets = malloc((changed->count + 1) * sizeof(size_t));
+    buffers[0].length = 0;
+    buffers[1].length = 0;
+    format_changes(inventory, changed, &buffers[0], offsets, &buffers[1]);
+
+    rcu_read_lock();
+    const struct NeighbourSet* set = read_neighbours(feed->thisDepot);
+    for (int i = 0; i < set->count; i++) {
+        update_subscriber(set->neighbours[i].depot, inventory, changed,
+                &buffers[0], offsets, &buffers[1], &buffers[2]);
+    }
+    rcu_read_unlock();
+    free(offsets);
+
+    good_set_clear(&feed->changed);
+}
+
+/**
+ * Thread function which sends subscribers their updates, once every
+ * DEPOT_FEED_MS. Subscribers all use credit flow, so sending to one which
+ * is slow holds its updates back rather than blocking this thread.
+ *
+ * @param arg: unused
+ * @return NULL (for thread function definition)
+ */
+static void* feed_thread(void* arg) {
+
+    place_thread(ROLE_WORKER);
+    int flushMs = get_config()->feedMs;
+    struct timespec pause = {flushMs / 1000, (flushMs % 1000) * 1000000L};
+    struct LineBuffer buffers[3];
+    for (int i = 0; i < 3; i++) {
+        init_line(&buffers[i]);
+    }
+    while (1) {
+        nanosleep(&pause, NULL);
+        for (struct Tenant* tenant = first_tenant(); tenant != NULL;
+                tenant = tenant->next) {
+            struct ChangeFeed* feed = tenant->inventory->feed;
+            if (feed != NULL &&
+                    __atomic_load_n(&feed->subscribers, __ATOMIC_RELAXED)) {
+                flush_feed(feed, tenant->inventory, buffers);
+            }
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Starts the thread which sends subscribers their updates, if feeds are
+ * on (DEPOT_FEED_MS is set). Must be called once in main, after the hosted
+ * depots are set up.
+ */
+void start_feeds(void) {
+
+    if (get_config()->feedMs <= 0) {
+        return;
+    }
+    pthread_t tid;
+    pthread_create(&tid, 0, feed_thread, NULL);
+    pthread_detach(tid);
+}
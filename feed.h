@@ -0,0 +1,84 @@
+#ifndef FEED_H
+#define FEED_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+struct LinkedList;
+struct Inventory;
+struct ConnectionWrapper;
+
+/**
+ * A set of goods, as a list in the order they were added, with a mark per
+ * good ID so each is only listed once.
+ */
+struct GoodSet {
+    uint32_t* goods;
+    uint32_t count;
+    uint32_t capacity;
+    uint8_t* marks;
+    uint32_t marksSize;
+};
+
+/**
+ * A set of goods as a bit per good ID, which goods can be added to (and
+ * taken from) with atomics, without a lock. Like an inventory's quantities
+ * (see inventory.h), the bits are kept in fixed size chunks found through a
+ * directory, and only adding chunks takes a lock; an outgrown directory is
+ * never freed, as a reader may still be using it.
+ */
+struct GoodBits {
+    uint64_t** chunks;
+    uint32_t chunkCount;
+    uint32_t directorySize;
+};
+
+/**
+ * The goods whose stock has changed in an inventory since its neighbours'
+ * subscriptions were last sent updates (dirty), and the goods any of them
+ * has subscribed to (wanted, which only grows). Changes are only noted
+ * while subscribers (the number of neighbours subscribed) is above 0, and
+ * only for wanted goods unless everything (the number subscribed to every
+ * good) is. Lock is only taken to add chunks to the bits. Changed is the
+ * feed thread's list of the goods it has taken from dirty.
+ */
+struct ChangeFeed {
+    pthread_mutex_t lock;
+    int subscribers;
+    int everything;
+    struct GoodBits dirty;
+    struct GoodBits wanted;
+    struct GoodSet changed;
+    struct LinkedList* thisDepot;
+};
+
+/**
+ * A neighbour's subscription to stock updates, for every good (all) or
+ * those in wanted, and the goods it is owed an update for which couldn't
+ * be sent when they changed (it was slow to take them), protected by lock.
+ * Unknown is how many of the goods wanted were first seen in its Subscribe
+ * messages (see DEPOT_FEED_MAX_GOODS).
+ */
+struct Subscription {
+    pthread_mutex_t lock;
+    bool all;
+    struct GoodSet wanted;
+    struct GoodSet pending;
+    uint32_t unknown;
+};
+
+struct ChangeFeed* new_change_feed(struct LinkedList* thisDepot);
+
+void start_feeds(void);
+
+void feed_changed(struct ChangeFeed* feed, uint32_t good);
+
+void handle_subscribe_message(char* message,
+        struct ConnectionWrapper* connection);
+
+void end_subscription(struct ConnectionWrapper* connection);
+
+void free_subscription(struct Subscription* subscription);
+
+#endif //FEED_H
@@ -0,0 +1,234 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "intern.h"
+
+#define INITIAL_INTERN_SLOTS 64
+#define GOODS_PER_CHUNK 1024
+#define MAX_GOOD_CHUNKS 65536
+#define NAME_BLOCK_SIZE 65536
+
+// The current table, replaced (under internLock) when it fills up
+static struct InternTable* internTable = NULL;
+
+// Names by ID, in chunks which never move once allocated
+static const char** nameChunks[MAX_GOOD_CHUNKS];
+
+// The block names are currently copied into, and the room left in it
+static char* nameBlock = NULL;
+static size_t nameBlockLeft = 0;
+
+// The number of goods interned so far (which is also the next ID), and the
+// memory taken by the table, name chunks and name blocks
+static uint32_t goodCount = 0;
+static size_t internBytes = 0;
+
+// Held while interning a new good
+static pthread_mutex_t internLock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Hashes a good name (FNV-1a).
+ *
+ * @param name: the name to hash
+ * @return the hash of the name
+ */
+static uint32_t hash_name(const char* name) {
+
+    uint32_t hash = 2166136261u;
+    for (; *name != '\0'; name++) {
+        hash = (hash ^ (unsigned char)*name) * 16777619u;
+    }
+
+    return hash;
+}
+
+/**
+ * Creates an empty intern table.
+ *
+ * @param size: the number of slots, a power of 2
+ * @return the new table
+ */
+static struct InternTable* new_intern_table(uint32_t size) {
+
+    struct InternTable* table = malloc(sizeof(struct InternTable));
+    table->mask = size - 1;
+    table->slots = calloc(size, sizeof(uint32_t));
+    internBytes += sizeof(struct InternTable) + sizeof(uint32_t) * size;
+
+    return table;
+}
+
+/**
+ * Searches a table for a good, without a lock.
+ *
+ * @param table: the table to search
+ * @param name: the name of the good
+ * @param hash: the hash of the name
+ * @return the good's ID, or NO_GOOD if it isn't in the table
+ */
+static uint32_t search_table(struct InternTable* table, const char* name,
+        uint32_t hash) {
+
+    for (uint32_t i = hash & table->mask; ; i = (i + 1) & table->mask) {
+        uint32_t slot = __atomic_load_n(&table->slots[i], __ATOMIC_ACQUIRE);
+        if (slot == 0) {
+            return NO_GOOD;
+        }
+        if (strcmp(good_name(slot - 1), name) == 0) {
+            return slot - 1;
+        }
+    }
+}
+
+/**
+ * Puts a good in the first free slot for it.
+ *
+ * @param table: the table to add to (internLock must be held)
+ * @param good: the ID of the good to add
+ */
+static void insert_good(struct InternTable* table, uint32_t good) {
+
+    uint32_t i = hash_name(good_name(good)) & table->mask;
+    while (table->slots[i] != 0) {
+        i = (i + 1) & table->mask;
+    }
+
+    // readers may be probing this table, so the good is published last
+    __atomic_store_n(&table->slots[i], good + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Replaces the table with one twice the size, holding the same goods.
+ * The old table is left for any reader still searching it.
+ */
+static void grow_table(void) {
+
+    struct InternTable* table = new_intern_table((internTable->mask + 1) * 2);
+    for (uint32_t i = 0; i <= internTable->mask; i++) {
+        if (internTable->slots[i] != 0) {
+            insert_good(table, internTable->slots[i] - 1);
+        }
+    }
+
+    __atomic_store_n(&internTable, table, __ATOMIC_RELEASE);
+}
+
+/**
+ * Copies a name into the pool, starting a new block if the current one
+ * doesn't have room (names too long for a block get one of their own).
+ *
+ * @param name: the name to copy (internLock must be held)
+ * @return the pooled copy
+ */
+static const char* pool_name(const char* name) {
+
+    size_t size = strlen(name) + 1;
+    if (size > nameBlockLeft) {
+        size_t blockSize = size > NAME_BLOCK_SIZE ? size : NAME_BLOCK_SIZE;
+        nameBlock = malloc(blockSize);
+        nameBlockLeft = blockSize;
+        internBytes += blockSize;
+    }
+
+    char* copy = nameBlock;
+    memcpy(copy, name, size);
+    nameBlock += size;
+    nameBlockLeft -= size;
+
+    return copy;
+}
+
+/**
+ * Gets the ID of a good, giving it the next ID if it hasn't been seen
+ * before. Goods already interned are found without a lock.
+ *
+ * @param name: the name of the good
+ * @return the good's ID, or NO_GOOD if there is no room for more goods
+ */
+uint32_t intern_good(const char* name) {
+
+    uint32_t good = find_good(name);
+    if (good != NO_GOOD) {
+        return good;
+    }
+
+    pthread_mutex_lock(&internLock);
+
+    if (internTable == NULL) {
+        internTable = new_intern_table(INITIAL_INTERN_SLOTS);
+    }
+
+    // another thread may have interned it since we looked
+    good = search_table(internTable, name, hash_name(name));
+    if (good != NO_GOOD) {
+        pthread_mutex_unlock(&internLock);
+        return good;
+    }
+
+    good = goodCount;
+    if (good / GOODS_PER_CHUNK == MAX_GOOD_CHUNKS) {
+        pthread_mutex_unlock(&internLock);
+        return NO_GOOD;
+    }
+
+    const char*** chunk = &nameChunks[good / GOODS_PER_CHUNK];
+    if (*chunk == NULL) {
+        *chunk = malloc(sizeof(const char*) * GOODS_PER_CHUNK);
+        internBytes += sizeof(const char*) * GOODS_PER_CHUNK;
+    }
+    (*chunk)[good % GOODS_PER_CHUNK] = pool_name(name);
+    __atomic_store_n(&goodCount, good + 1, __ATOMIC_RELAXED);
+
+    // keep the table at most half full, so probes stay short
+    if (goodCount * 2 > internTable->mask + 1) {
+        grow_table();
+    }
+    insert_good(internTable, good);
+
+    pthread_mutex_unlock(&internLock);
+    return good;
+}
+
+/**
+ * Gets the ID of a good without interning it, and without a lock.
+ *
+ * @param name: the name of the good
+ * @return the good's ID, or NO_GOOD if it has never been interned
+ */
+uint32_t find_good(const char* name) {
+
+    struct InternTable* table = __atomic_load_n(&internTable,
+            __ATOMIC_ACQUIRE);
+    if (table == NULL) {
+        return NO_GOOD;
+    }
+
+    return search_table(table, name, hash_name(name));
+}
+
+/**
+ * Gets the name of an interned good.
+ *
+ * @param good: the ID of the good, as returned by intern_good
+ * @return the good's name, valid for as long as the process runs
+ */
+const char* good_name(uint32_t good) {
+    return nameChunks[good / GOODS_PER_CHUNK][good % GOODS_PER_CHUNK];
+}
+
+/**
+ * Gets the memory taken by interned goods: tables (including outgrown
+ * ones), names and the index of names by ID.
+ *
+ * @param goods: where the number of goods interned is written
+ * @return the memory taken, in bytes
+ */
+size_t intern_memory(uint32_t* goods) {
+
+    pthread_mutex_lock(&internLock);
+    *goods = goodCount;
+    size_t bytes = internBytes;
+    pthread_mutex_unlock(&internLock);
+
+    return bytes;
+}
@@ -0,0 +1,34 @@
+#ifndef INTERN_H
+#define INTERN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// The ID given when a good is unknown, or can't be interned
+#define NO_GOOD UINT32_MAX
+
+/**
+ * A hash table of interned goods (open addressing, linear probing), whose
+ * slots hold each good's ID plus 1, so 0 marks an empty slot. IDs are dense
+ * (0, 1, 2, ...) in the order goods are first seen, and shared by every
+ * depot in the process. Names are kept in a pool of large blocks, and are
+ * never freed, so names and IDs stay valid for as long as the process runs.
+ *
+ * A full table is replaced with one twice the size; readers search
+ * whichever table they loaded without a lock, so an outgrown table is never
+ * freed.
+ */
+struct InternTable {
+    uint32_t mask;
+    uint32_t* slots;
+};
+
+uint32_t intern_good(const char* name);
+
+uint32_t find_good(const char* name);
+
+const char* good_name(uint32_t good);
+
+size_t intern_memory(uint32_t* goods);
+
+#endif //INTERN_H
@@ -0,0 +1,399 @@
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include "inventory.h"
+#include "intern.h"
+#include "replica.h"
+#include "feed.h"
+
+#define INITIAL_DIRECTORY_SIZE 16
+#define SNAPSHOT_RETRIES 4
+#define CACHE_LINE_SIZE 64
+
+// Stripes are given to threads in turn, as each first changes stock
+static uint32_t nextStripe = 0;
+static __thread int threadStripe = -1;
+
+/**
+ * Gets the slot holding a good's quantity, without a lock.
+ *
+ * @param inventory: the inventory holding the good
+ * @param good: the interned ID of the good, which must be below the count
+ *      the caller loaded
+ * @return a pointer to the good's quantity
+ */
+static int64_t* find_slot(struct Inventory* inventory, uint32_t good) {
+
+    int64_t** chunks = __atomic_load_n(&inventory->chunks, __ATOMIC_ACQUIRE);
+    return &chunks[good / INVENTORY_CHUNK_SIZE][good % INVENTORY_CHUNK_SIZE];
+}
+
+/**
+ * Adds chunks to an inventory until it has a slot for a good, growing the
+ * directory first if it is full.
+ *
+ * @param inventory: the inventory to grow (growLock must be held)
+ * @param good: the good which needs a slot
+ */
+static void add_chunks(struct Inventory* inventory, uint32_t good) {
+
+    uint32_t needed = good / INVENTORY_CHUNK_SIZE + 1;
+
+    if (needed > inventory->directorySize) {
+        uint32_t size = inventory->directorySize;
+        while (size < needed) {
+            size *= 2;
+        }
+
+        int64_t** chunks = malloc(sizeof(int64_t*) * size);
+        memcpy(chunks, inventory->chunks,
+                sizeof(int64_t*) * inventory->chunkCount);
+        __atomic_store_n(&inventory->chunks, chunks, __ATOMIC_RELEASE);
+        inventory->directorySize = size;
+    }
+
+    for (uint32_t i = inventory->chunkCount; i < needed; i++) {
+        inventory->chunks[i] = calloc(INVENTORY_CHUNK_SIZE, sizeof(int64_t));
+    }
+    inventory->chunkCount = needed;
+}
+
+/**
+ * Creates an empty inventory.
+ * @return the new inventory
+ */
+struct Inventory* new_inventory(void) {
+
+    struct Inventory* inventory = malloc(sizeof(struct Inventory));
+    inventory->count = 0;
+    inventory->chunkCount = 0;
+    inventory->directorySize = INITIAL_DIRECTORY_SIZE;
+    inventory->chunks = malloc(sizeof(int64_t*) * INITIAL_DIRECTORY_SIZE);
+    pthread_mutex_init(&inventory->growLock, NULL);
+    void* stripes;
+    posix_memalign(&stripes, CACHE_LINE_SIZE,
+            sizeof(struct ChangeStripe) * CHANGE_STRIPES);
+    memset(stripes, 0, sizeof(struct ChangeStripe) * CHANGE_STRIPES);
+    inventory->stripes = stripes;
+    inventory->frozen = 0;
+    pthread_mutex_init(&inventory->snapshotLock, NULL);
+    inventory->log = NULL;
+    inventory->feed = NULL;
+
+    return inventory;
+}
+
+/**
+ * Frees an inventory, once nothing can read it.
+ * @param inventory: the inventory to free
+ */
+void free_inventory(struct Inventory* inventory) {
+
+    for (uint32_t i = 0; i < inventory->chunkCount; i++) {
+        free(inventory->chunks[i]);
+    }
+    free(inventory->chunks);
+    free(inventory->stripes);
+    pthread_mutex_destroy(&inventory->growLock);
+    pthread_mutex_destroy(&inventory->snapshotLock);
+    free(inventory);
+}
+
+/**
+ * Counts a change as started, on the calling thread's stripe, so snapshots
+ * copied meanwhile are retried (see snapshot_stock). While a snapshot has
+ * the inventory frozen, the change is backed out of and waits for the
+ * snapshot to finish.
+ *
+ * @param inventory: the inventory about to be changed
+ * @return the stripe the change is counted on, to finish it on
+ */
+static struct ChangeStripe* begin_change(struct Inventory* inventory) {
+
+    if (threadStripe < 0) {
+        threadStripe = __atomic_fetch_add(&nextStripe, 1, __ATOMIC_RELAXED) %
+                CHANGE_STRIPES;
+    }
+    struct ChangeStripe* stripe = &inventory->stripes[threadStripe];
+
+    while (1) {
+        __atomic_fetch_add(&stripe->started, 1, __ATOMIC_SEQ_CST);
+        if (!__atomic_load_n(&inventory->frozen, __ATOMIC_SEQ_CST)) {
+            // the count is seen before the change, as in a seqlock
+            __atomic_thread_fence(__ATOMIC_RELEASE);
+            return stripe;
+        }
+        __atomic_fetch_add(&stripe->finished, 1, __ATOMIC_RELEASE);
+        pthread_mutex_lock(&inventory->snapshotLock);
+        pthread_mutex_unlock(&inventory->snapshotLock);
+    }
+}
+
+/**
+ * Counts a change as finished, publishing it to snapshots.
+ * @param stripe: the stripe the change was started on
+ */
+static void end_change(struct ChangeStripe* stripe) {
+    __atomic_fetch_add(&stripe->finished, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Adds to the quantity of a good. Goods the depot already has are changed
+ * with an atomic add, without a lock; a good the depot hasn't had is added
+ * to the inventory under its growLock. Either way the change is counted
+ * (see begin_change), so snapshots see all of it or none of it.
+ *
+ * @param inventory: the inventory to change
+ * @param good: the interned ID of the good
+ * @param amount: the amount to add, or to subtract if negative
+ */
+static void add_stock(struct Inventory* inventory, uint32_t good,
+        int64_t amount) {
+
+    struct ChangeStripe* stripe = begin_change(inventory);
+
+    // the count is stored after the chunks it covers, so they are there
+    if (good < __atomic_load_n(&inventory->count, __ATOMIC_ACQUIRE)) {
+        __atomic_fetch_add(find_slot(inventory, good), amount,
+                __ATOMIC_RELAXED);
+        end_change(stripe);
+        return;
+    }
+
+    pthread_mutex_lock(&inventory->growLock);
+
+    if (good / INVENTORY_CHUNK_SIZE >= inventory->chunkCount) {
+        add_chunks(inventory, good);
+    }
+    __atomic_fetch_add(find_slot(inventory, good), amount, __ATOMIC_RELAXED);
+    if (good >= inventory->count) {
+        __atomic_store_n(&inventory->count, good + 1, __ATOMIC_RELEASE);
+    }
+
+    pthread_mutex_unlock(&inventory->growLock);
+    end_change(stripe);
+}
+
+/**
+ * Changes the quantity of a good (see add_stock). If the depot keeps a
+ * replication log, the change is added to it, under the log's read lock,
+ * so a snapshot (under the write lock) sees every logged change, and no
+ * others. The inventory's change feed, if it has one, is then told.
+ *
+ * @param inventory: the inventory to change
+ * @param good: the interned ID of the good
+ * @param amount: the amount to add, or to subtract if negative
+ */
+void change_stock(struct Inventory* inventory, uint32_t good,
+        int64_t amount) {
+
+    struct ReplLog* log = inventory->log;
+    if (log == NULL) {
+        add_stock(inventory, good, amount);
+    } else {
+        pthread_rwlock_rdlock(&log->lock);
+        add_stock(inventory, good, amount);
+        repl_append(log, good, amount);
+        pthread_rwlock_unlock(&log->lock);
+    }
+
+    if (inventory->feed != NULL) {
+        feed_changed(inventory->feed, good);
+    }
+}
+
+/**
+ * Reads the quantity of one good, without a lock.
+ *
+ * @param inventory: the inventory to read
+ * @param good: the interned ID of the good to read
+ * @return the good's quantity, or 0 if the depot has never had it
+ */
+int64_t read_stock(struct Inventory* inventory, uint32_t good) {
+
+    if (good >= __atomic_load_n(&inventory->count, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+
+    return __atomic_load_n(find_slot(inventory, good), __ATOMIC_RELAXED);
+}
+
+/**
+ * Copies the quantity of every good the depot has had, straight through
+ * each chunk, so full scans run at memory speed.
+ *
+ * @param inventory: the inventory to copy
+ * @param output: where a pointer to the copied quantities is written
+ * @return the number of quantities copied
+ */
+static uint32_t copy_stock(struct Inventory* inventory, int64_t** output) {
+
+    uint32_t count = __atomic_load_n(&inventory->count, __ATOMIC_ACQUIRE);
+    int64_t** chunks = __atomic_load_n(&inventory->chunks, __ATOMIC_ACQUIRE);
+    int64_t* copy = malloc(sizeof(int64_t) * (count == 0 ? 1 : count));
+
+    for (uint32_t start = 0; start < count; start += INVENTORY_CHUNK_SIZE) {
+        int64_t* chunk = chunks[start / INVENTORY_CHUNK_SIZE];
+        uint32_t length = count - start < INVENTORY_CHUNK_SIZE ?
+                count - start : INVENTORY_CHUNK_SIZE;
+        for (uint32_t i = 0; i < length; i++) {
+            copy[start + i] = __atomic_load_n(&chunk[i], __ATOMIC_RELAXED);
+        }
+    }
+
+    *output = copy;
+    return count;
+}
+
+/**
+ * Counts the changes to an inventory started so far, on every stripe.
+ *
+ * @param inventory: the inventory to check
+ * @return the number of changes started
+ */
+static uint64_t changes_started(struct Inventory* inventory) {
+
+    uint64_t started = 0;
+    for (int i = 0; i < CHANGE_STRIPES; i++) {
+        started += __atomic_load_n(&inventory->stripes[i].started,
+                __ATOMIC_SEQ_CST);
+    }
+    return started;
+}
+
+/**
+ * Checks whether any change to an inventory is in progress.
+ *
+ * @param inventory: the inventory to check
+ * @param started: where the number of changes started so far is written
+ * @return true if every change started has finished, false otherwise
+ */
+static bool changes_finished(struct Inventory* inventory,
+        uint64_t* started) {
+
+    // finished is read first: as no stripe's started ever falls behind its
+    // finished, equal totals mean nothing was in progress on any stripe
+    // when its finished was read
+    uint64_t finished = 0;
+    for (int i = 0; i < CHANGE_STRIPES; i++) {
+        finished += __atomic_load_n(&inventory->stripes[i].finished,
+                __ATOMIC_ACQUIRE);
+    }
+    *started = changes_started(inventory);
+    return *started == finished;
+}
+
+/**
+ * Copies the quantity of every good the depot has had, as of a single
+ * moment, without a lock. The copy is made when no change is in progress,
+ * and is only kept if no change started while it was being made, so it
+ * holds every change made before that moment and none after. After
+ * SNAPSHOT_RETRIES tries spoiled by changes, the inventory is frozen (see
+ * begin_change) for one last copy, so a busy depot still gets its
+ * snapshot.
+ *
+ * @param inventory: the inventory to copy
+ * @param output: where a pointer to the copied quantities, indexed by good
+ *      ID, is written (to be freed by the caller)
+ * @return the number of quantities copied
+ */
+uint32_t snapshot_stock(struct Inventory* inventory, int64_t** output) {
+
+    uint64_t started;
+    for (int attempt = 0; attempt < SNAPSHOT_RETRIES; attempt++) {
+        if (!changes_finished(inventory, &started)) {
+            sched_yield();
+            continue;
+        }
+        uint32_t count = copy_stock(inventory, output);
+
+        // pairs with the fence in begin_change, so a change whose quantity
+        // was copied can't go unnoticed
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (changes_started(inventory) == started) {
+            return count;
+        }
+        free(*output);
+    }
+
+    pthread_mutex_lock(&inventory->snapshotLock);
+    __atomic_store_n(&inventory->frozen, 1, __ATOMIC_SEQ_CST);
+    while (!changes_finished(inventory, &started)) {
+        sched_yield();
+    }
+    uint32_t count = copy_stock(inventory, output);
+    __atomic_store_n(&inventory->frozen, 0, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&inventory->snapshotLock);
+
+    return count;
+}
+
+/**
+ * Compares two stock entries by name, for sorting.
+ *
+ * @param first: the first entry
+ * @param second: the second entry
+ * @return the string comparison of the two names
+ */
+static int compare_stock_entries(const void* first, const void* second) {
+
+    return strcmp(good_name(((const struct StockEntry*)first)->good),
+            good_name(((const struct StockEntry*)second)->good));
+}
+
+/**
+ * Lists every good with a non-zero quantity, in lexicographic order,
+ * without the depot's lock, as of a single moment (see snapshot_stock).
+ *
+ * @param inventory: the inventory to list
+ * @param output: where a pointer to the listed entries is written (to be
+ *      freed by the caller)
+ * @return the number of entries listed
+ */
+uint32_t list_stock(struct Inventory* inventory, struct StockEntry** output) {
+
+    int64_t* quantities;
+    uint32_t count = snapshot_stock(inventory, &quantities);
+
+    uint32_t stocked = 0;
+    for (uint32_t good = 0; good < count; good++) {
+        stocked += quantities[good] != 0;
+    }
+
+    struct StockEntry* entries = malloc(sizeof(struct StockEntry) *
+            (stocked == 0 ? 1 : stocked));
+    stocked = 0;
+    for (uint32_t good = 0; good < count; good++) {
+        if (quantities[good] != 0) {
+            entries[stocked].good = good;
+            entries[stocked].quantity = quantities[good];
+            stocked++;
+        }
+    }
+    free(quantities);
+
+    qsort(entries, stocked, sizeof(struct StockEntry),
+            compare_stock_entries);
+
+    *output = entries;
+    return stocked;
+}
+
+/**
+ * Gets the memory an inventory's chunks and directory take up.
+ *
+ * @param inventory: the inventory to measure
+ * @param goods: where the number of goods the depot has had is written
+ * @return the size of the inventory's chunks and directory, in bytes
+ */
+size_t inventory_memory(struct Inventory* inventory, uint32_t* goods) {
+
+    pthread_mutex_lock(&inventory->growLock);
+    *goods = inventory->count;
+    size_t bytes = sizeof(int64_t) * INVENTORY_CHUNK_SIZE *
+            inventory->chunkCount + sizeof(int64_t*) *
+            inventory->directorySize;
+    pthread_mutex_unlock(&inventory->growLock);
+
+    return bytes;
+}
@@ -0,0 +1,92 @@
+#ifndef INVENTORY_H
+#define INVENTORY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+struct ReplLog;
+struct ChangeFeed;
+
+// The number of quantities in each chunk of an inventory
+#define INVENTORY_CHUNK_SIZE 1024
+
+// The number of stripes an inventory's change counts are spread over
+#define CHANGE_STRIPES 16
+
+/**
+ * Counts of the changes started and finished by the threads given a
+ * stripe, alone on a cache line so threads on other stripes don't contend
+ * for it.
+ */
+struct ChangeStripe {
+    uint64_t started;
+    uint64_t finished;
+    char pad[48];
+};
+
+/**
+ * A depot's stock of goods, as dense arrays of quantities indexed by good
+ * ID (see intern.h); names are kept once, in the intern table. The arrays
+ * are fixed size chunks, found through a directory, so a quantity never
+ * moves once it has a slot. Count covers every good the depot has had, and
+ * slots past it are 0.
+ *
+ * Quantities of goods the depot already has are changed with an atomic
+ * add, without a lock. Only adding a good the depot hasn't had takes
+ * growLock, to add chunks (and grow the directory if needed). Readers may
+ * still be using an outgrown directory, so it is never freed; as it holds
+ * only a pointer per chunk, and doubles each time, those kept add up to
+ * less than the current one.
+ *
+ * Every change is counted as started before it is made, and as finished
+ * after, so snapshot_stock can tell whether any change was made while it
+ * copied the quantities, and copy them again if so. The counts are spread
+ * over CHANGE_STRIPES stripes, a thread always counting on the same one,
+ * and snapshots add them up. A
+ * snapshot which keeps losing that race sets frozen, holding new changes
+ * back (on snapshotLock) until it has its copy.
+ *
+ * If the depot is a replication primary, log is the replication log every
+ * change is added to (see replica.h), or NULL otherwise. If neighbours can
+ * subscribe to its changes, feed is told of every change (see feed.h), or
+ * is NULL otherwise.
+ */
+struct Inventory {
+    int64_t** chunks;
+    uint32_t count;
+    uint32_t chunkCount;
+    uint32_t directorySize;
+    pthread_mutex_t growLock;
+    struct ChangeStripe* stripes;
+    int frozen;
+    pthread_mutex_t snapshotLock;
+    struct ReplLog* log;
+    struct ChangeFeed* feed;
+};
+
+/**
+ * A good (by interned ID) and its quantity, as listed from an inventory.
+ */
+struct StockEntry {
+    uint32_t good;
+    int64_t quantity;
+};
+
+struct Inventory* new_inventory(void);
+
+void free_inventory(struct Inventory* inventory);
+
+void change_stock(struct Inventory* inventory, uint32_t good,
+        int64_t amount);
+
+int64_t read_stock(struct Inventory* inventory, uint32_t good);
+
+uint32_t snapshot_stock(struct Inventory* inventory, int64_t** output);
+
+uint32_t list_stock(struct Inventory* inventory, struct StockEntry** output);
+
+size_t inventory_memory(struct Inventory* inventory, uint32_t* goods);
+
+#endif //INVENTORY_H
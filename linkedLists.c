@@ -71,6 +71,30 @@ struct LinkedList* add_item(struct LinkedList* first) {
     return current->next;
 }
 
+/**
+ * Removes an item from a given linked list, without freeing it. The first
+ * item in the list can't be removed.
+ *
+ * @param first: the first item in the linked list to remove from
+ * @param item: the item to remove
+ * @return true if the item was found and removed, false otherwise
+ */
+bool remove_item(struct LinkedList* first, struct LinkedList* item) {
+
+    struct LinkedList* node = first;
+    while (node->next != NULL) { // process all nodes
+
+        if (node->next == item) {
+            node->next = item->next;
+            item->next = NULL;
+            return true;
+        }
+        node = node->next;
+    }
+
+    return false;
+}
+
 /**
  * Searches a linked list for a specific item with a given name, and returns a
  * pointer to that item.
@@ -6,6 +6,17 @@
 #include <semaphore.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+
+struct ShmLink;
+struct UringConn;
+struct HeldLine;
+struct MemBudget;
+struct NeighbourSet;
+struct Inventory;
+struct Coalescer;
+struct Subscription;
 
 /**
  * Struct which describes a single deferred operation to be handled later.
@@ -18,33 +29,58 @@ struct Deferral {
     bool executed;
 };
 
-/**
- * Struct which describes a single resource for this depot. Any amount
- * of resources could exist for a single depot.
- */
-struct Resource {
-    int quantity;
-};
-
 /**
  * Struct which describes an existing connection between this depot and
- * another, including information about the other depot, and the streams
- * to contact that depot with.
+ * another, including information about the other depot, and the streams to
+ * contact that depot with. Once a shared memory link is set up, messages to
+ * the depot are sent on it instead of the to stream. With the io_uring engine,
+ * messages are sent by the engine instead of the to stream. With flow control,
+ * messages are held back while the depot has no credits. Budget is the memory
+ * budget of the connection to the depot. Closed is set (under the send lock)
+ * once the connection is torn down, after which nothing more is sent. Traced
+ * is set if the depot takes trace context ahead of messages (see tracing.h).
+ * When coalescing, coalesced holds the Delivers waiting to be sent to the
+ * depot (see coalesce.h). Once the depot subscribes to stock updates,
+ * subscription says which (see feed.h). For this depot (first in the list),
+ * neighbours is the published snapshot of the rest of the list. With state
+ * sync, mirror is the depot's stock as it sent it after connecting,
+ * mirrorGoods the number of goods received so far, and mirrorState where the
+ * sync has got to (see sync.h). Room is signalled (under the send lock) when
+ * held messages have all been sent, or the depot is closed, for bulk senders
+ * waiting to send more (see wait_for_send_room).
  */
 struct Depot {
     char* port;
+    bool unixCapable;
     FILE* to;
     FILE* from;
+    pthread_mutex_t sendLock;
+    struct ShmLink* shm;
+    struct UringConn* uring;
+    bool creditFlow;
+    int credits;
+    struct HeldLine* heldFirst;
+    struct HeldLine* heldLast;
+    struct MemBudget* budget;
+    bool closed;
+    bool traced;
+    struct Coalescer* coalesced;
+    struct Subscription* subscription;
+    struct NeighbourSet* neighbours;
+    struct Inventory* mirror;
+    uint32_t mirrorGoods;
+    int mirrorState;
+    pthread_cond_t room;
     pthread_t readerId;
     pthread_t writerId;
 };
 
 /**
- * Union which allows both a resource and depot type struct to be identified
- * as a LinkedList struct. These types are mutually exclusive.
+ * Union which allows both a depot and deferral type struct to be identified
+ * as a LinkedList struct. These types are mutually exclusive. (A depot's
+ * resources are kept in its inventory, see inventory.h.)
  */
 union Type {
-    struct Resource resource;
     struct Depot depot;
     struct Deferral deferral;
 };
@@ -70,6 +106,8 @@ int count_items_in_list(struct LinkedList* first);
 
 struct LinkedList* add_item(struct LinkedList* first);
 
+bool remove_item(struct LinkedList* first, struct LinkedList* item);
+
 struct LinkedList* search_list_by_name(char* search,
         struct LinkedList* firstItem);
 
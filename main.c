@@ -7,11 +7,27 @@
 #include "linkedLists.h"
 #include "network.h"
 #include "util.h"
+#include "config.h"
+#include "budget.h"
+#include "stats.h"
+#include "tenant.h"
+#include "inventory.h"
+#include "intern.h"
+#include "rcu.h"
+#include "neighbours.h"
+#include "replica.h"
+#include "sched.h"
+#include "placement.h"
+#include "capture.h"
+#include "tracing.h"
+#include "coalesce.h"
+#include "feed.h"
 
 #define MIN_ARGS 2
 #define NUM_ARG_ERR 1
 #define NAME_ERR 2
 #define QUANTITY_ERR 3
+#define GOODS_ERR 4
 
 // Global Boolean Variable to detect SIGHUP
 bool sigHupDetected = false;
@@ -19,6 +35,9 @@ bool sigHupDetected = false;
 // Global Boolean Variable to detect SIGPIPE
 bool sigPipeDetected = false;
 
+// Global Boolean Variable to detect SIGUSR1
+bool sigUsr1Detected = false;
+
 /**
  * Signal handler for SIGHUP signal, which sets global flag
  * for the displaying of depot data.
@@ -39,64 +58,64 @@ void handle_sigpipe(int signalNum) {
     sigPipeDetected = true;
 }
 
+/**
+ * Signal handler for SIGUSR1 signal, which sets global flag
+ * for the displaying of depot stats.
+ *
+ * @param signalNum: parameter in case of multiple signals
+ */
+void handle_sigusr1(int signalNum) {
+    sigUsr1Detected = true;
+}
+
 /**
  * Displays this depot's current stock of (non-zero) goods in
  * lexicographic order, and the connected neighbours of this
- * depot in lexicographic order, to stdout.
+ * depot in lexicographic order, to stdout. Neither needs the depot's
+ * lock: goods are copied from the inventory, and neighbours come from the
+ * published neighbour set.
  *
  * @param thisDepot: start of linked list of all connected depots
- * @param firstResource: start of linked list of all resources
+ * @param inventory: this depot's inventory
  */
 void display_depot_data(struct LinkedList* thisDepot,
-        struct LinkedList* firstResource) {
-
-    struct LinkedList* node;
-    char** goodNames;
-    int quantity;
-    char** neighbours;
-    int goodCount, neighbourCount = 0;
-
-    printf("Goods:\n"); // create goods list for sorting
-    goodCount = count_items_in_list(firstResource);
-    goodNames = malloc(sizeof(char*) * goodCount);
-
-    node = firstResource;
-    for (int i = 0; i < goodCount; i++) {
-        goodNames[i] = node->name;
-        node = node->next;
-    }
-
-    qsort(goodNames, goodCount, sizeof(char*), string_compare);
-    for (int i = 0; i < goodCount; i++) {
-        node = search_list_by_name(goodNames[i], firstResource);
-        quantity = node->type.resource.quantity;
-        if (quantity != 0) {
-            printf("%s %i\n", goodNames[i], quantity);
-        }
+        struct Inventory* inventory) {
+
+    struct StockEntry* goods;
+    uint32_t goodCount;
+    const char** neighbours;
+    int neighbourCount = 0;
+
+    printf("Goods:\n"); // list comes sorted, without zero quantities
+    goodCount = list_stock(inventory, &goods);
+    for (uint32_t i = 0; i < goodCount; i++) {
+        printf("%s %lld\n", good_name(goods[i].good),
+                (long long)goods[i].quantity);
     }
+    free(goods);
 
+    rcu_read_lock();
+    const struct NeighbourSet* neighbourSet = read_neighbours(thisDepot);
     printf("Neighbours:\n"); // create neighbours list for sorting
-    neighbourCount = count_items_in_list(thisDepot) - 1;
-    neighbours = malloc(sizeof(char*) * neighbourCount);
+    neighbourCount = neighbourSet->count;
     if (neighbourCount < 1) {
+        rcu_read_unlock();
         fflush(stdout); // exit early if no neighbours to process
         return;
     }
 
-    node = thisDepot;
-    node = node->next;
+    neighbours = malloc(sizeof(char*) * neighbourCount);
     for (int i = 0; i < neighbourCount; i++) {
-        neighbours[i] = node->name;
-        node = node->next;
+        neighbours[i] = neighbourSet->neighbours[i].name;
     }
 
     qsort(neighbours, neighbourCount, sizeof(char*), string_compare);
     for (int i = 0; i < neighbourCount; i++) {
         printf("%s\n", neighbours[i]);
     }
+    rcu_read_unlock();
 
     fflush(stdout);
-    free(goodNames);
     free(neighbours);
 }
 
@@ -121,6 +140,10 @@ void display_err(int status) {
             fprintf(stderr, "Invalid quantity\n");
             break;
 
+        case GOODS_ERR:
+            fprintf(stderr, "Too many goods\n");
+            break;
+
         default:
             return;
     }
@@ -189,53 +212,119 @@ int check_args(int argc, char* argv[]) {
 
 /**
  * Parses from the commandline, this depot's name, and any resource
- * names and their quantities, if given, into relevant linkedList structs.
+ * names and their quantities, if given, into the depot's list and
+ * inventory.
  *
  * @param argc: the number of command line args
  * @param argv: the command line args
  * @param thisDepot: the first depot in the list (this one)
- * @param firstResource: the first resource in the list
+ * @param inventory: this depot's inventory
+ * @return GOODS_ERR if a resource couldn't be interned (there is no room
+ *      for more goods), 0 otherwise
  */
-void set_args(int argc, char* argv[], struct LinkedList* thisDepot,
-        struct LinkedList* firstResource, struct LinkedList* firstDeferral) {
+int set_args(int argc, char* argv[], struct LinkedList* thisDepot,
+        struct Inventory* inventory, struct LinkedList* firstDeferral) {
 
     // set depot name and thread safety info
     thisDepot->name = argv[1];
-    firstResource->name = "XXXX";
-    firstResource->type.resource.quantity = 0;
 
     firstDeferral->type.deferral.executed = true;
     firstDeferral->type.deferral.key = -1;
     firstDeferral->name = "first";
 
-    // check resources have been defined
-    if (argc < 3) {
-        return;
+    // stock each resource given, as name and quantity pairs (start at 3rd
+    // arg for the first resource)
+    for (int i = 2; i + 1 < argc; i += 2) {
+        uint32_t good = intern_good(argv[i]);
+        if (good == NO_GOOD) {
+            return GOODS_ERR;
+        }
+        change_stock(inventory, good, atoi(argv[i + 1]));
     }
 
-    // set name and quantity for the first resource
-    firstResource->name = argv[2];
-    firstResource->type.resource.quantity = atoi(argv[3]);
+    return 0;
+}
 
-    // create new list entries and assign values for all other resources
-    // (start at 4th arg for first additional resource)
-    struct LinkedList* newResource;
-    for (int i = 4; i < argc; i++) {
+/**
+ * Splits the arguments for a hosted depot (as given in DEPOT_TENANTS) into
+ * an argument array in the format of 2310depot's own command line.
+ *
+ * @param spec: the depot's arguments, separated by spaces (modified, and
+ *      pointed into by the array)
+ * @param argc: where the number of arguments is written
+ * @return the argument array, starting with the program name
+ */
+char** split_tenant_args(char* spec, int* argc) {
+
+    int capacity = MIN_ARGS;
+    char** argv = malloc(sizeof(char*) * capacity);
+    char* arg;
+
+    argv[0] = "2310depot";
+    *argc = 1;
+    while ((arg = strtok_r(spec, " ", &spec)) != NULL) {
+        if (*argc == capacity) {
+            capacity *= 2;
+            argv = realloc(argv, sizeof(char*) * capacity);
+        }
+        argv[(*argc)++] = arg;
+    }
 
-        if (i % 2 == 0) {
-            // add new resource to list
-            newResource = add_item(firstResource);
+    return argv;
+}
 
-            // set name
-            newResource->name = argv[i];
+/**
+ * Checks the arguments of every depot named in DEPOT_TENANTS, as check_args
+ * does for the command line.
+ *
+ * @param tenants: the DEPOT_TENANTS setting, or NULL if unset
+ * @return integer error status to be handled by main if detected, or
+ *      0 otherwise.
+ */
+int check_tenants(const char* tenants) {
 
-        } else {
-            // set quantity
-            newResource->type.resource.quantity = atoi(argv[i]);
+    if (tenants == NULL) {
+        return 0;
+    }
 
-        }
+    char* copy = strdup(tenants);
+    char* rest = copy;
+    char* spec;
+    int err = 0;
+    while (!err && (spec = strtok_r(rest, ";", &rest)) != NULL) {
+        int argc;
+        char** argv = split_tenant_args(spec, &argc);
+        err = check_args(argc, argv);
+        free(argv);
+    }
+
+    free(copy);
+    return err;
+}
+
+/**
+ * Starts a depot hosted by this process: sets up its lists from its
+ * arguments, starts its server (printing its port), and adds it to the
+ * hosted depots.
+ *
+ * @param argc: the number of the depot's arguments
+ * @param argv: the depot's arguments, in the format of the command line
+ * @return GOODS_ERR if the depot's goods couldn't be set up (see set_args),
+ *      0 otherwise
+ */
+int start_tenant(int argc, char* argv[]) {
+
+    struct Tenant* tenant = new_tenant();
+    int err = set_args(argc, argv, tenant->thisDepot, tenant->inventory,
+            tenant->firstDeferral);
+    if (err) {
+        return err;
     }
 
+    start_server(tenant->thisDepot, tenant->inventory,
+            tenant->firstDeferral, &tenant->dataLock);
+    add_tenant(tenant);
+    return 0;
 }
 
 int main(int argc, char* argv[]) {
@@ -250,40 +339,98 @@ int main(int argc, char* argv[]) {
     sigpipe.sa_flags = SA_RESTART;
     sigaction(SIGPIPE, &sigpipe, 0);
 
+    struct sigaction sigusr1; // setup signal handler - SIGUSR1
+    sigusr1.sa_handler = handle_sigusr1;
+    sigusr1.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &sigusr1, 0);
+
+    // only the main thread takes SIGHUP and SIGUSR1, while it waits for
+    // them (every other thread inherits them blocked)
+    sigset_t displaySignals, waitMask;
+    sigemptyset(&displaySignals);
+    sigaddset(&displaySignals, SIGHUP);
+    sigaddset(&displaySignals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &displaySignals, &waitMask);
+
     int err = 0;
     err = check_args(argc, argv); // check args
     if (err) {
         display_err(err);
         return err;
     }
+    load_config();
+    err = check_tenants(get_config()->tenants);
+    if (err) {
+        display_err(err);
+        return err;
+    }
+    init_budget(global_budget(), get_config()->processMemory, NULL);
+    init_scheduler();
+    init_placement();
+    if (get_config()->capture != NULL) {
+        start_capture(get_config()->capture);
+    }
+    start_tracing();
 
-    // setup linked lists for resources, depots and deferred commands
-    struct LinkedList* firstResource = malloc(sizeof(struct LinkedList));
-    struct LinkedList* thisDepot = malloc(sizeof(struct LinkedList));
-    struct LinkedList* firstDeferral = malloc(sizeof(struct LinkedList));
-
-    // instantiate mutex and set args
-    pthread_mutex_t dataLock;
-    pthread_mutex_init(&dataLock, NULL);
-    set_args(argc, argv, thisDepot, firstResource, firstDeferral);
+    // set depots up on the workers' CPUs, so the memory they use most is
+    // local to them, then report from the main thread's own CPUs
+    place_thread(ROLE_WORKER);
 
-    // start server - listen on ephemeral port
-    pthread_t serverTid = start_server(thisDepot, firstResource,
-            firstDeferral, &dataLock);
+    // start servers - each hosted depot listens on an ephemeral port
+    err = start_tenant(argc, argv);
+    if (err) {
+        display_err(err);
+        return err;
+    }
+    if (get_config()->follow != NULL) {
+        struct Tenant* tenant = first_tenant();
+        start_replica(get_config()->follow, tenant->thisDepot,
+                tenant->inventory, tenant->firstDeferral, &tenant->dataLock);
+    }
+    if (get_config()->tenants != NULL) {
+        char* tenants = strdup(get_config()->tenants);
+        char* spec;
+        while ((spec = strtok_r(tenants, ";", &tenants)) != NULL) {
+            int tenantArgc;
+            char** tenantArgv = split_tenant_args(spec, &tenantArgc);
+            err = start_tenant(tenantArgc, tenantArgv);
+            if (err) {
+                display_err(err);
+                return err;
+            }
+        }
+    }
 
+    start_coalescing();
+    start_feeds();
+    place_thread(ROLE_REPORT);
     while (1) { // main thread used to detect signals
+        sigsuspend(&waitMask);
+        flush_capture();
+
         if (sigHupDetected) {
-            pthread_mutex_lock(&dataLock);
-            display_depot_data(thisDepot, firstResource);
-            pthread_mutex_unlock(&dataLock);
             sigHupDetected = false;
+            for (struct Tenant* tenant = first_tenant(); tenant != NULL;
+                    tenant = tenant->next) {
+                if (count_tenants() > 1) {
+                    printf("Depot:%s\n", tenant->thisDepot->name);
+                }
+                display_depot_data(tenant->thisDepot, tenant->inventory);
+            }
         }
+        if (sigUsr1Detected) {
+            sigUsr1Detected = false;
+            note_thread_cpu();
+            display_stats(stdout);
+        }
+    }
+
+    for (struct Tenant* tenant = first_tenant(); tenant != NULL;
+            tenant = tenant->next) {
+        pthread_mutex_destroy(&tenant->dataLock);
+        free_inventory(tenant->inventory);
+        free_linked_list(tenant->thisDepot);
+        free_linked_list(tenant->firstDeferral);
     }
-    void* result;
-    pthread_join(serverTid, &result);
-    pthread_mutex_destroy(&dataLock);
-    free_linked_list(firstResource);
-    free_linked_list(thisDepot);
-    free_linked_list(firstDeferral);
     return 0;
-}
\ No newline at end of file
+}
@@ -1,6 +1,14 @@
 #include "messaging.h"
 #include "util.h"
 #include "linkedLists.h"
+#include "network.h"
+#include "budget.h"
+#include "inventory.h"
+#include "intern.h"
+#include "rcu.h"
+#include "neighbours.h"
+#include "tracing.h"
+#include "coalesce.h"
 
 #define MAX_CONNECT_MSG_SIZE 13
 #define MIN_IM_MSG_SIZE 6
@@ -9,10 +17,47 @@
 #define MIN_DEFER_MSG_SIZE 8
 #define MIN_EXECUTE_MSG_SIZE 9
 #define MIN_TRANSFER_MSG_SIZE 14
+#define MAX_BROADCAST_LINE_LENGTH 256
+#define MIN_QUERY_MSG_SIZE 7
+#define MIN_RING_MSG_SIZE 7
+// Longest transfer quantity which is certain to fit in an int
+#define MAX_COALESCE_DIGITS 9
+#define MIN_CREDIT_MSG_SIZE 8
+#define MAX_IM_FIELDS 6
+
+/**
+ * Checks an optional field at the end of an IM message. Fields are either
+ * "unix" (the depot also listens on a Unix domain socket), "sync" (the depot
+ * sends and wants state sync), "trace" (the depot records trace spans) or
+ * "credit=w" (the depot uses credit based flow control, with a window of w
+ * messages).
+ *
+ * @param option: the field to check
+ * @return true if the field is valid, false otherwise
+ */
+bool check_im_option(char* option) {
+
+    if (strcmp(option, "unix") == 0 || strcmp(option, "sync") == 0 ||
+            strcmp(option, "trace") == 0) {
+        return true;
+    }
+
+    char* credit = "credit=";
+    if (!check_string_match(credit, option) ||
+            strlen(option) == strlen(credit)) {
+        return false;
+    }
+
+    // check window is a positive number
+    return is_a_number(option + strlen(credit)) &&
+            atoi(option + strlen(credit)) > 0;
+}
 
 /**
  * Checks a received IM message for any errors, and reports
- * these errors to the IM message handler.
+ * these errors to the IM message handler. An IM message may end with
+ * optional fields advertising what the sending depot supports (see
+ * check_im_option).
  *
  * @param message: the string message to be checked
  * @return true if no errors are detected in the message, false
@@ -32,31 +77,42 @@ bool check_im_message(char* message) {
     }
 
     // Correct number of ':' symbol check
-    if (count_symbol(message, ':') != 2) {
+    int symbols = count_symbol(message, ':');
+    if (symbols < 2 || symbols > MAX_IM_FIELDS) {
         return false;
     }
 
-    char* checkMessage = malloc(sizeof(char) * strlen(message));
-    strcpy(checkMessage, message);
+    char* copy = strdup(message);
+    char* checkMessage = copy;
 
     char* port;
     char* name;
+    char* option;
+    bool valid = true;
     strtok_r(checkMessage, ":", &checkMessage);
     port = strtok_r(checkMessage, ":", &checkMessage);
     name = strtok_r(checkMessage, ":", &checkMessage);
 
-    // check port is a number
-    if (!is_a_number(port)) {
-        return false;
+    if (port == NULL || name == NULL) {
+        valid = false;
     }
 
-    // check name isn't invalid
+    // check advertised options, if given
+    for (int i = 2; valid && i < symbols; i++) {
+        option = strtok_r(checkMessage, ":", &checkMessage);
+        if (option == NULL || !check_im_option(option)) {
+            valid = false;
+        }
+    }
+
+    // check port is a number, and name isn't invalid
     char* invalid = " \n\r:";
-    if (!check_characters(name, invalid)) {
-        return false;
+    if (valid && (!is_a_number(port) || !check_characters(name, invalid))) {
+        valid = false;
     }
 
-    return true;
+    free(copy);
+    return valid;
 }
 
 /**
@@ -85,15 +141,79 @@ bool check_connect_message(char* message) {
         return false;
     }
 
-    char* checkMessage = malloc(sizeof(char) * strlen(message));
-    strcpy(checkMessage, message);
+    char* copy = strdup(message);
+    char* checkMessage = copy;
 
     char* port;
     strtok_r(checkMessage, ":", &checkMessage);
     port = strtok_r(checkMessage, ":", &checkMessage);
 
     // check port is a number
-    if (!is_a_number(port)) {
+    bool valid = port != NULL && is_a_number(port);
+
+    free(copy);
+    return valid;
+}
+
+/**
+ * Checks a received ring message (of the format Ring:name) for any errors,
+ * and reports these to the ring message handler.
+ *
+ * @param message: the string message to be checked
+ * @return true if no errors are detected in the message, false
+ *      otherwise. If an error is detected, do not handle the message.
+ */
+bool check_ring_message(char* message) {
+
+    // length check (+1 for the name's leading '/')
+    if (strlen(message) < MIN_RING_MSG_SIZE) {
+        return false;
+    }
+
+    // check for "Ring:/"
+    char* ring = "Ring:/";
+    if (!check_string_match(ring, message)) {
+        return false;
+    }
+
+    // check for correct number of ':' symbols (1)
+    if (count_symbol(message, ':') != 1) {
+        return false;
+    }
+
+    // check name (after the leading '/') has no invalid chars
+    char* invalid = " \n\r:/";
+    if (!check_characters(message + strlen(ring), invalid)) {
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Checks a received credit message (of the format Credit:n) for any errors,
+ * and reports these to the credit message handler.
+ *
+ * @param message: the string message to be checked
+ * @return true if no errors are detected in the message, false
+ *      otherwise. If an error is detected, do not handle the message.
+ */
+bool check_credit_message(char* message) {
+
+    // length check
+    if (strlen(message) < MIN_CREDIT_MSG_SIZE) {
+        return false;
+    }
+
+    // check for "Credit:"
+    char* credit = "Credit:";
+    if (!check_string_match(credit, message)) {
+        return false;
+    }
+
+    // check credits are a positive number
+    char* credits = message + strlen(credit);
+    if (!is_a_number(credits) || atoi(credits) <= 0) {
         return false;
     }
 
@@ -126,8 +246,8 @@ bool check_deliver_withdraw_message(char* message, char* commandString) {
     }
 
     // break down message
-    char* checkMessage = malloc(sizeof(char) * strlen(message));
-    strcpy(checkMessage, message);
+    char* copy = strdup(message);
+    char* checkMessage = copy;
 
     char* quantity;
     char* type;
@@ -135,44 +255,34 @@ bool check_deliver_withdraw_message(char* message, char* commandString) {
     quantity = strtok_r(checkMessage, ":", &checkMessage);
     type = strtok_r(checkMessage, ":", &checkMessage);
 
-    // check quantity is valid number
-    if (!is_a_number(quantity)) {
-        return false;
-    }
-
-    // check quantity is above 0
-    if (atoi(quantity) <= 0) {
-        return false;
-    }
-
-    // check type has no invalid chars
+    // check quantity is a valid number above 0, and type has no invalid
+    // chars
     char* invalid = " \n\r:";
-    if (!check_characters(type, invalid)) {
-        return false;
-    }
+    bool valid = quantity != NULL && type != NULL &&
+            is_a_number(quantity) && atoi(quantity) > 0 &&
+            check_characters(type, invalid);
 
-    return true;
+    free(copy);
+    return valid;
 }
 
 /**
  * Message handler for a received Deliver or Withdraw message. First
  * checks the message is valid, then finds the resource given by
- * type (t) in: Deliver:q:t or Withdraw:q:t in the depot's current list.
+ * type (t) in: Deliver:q:t or Withdraw:q:t in the depot's inventory.
  * If it is a Deliver message, add the quantity to the given type. If it
  * is a Withdraw message, subtract the quantity from the given type. If the
- * type does not exist create a new instance of that type in the resource list,
- * and then perform +/- operations upon it.
+ * type does not exist it is added to the inventory, and then +/- operations
+ * performed upon it. Goods the depot already has are updated without a
+ * lock (see change_stock).
  *
  * @param message: the received deliver/withdraw message
- * @param firstResource: the first resource in this depots linked list of
- *      resources
- * @param dataLock: the mutex to lock this depot's resource list with
+ * @param inventory: this depot's inventory
  * @param command: boolean macro DELIVER or WITHDRAW, treats the incoming
  *      message as a deliver or withdraw message.
  */
 void handle_deliver_withdraw_message(char* message,
-        struct LinkedList* firstResource, pthread_mutex_t* dataLock,
-        int command) {
+        struct Inventory* inventory, int command) {
 
     char* commandString;
     if (command == DELIVER) {
@@ -193,24 +303,18 @@ void handle_deliver_withdraw_message(char* message,
     quantity = strtok_r(message, ":", &message);
     type = strtok_r(message, ":", &message);
 
-    pthread_mutex_lock(dataLock);
-    struct LinkedList* resource = search_list_by_name(type, firstResource);
-
-    // create new resource if it doesn't exist already
-    if (resource == NULL) {
-        resource = add_item(firstResource);
-        resource->name = type;
+    uint32_t good = intern_good(type);
+    if (good == NO_GOOD) {
+        return;
     }
 
     // decide whether to add/subtract quantity from resource
     if (command == DELIVER) {
-        resource->type.resource.quantity += atoi(quantity);
+        change_stock(inventory, good, atoi(quantity));
 
     } else {
-        resource->type.resource.quantity -= atoi(quantity);
+        change_stock(inventory, good, -atoi(quantity));
     }
-
-    pthread_mutex_unlock(dataLock);
 }
 
 /**
@@ -249,16 +353,17 @@ bool check_transfer_message(char* message) {
  * whether this message is valid, then finds the destination depot, withdraws
  * the given quantity of the resource from the current depot's stocks
  * (given by q and t) and then sends a deliver message to the other depot.
+ * When tracing, a sample of transfers (DEPOT_TRACE_SAMPLE) start a trace of
+ * their own, which the Deliver carries to the destination. When coalescing,
+ * the Deliver waits to be sent with others of the same good instead (see
+ * coalesce_transfer), unless it carries a trace.
  *
  * @param message: the transfer message to handle
- * @param firstResource: the first resource in this depot's linked list of
- *      resources
+ * @param inventory: this depot's inventory
  * @param thisDepot: this depot as the first item in a linked list of depots
- * @param dataLock: a mutex to protect both the depot and resource list
  */
 void handle_transfer_message(char* message,
-        struct LinkedList* firstResource, struct LinkedList* thisDepot,
-        pthread_mutex_t* dataLock) {
+        struct Inventory* inventory, struct LinkedList* thisDepot) {
 
     // do nothing if message is invalid
     if (!check_transfer_message(message)) {
@@ -279,25 +384,150 @@ void handle_transfer_message(char* message,
         return;
     }
 
-    // find destination depot for delivery
-    pthread_mutex_lock(dataLock);
-    struct LinkedList* destination = search_list_by_name(dest, thisDepot);
+    uint32_t good = intern_good(type);
+    if (good == NO_GOOD) {
+        return;
+    }
+
+    // find destination depot for delivery, without locking
+    rcu_read_lock();
+    const struct Neighbour* destination =
+            find_neighbour(read_neighbours(thisDepot), dest);
     if (destination == NULL) {
+        rcu_read_unlock();
         return;
     }
 
-    // find resource in current directory, and withdraw quantity
-    struct LinkedList* resource = search_list_by_name(type, firstResource);
-    if (resource == NULL) {
-        resource = add_item(firstResource);
-        resource->name = type;
+    // start a trace for the transfer, unless it arrived with one
+    struct TracedMessage traced = {0};
+    if (current_trace() == NULL && sample_trace()) {
+        begin_root_trace(&traced, thisDepot->name, "Transfer");
     }
-    resource->type.resource.quantity -= atoi(quantity);
 
-    // send deliver message to other depot
-    fprintf(destination->type.depot.to, "Deliver:%s:%s\n", quantity, type);
-    fflush(destination->type.depot.to);
-    pthread_mutex_unlock(dataLock);
+    // withdraw quantity from this depot's inventory
+    change_stock(inventory, good, -atoi(quantity));
+
+    // send deliver message to other depot (with the trace, see
+    // send_to_depot), or leave it to be sent with others
+    if (current_trace() != NULL || strlen(quantity) > MAX_COALESCE_DIGITS ||
+            !is_a_number(quantity) ||
+            !coalesce_transfer(destination->depot, good, atoi(quantity))) {
+        send_to_depot(destination->depot, "Deliver:%s:%s", quantity, type);
+    }
+    rcu_read_unlock();
+    end_traced_message(&traced);
+}
+
+/**
+ * Checks a received broadcast message (of the format Broadcast:q:t) for any
+ * errors, and reports these to the broadcast message handler. The quantity
+ * and type are checked as for a deliver message.
+ *
+ * @param message: the string message to be checked
+ * @return true if no errors are detected in the message, false
+ *      otherwise. If an error is detected, do not handle the message.
+ */
+bool check_broadcast_message(char* message) {
+    return check_deliver_withdraw_message(message, "Broadcast");
+}
+
+/**
+ * Message handler for a broadcast message of the format: Broadcast:q:t,
+ * where q is the quantity of the resource and t is the type of resource.
+ * Delivers q of t to every neighbour (which has sent its IM message), like
+ * a transfer to each one: the total is withdrawn from this depot's stocks
+ * once, and the Deliver message is formatted once and the same buffer
+ * passed to every neighbour's send path. Quantities for neighbours whose
+ * connections were torn down before they could be sent to are put back.
+ *
+ * @param message: the broadcast message to handle
+ * @param inventory: this depot's inventory
+ * @param thisDepot: this depot as the first item in a linked list of depots
+ */
+void handle_broadcast_message(char* message,
+        struct Inventory* inventory, struct LinkedList* thisDepot) {
+
+    // do nothing if message is invalid
+    if (!check_broadcast_message(message)) {
+        return;
+    }
+
+    // split up message
+    char* quantity;
+    char* type;
+    strtok_r(message, ":", &message);
+    quantity = strtok_r(message, ":", &message);
+    type = strtok_r(message, ":", &message);
+
+    char line[MAX_BROADCAST_LINE_LENGTH];
+    int length = snprintf(line, MAX_BROADCAST_LINE_LENGTH, "Deliver:%s:%s",
+            quantity, type);
+    uint32_t good = intern_good(type);
+    if (length >= MAX_BROADCAST_LINE_LENGTH || good == NO_GOOD) {
+        return;
+    }
+
+    rcu_read_lock();
+    const struct NeighbourSet* neighbourSet = read_neighbours(thisDepot);
+
+    // count neighbours which have identified themselves
+    int neighbours = 0;
+    for (int i = 0; i < neighbourSet->count; i++) {
+        if (neighbourSet->neighbours[i].port != NULL) {
+            neighbours++;
+        }
+    }
+    if (neighbours == 0) {
+        rcu_read_unlock();
+        return;
+    }
+
+    // withdraw the total from this depot once
+    int64_t each = atoi(quantity);
+    change_stock(inventory, good, -each * neighbours);
+
+    // send the same deliver message to every neighbour
+    int sent = 0;
+    for (int i = 0; i < neighbourSet->count; i++) {
+        if (neighbourSet->neighbours[i].port != NULL &&
+                send_line_to_depot(neighbourSet->neighbours[i].depot, line,
+                length)) {
+            sent++;
+        }
+    }
+    rcu_read_unlock();
+
+    // put back what couldn't be sent
+    if (sent < neighbours) {
+        change_stock(inventory, good, each * (neighbours - sent));
+    }
+}
+
+/**
+ * Checks a received query message (of the format Query:t, where t is the
+ * type of a resource, or * for every resource) for any errors, and reports
+ * these to the query message handler.
+ *
+ * @param message: the string message to be checked
+ * @return true if no errors are detected in the message, false
+ *      otherwise. If an error is detected, do not handle the message.
+ */
+bool check_query_message(char* message) {
+
+    // length check
+    if (strlen(message) < MIN_QUERY_MSG_SIZE) {
+        return false;
+    }
+
+    // check for "Query:"
+    char* query = "Query:";
+    if (!check_string_match(query, message)) {
+        return false;
+    }
+
+    // check type has no invalid chars
+    char* invalid = " \n\r:";
+    return check_characters(message + strlen(query), invalid);
 }
 
 /**
@@ -326,22 +556,16 @@ bool check_defer_message(char* message) {
 
     // split up string
     char* key;
-    char* checkMessage = malloc(sizeof(char) * strlen(message));
-    strcpy(checkMessage, message);
+    char* copy = strdup(message);
+    char* checkMessage = copy;
     strtok_r(checkMessage, ":", &checkMessage);
     key = strtok_r(checkMessage, ":", &checkMessage);
 
-    // check key is number
-    if (!is_a_number(key)) {
-        return false;
-    }
-
-    // check key is positive
-    if (atoi(key) < 0) {
-        return false;
-    }
+    // check key is a positive number
+    bool valid = key != NULL && is_a_number(key) && atoi(key) >= 0;
 
-    return true;
+    free(copy);
+    return valid;
 }
 
 /**
@@ -367,22 +591,16 @@ bool check_execute_message(char* message) {
 
     // split up message
     char* key;
-    char* checkMessage = malloc(sizeof(char) * strlen(message));
-    strcpy(checkMessage, message);
+    char* copy = strdup(message);
+    char* checkMessage = copy;
     strtok_r(checkMessage, ":", &checkMessage);
     key = strtok_r(checkMessage, ":", &checkMessage);
 
-    // check key is number
-    if (!is_a_number(key)) {
-        return false;
-    }
+    // check key is a positive number
+    bool valid = key != NULL && is_a_number(key) && atoi(key) >= 0;
 
-    // check key is positive
-    if (atoi(key) < 0) {
-        return false;
-    }
-
-    return true;
+    free(copy);
+    return valid;
 }
 
 /**
@@ -9,23 +9,35 @@
 #include <pthread.h>
 
 struct LinkedList;
+struct Inventory;
+
+bool check_im_option(char* option);
 
 bool check_im_message(char* message);
 
+bool check_credit_message(char* message);
+
 bool check_connect_message(char* message);
 
+bool check_ring_message(char* message);
+
 bool check_deliver_withdraw_message(char* message, char* commandString);
 
 void handle_deliver_withdraw_message(char* message,
-        struct LinkedList* firstResource, pthread_mutex_t* dataLock,
-        int command);
+        struct Inventory* inventory, int command);
 
 void handle_transfer_message(char* message,
-        struct LinkedList* firstResource, struct LinkedList* thisDepot,
-        pthread_mutex_t* dataLock);
+        struct Inventory* inventory, struct LinkedList* thisDepot);
 
 bool check_transfer_message(char* message);
 
+bool check_broadcast_message(char* message);
+
+bool check_query_message(char* message);
+
+void handle_broadcast_message(char* message,
+        struct Inventory* inventory, struct LinkedList* thisDepot);
+
 bool check_defer_message(char* message);
 
 bool check_execute_message(char* message);
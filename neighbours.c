@@ -0,0 +1,72 @@
+#include <stdlib.h>
+#include <string.h>
+#include "neighbours.h"
+#include "linkedLists.h"
+#include "rcu.h"
+
+// Published when a depot has no neighbours yet
+static const struct NeighbourSet emptySet = {0};
+
+/**
+ * Publishes a new snapshot of a depot's neighbours, built from its list of
+ * connected depots, and retires the previous one. Called after every change
+ * to the list, or to a neighbour's name or port.
+ *
+ * @param thisDepot: this depot, first in the list of connected depots (the
+ *      lock protecting the list must be held)
+ */
+void publish_neighbours(struct LinkedList* thisDepot) {
+
+    int count = count_items_in_list(thisDepot) - 1;
+    struct NeighbourSet* set = malloc(sizeof(struct NeighbourSet) +
+            sizeof(struct Neighbour) * count);
+    set->count = count;
+
+    struct LinkedList* node = thisDepot->next;
+    for (int i = 0; i < count; i++) {
+        set->neighbours[i].name = node->name;
+        set->neighbours[i].port = node->type.depot.port;
+        set->neighbours[i].depot = &node->type.depot;
+        node = node->next;
+    }
+
+    struct NeighbourSet* old = __atomic_exchange_n(
+            &thisDepot->type.depot.neighbours, set, __ATOMIC_SEQ_CST);
+    if (old != NULL) {
+        rcu_retire(old, free);
+    }
+}
+
+/**
+ * Gets a depot's current neighbours, without a lock.
+ *
+ * @param thisDepot: this depot, first in the list of connected depots
+ * @return the published set of neighbours, valid until rcu_read_unlock
+ *      (the caller must hold an RCU read lock)
+ */
+const struct NeighbourSet* read_neighbours(struct LinkedList* thisDepot) {
+
+    struct NeighbourSet* set = __atomic_load_n(
+            &thisDepot->type.depot.neighbours, __ATOMIC_SEQ_CST);
+    return set == NULL ? &emptySet : set;
+}
+
+/**
+ * Finds a neighbour by name, among those which have sent their IM message.
+ *
+ * @param set: the set of neighbours to search
+ * @param name: the name to search for
+ * @return the neighbour found, or NULL if there is none by that name
+ */
+const struct Neighbour* find_neighbour(const struct NeighbourSet* set,
+        const char* name) {
+
+    for (int i = 0; i < set->count; i++) {
+        if (set->neighbours[i].port != NULL &&
+                strcmp(set->neighbours[i].name, name) == 0) {
+            return &set->neighbours[i];
+        }
+    }
+
+    return NULL;
+}
@@ -0,0 +1,36 @@
+#ifndef NEIGHBOURS_H
+#define NEIGHBOURS_H
+
+struct LinkedList;
+struct Depot;
+
+/**
+ * A connected depot, as published in a neighbour set. Name and port point
+ * to the depot's own (port is NULL until the depot has sent its IM
+ * message), which are only freed once no set can refer to them.
+ */
+struct Neighbour {
+    const char* name;
+    const char* port;
+    struct Depot* depot;
+};
+
+/**
+ * An immutable snapshot of a depot's neighbours, published on the depot
+ * so it can be read without dataLock. Changes publish a new set and retire
+ * the old one (see rcu.h), so readers must hold an RCU read lock while
+ * using a set, and anything it points to.
+ */
+struct NeighbourSet {
+    int count;
+    struct Neighbour neighbours[];
+};
+
+void publish_neighbours(struct LinkedList* thisDepot);
+
+const struct NeighbourSet* read_neighbours(struct LinkedList* thisDepot);
+
+const struct Neighbour* find_neighbour(const struct NeighbourSet* set,
+        const char* name);
+
+#endif //NEIGHBOURS_H
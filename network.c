@@ -1,13 +1,60 @@
+#define _GNU_SOURCE
 #include "network.h"
 #include "linkedLists.h"
 #include "channel.h"
 #include "messaging.h"
+#include "dialer.h"
+#include "config.h"
+#include <poll.h>
+#include <sys/un.h>
+#include <stdarg.h>
+#include "shmring.h"
+#include "util.h"
+#include "uring.h"
+#include "budget.h"
+#include "stats.h"
+#include "tenant.h"
+#include "inventory.h"
+#include "intern.h"
+#include "rcu.h"
+#include "neighbours.h"
+#include "replica.h"
+#include "sync.h"
+#include "placement.h"
+#include "capture.h"
+#include "tracing.h"
+#include "coalesce.h"
+#include "feed.h"
+#include <inttypes.h>
+#include <errno.h>
+#include <time.h>
 
 #define MAX_BUFFER_LENGTH 50
 #define DELIVER 0
 #define WITHDRAW 1
 #define BLANK_DEFER_LENGTH 7
-#define MAX_CONNECTIONS 30
+#define CONNECTION_STACK_SIZE (256 * 1024)
+#define MAX_LINE_LENGTH 256
+#define MAX_SHM_NAME_LENGTH 64
+#define MAX_QUANTITY_LENGTH 20
+#define READ_CHUNK_LENGTH 4096
+#define TRACE_HEADER_LENGTH 64
+#define KEPT_LINE_CAPACITY 4096
+#define ACCEPT_BACKOFF_NS 50000000
+#define MAX_STALLED_BYTES (4 * 1024 * 1024)
+
+/**
+ * A reader which can't wait, finished, with the lines it left stalled, for
+ * finish_thread to queue.
+ */
+struct FinishedReader {
+    struct ConnectionWrapper* connection;
+    struct PartialLine line;
+};
+
+// Attributes shared by every reader/action thread
+static pthread_once_t threadAttrOnce = PTHREAD_ONCE_INIT;
+static pthread_attr_t connectionThreadAttr;
 
 /**
  * Thread function for waiting on an execution key to instantiate a
@@ -16,7 +63,8 @@
  *
  * @param arg: connection wrapper containing information for the key,
  *      executed status, deferred message and info for all other required
- *      subsequent message handlers
+ *      subsequent message handlers (a copy owned by this thread, as the
+ *      connection may be torn down before the key is executed)
  * @return null unused value (required for thread function)
  */
 void* defer_thread(void* arg) {
@@ -28,6 +76,8 @@ void* defer_thread(void* arg) {
             search_list_by_name("new", connection->firstDeferral);
 
     if (deferral == NULL) {
+        pthread_mutex_unlock(connection->dataLock);
+        free(connection);
         return NULL;
     }
 
@@ -45,26 +95,34 @@ void* defer_thread(void* arg) {
     switch (firstLetter) {
         case 'D':
             handle_deliver_withdraw_message(operation,
-                    connection->firstResource, connection->dataLock,
-                    DELIVER);
+                    connection->inventory, DELIVER);
             break;
 
         case 'W':
             handle_deliver_withdraw_message(operation,
-                    connection->firstResource, connection->dataLock,
-                    WITHDRAW);
+                    connection->inventory, WITHDRAW);
             break;
 
         case 'T':
             handle_transfer_message(operation,
-                    connection->firstResource,
-                    connection->thisDepot, connection->dataLock);
+                    connection->inventory, connection->thisDepot);
+            break;
+
+        case 'B':
+            handle_broadcast_message(operation,
+                    connection->inventory, connection->thisDepot);
             break;
 
         default:
-            return NULL;
+            break;
     }
 
+    pthread_mutex_lock(connection->dataLock);
+    deferral->type.deferral.operation = NULL;
+    pthread_mutex_unlock(connection->dataLock);
+    budget_free(operation);
+    free(connection);
+
     return NULL;
 }
 
@@ -91,35 +149,49 @@ void handle_defer_message(char* message,
 
     // breakdown defer message to find position of 'operation'
     // mesage (i.e. Deliver...)
-    char* messageCopy = malloc(sizeof(char) * strlen(message));
-    strcpy(messageCopy, message);
+    char* messageCopy = strdup(message);
+    char* rest = messageCopy;
     char* key;
     int splitPosition = BLANK_DEFER_LENGTH; // i.e. Defer::
 
-    strtok_r(messageCopy, ":", &messageCopy);
-    key = strtok_r(messageCopy, ":", &messageCopy);
+    strtok_r(rest, ":", &rest);
+    key = strtok_r(rest, ":", &rest);
     splitPosition += strlen(key);
     message += splitPosition;
 
-    // create new deferral
+    // create new deferral, keeping its own copy of the operation, as the
+    // message is freed once handled
     pthread_mutex_lock(connection->dataLock);
     struct LinkedList* newDeferral = add_item(connection->firstDeferral);
     newDeferral->type.deferral.executed = false;
     newDeferral->type.deferral.key = atoi(key);
     newDeferral->name = "new";
-    newDeferral->type.deferral.operation = message;
+    newDeferral->type.deferral.operation =
+            budget_strdup(global_budget(), message);
+    free(messageCopy);
 
     pthread_mutex_unlock(connection->dataLock);
 
     // create defer thread
     pthread_t tid;
-    pthread_create(&tid, 0, defer_thread, connection);
+    pthread_create(&tid, 0, defer_thread, new_connection_wrapper(
+            connection->thisDepot, connection->inventory,
+            connection->firstDeferral, connection->dataLock));
 }
 
 /**
- * Mesage handler for IM message, of the format IM:port:name,
+ * Mesage handler for IM message, of the format IM:port:name[:options],
  * where port is the port of the connecting depot, and name is
- * the name of the connecting depot. Adds a record of the
+ * the name of the connecting depot. A "unix" option advertises that
+ * the depot also listens on a Unix domain socket, which is remembered
+ * for later connects to its port. A "credit=w" option turns on credit
+ * based flow control, if this depot also uses it: each depot may then
+ * only send as many messages as the other has granted credits for. A
+ * "sync" option turns on state sync, if this depot also uses it: each then
+ * sends the other its stock (see send_state_sync). A "trace" option says
+ * the depot records spans, so messages sent to it on behalf of a trace are
+ * preceded by a Trace line carrying the trace (see send_to_depot).
+ * Adds a record of the
  * connecting depot (with port and name) in this depot's list
  * of all depots, if the IM message is received correctly. If
  * the IM message is not the first thing sent, or is incorrect, when
@@ -145,31 +217,828 @@ bool handle_im_message(char* message,
 
     char* port;
     char* name;
+    char* option;
+    bool unixCapable = false;
+    bool stateSync = false;
+    bool traced = false;
+    int window = 0;
     strtok_r(message, ":", &message);
     port = strtok_r(message, ":", &message);
     name = strtok_r(message, ":", &message);
+    while ((option = strtok_r(message, ":", &message)) != NULL) {
+        if (strcmp(option, "unix") == 0) {
+            unixCapable = true;
+        } else if (strcmp(option, "sync") == 0) {
+            stateSync = true;
+        } else if (strcmp(option, "trace") == 0) {
+            traced = true;
+        } else {
+            window = atoi(option + strlen("credit="));
+        }
+    }
 
     pthread_mutex_lock(connection->dataLock);
 
-    char* new = "new";
-    struct LinkedList* newDepot =
-            search_list_by_name(new, connection->thisDepot);
+    struct LinkedList* newDepot = connection->connectedDepot;
+    newDepot->name = budget_strdup(global_budget(), name);
+    newDepot->type.depot.port = budget_strdup(global_budget(), port);
+    newDepot->type.depot.unixCapable = unixCapable;
+    publish_neighbours(connection->thisDepot);
+
+    pthread_mutex_unlock(connection->dataLock);
 
-    if (newDepot != NULL) {
-        newDepot->name = name;
-        newDepot->type.depot.port = port;
+    // flow control is only used if both depots advertised it
+    if (window > 0 && get_config()->creditWindow > 0) {
+        pthread_mutex_lock(&newDepot->type.depot.sendLock);
+        newDepot->type.depot.creditFlow = true;
+        newDepot->type.depot.credits = window;
+        pthread_mutex_unlock(&newDepot->type.depot.sendLock);
+        connection->creditWindow = get_config()->creditWindow;
     }
 
-    pthread_mutex_unlock(connection->dataLock);
+    connection->stateSync = stateSync && get_config()->stateSync;
+    __atomic_store_n(&newDepot->type.depot.traced, traced && tracing(),
+            __ATOMIC_RELEASE);
+    remember_transport(port, unixCapable);
+    replica_connected(connection);
 
     return true;
 }
 
+/**
+ * Sends a single line to a connected depot, on its shared memory link if it
+ * has one, otherwise with the io_uring engine if it is in use, otherwise on
+ * its stream.
+ *
+ * @param depot: the depot to send to (its send lock must be held)
+ * @param line: the line to send, without a newline
+ * @param length: the length of the line
+ */
+static void send_line(struct Depot* depot, const char* line, int length) {
+
+    if (depot->shm != NULL) {
+        shm_send(depot->shm, line, length);
+    } else if (depot->uring != NULL) {
+        uring_send(depot->uring, line, length);
+    } else {
+        fprintf(depot->to, "%s\n", line);
+        fflush(depot->to);
+    }
+}
+
+/**
+ * Sends lines held back for lack of credits, oldest first, for as long as
+ * there are credits to send them with.
+ *
+ * @param depot: the depot to send to (its send lock must be held)
+ */
+static void send_held_lines(struct Depot* depot) {
+
+    while (depot->credits > 0 && depot->heldFirst != NULL) {
+        struct HeldLine* held = depot->heldFirst;
+        depot->heldFirst = held->next;
+        if (depot->heldFirst == NULL) {
+            depot->heldLast = NULL;
+        }
+
+        send_line(depot, held->line, held->length);
+        depot->credits--;
+        budget_free(held->line);
+        budget_free(held);
+    }
+
+    if (depot->heldFirst == NULL) {
+        pthread_cond_broadcast(&depot->room);
+    }
+}
+
+/**
+ * Waits until a depot has no messages held back for lack of credits, so a
+ * bulk sender (a state sync or replication stream) holds back at most one
+ * line at a time, rather than queueing everything it has to send.
+ *
+ * @param depot: the depot to wait for
+ * @param stop: set (then wake_send_waiters called) to give up waiting
+ * @return true once the depot can take more, false if stopped, or the
+ *      depot has been closed
+ */
+bool wait_for_send_room(struct Depot* depot, bool* stop) {
+
+    pthread_mutex_lock(&depot->sendLock);
+    while (depot->heldFirst != NULL && !depot->closed &&
+            !__atomic_load_n(stop, __ATOMIC_ACQUIRE)) {
+        pthread_cond_wait(&depot->room, &depot->sendLock);
+    }
+    bool room = !depot->closed && !__atomic_load_n(stop, __ATOMIC_ACQUIRE);
+    pthread_mutex_unlock(&depot->sendLock);
+
+    return room;
+}
+
+/**
+ * Checks, without waiting, whether a depot has taken every message sent to
+ * it so far: none are held back for lack of credits. Without flow control,
+ * this is always so (though sending may block until the depot reads).
+ *
+ * @param depot: the depot to check
+ * @return true if the depot is open and has nothing held back, false
+ *      otherwise
+ */
+bool has_send_room(struct Depot* depot) {
+
+    pthread_mutex_lock(&depot->sendLock);
+    bool room = !depot->closed && depot->heldFirst == NULL;
+    pthread_mutex_unlock(&depot->sendLock);
+
+    return room;
+}
+
+/**
+ * Wakes every thread waiting for room to send to a depot, so those told to
+ * stop can see it.
+ *
+ * @param depot: the depot being waited for
+ */
+void wake_send_waiters(struct Depot* depot) {
+
+    pthread_mutex_lock(&depot->sendLock);
+    pthread_cond_broadcast(&depot->room);
+    pthread_mutex_unlock(&depot->sendLock);
+}
+
+/**
+ * Message handler for credit messages, of the format Credit:n, where n is
+ * the number of further messages the other depot has room for. Sends any
+ * messages held back for lack of credits. Credit messages are handled as
+ * soon as they are read, rather than queued behind other messages.
+ *
+ * @param message: the credit message to handle
+ * @param connection: a connection wrapper containing information for this
+ *      connection between depots
+ */
+void handle_credit_message(char* message,
+        struct ConnectionWrapper* connection) {
+
+    if (!check_credit_message(message)) {
+        return;
+    }
+
+    struct Depot* depot = &connection->connectedDepot->type.depot;
+    pthread_mutex_lock(&depot->sendLock);
+    if (depot->creditFlow) {
+        depot->credits += atoi(message + strlen("Credit:"));
+        send_held_lines(depot);
+    }
+    pthread_mutex_unlock(&depot->sendLock);
+}
+
+/**
+ * Grants the depot at the other end of a connection more credits, once
+ * half a window of its messages has been handled since the last grant.
+ * Called by the action thread after handling each message.
+ *
+ * @param connection: the connection a message was just handled for
+ */
+void return_credits(struct ConnectionWrapper* connection) {
+
+    if (connection->creditWindow == 0 ||
+            ++connection->consumed < connection->creditWindow / 2) {
+        return;
+    }
+
+    char grant[MAX_LINE_LENGTH];
+    int length = snprintf(grant, MAX_LINE_LENGTH, "Credit:%d",
+            connection->consumed);
+    connection->consumed = 0;
+
+    // credit messages never need credits themselves
+    struct Depot* depot = &connection->connectedDepot->type.depot;
+    pthread_mutex_lock(&depot->sendLock);
+    send_line(depot, grant, length);
+    pthread_mutex_unlock(&depot->sendLock);
+}
+
+/**
+ * Checks whether reads from a connection should be held back for memory.
+ * Only messages waiting in the connection's channel are charged to its
+ * budget, so it is blocked while over budget (or the process is) and it
+ * still has messages of its own for the action thread to free. A connection
+ * with nothing queued (the lines its readers are putting together don't
+ * count) is never blocked, so a process over budget can't stop every
+ * reader, including those bringing the credits which would let held lines
+ * be sent and freed.
+ *
+ * @param connection: the connection to check
+ * @return true if reading should wait, false otherwise
+ */
+static bool budget_blocked(struct ConnectionWrapper* connection) {
+
+    return over_budget(&connection->budget) &&
+            __atomic_load_n(&connection->budget.used, __ATOMIC_RELAXED) >
+            __atomic_load_n(&connection->lineBytes, __ATOMIC_RELAXED);
+}
+
+/**
+ * Waits until reads from a connection needn't be held back for memory (see
+ * budget_blocked). The action thread wakes waiting readers each time it
+ * frees one of the connection's messages (see message_freed), and a
+ * blocked connection always has messages queued, so one is never left
+ * waiting.
+ *
+ * @param connection: the connection to wait for
+ */
+static void wait_for_budget(struct ConnectionWrapper* connection) {
+
+    pthread_mutex_lock(&connection->budgetLock);
+    __atomic_add_fetch(&connection->budgetWaiters, 1, __ATOMIC_RELAXED);
+    // pairs with the fence in message_freed, so a wakeup isn't missed
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    while (budget_blocked(connection)) {
+        pthread_cond_wait(&connection->budgetFreed, &connection->budgetLock);
+    }
+    __atomic_sub_fetch(&connection->budgetWaiters, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&connection->budgetLock);
+}
+
+/**
+ * Picks the channel lane for a message. IM, Connect, Ring and Follow
+ * messages control the connection itself, and Execute releases deferred
+ * operations, so they go in the control lane, ahead of bulk inventory
+ * traffic. Defer messages go with them, so an Execute never overtakes the
+ * deferrals it is meant to release. Until the connection has been
+ * greeted, everything goes in the bulk lane, so the first line read is the
+ * one checked as the IM message, rather than a later one overtaking it.
+ *
+ * @param connection: the connection the message was read from
+ * @param line: the message to place
+ * @return LANE_CONTROL or LANE_BULK
+ */
+static int message_lane(struct ConnectionWrapper* connection,
+        const char* line) {
+
+    if (!__atomic_load_n(&connection->greeted, __ATOMIC_ACQUIRE)) {
+        return LANE_BULK;
+    }
+    switch (line[0]) {
+        case 'C':
+            return check_string_match("Connect:", (char*)line) ?
+                    LANE_CONTROL : LANE_BULK;
+        case 'D':
+            return strncmp(line, "Defer:", strlen("Defer:")) == 0 ?
+                    LANE_CONTROL : LANE_BULK;
+        case 'E':
+        case 'I':
+        case 'R':
+        case 'F':
+            return LANE_CONTROL;
+        default:
+            return LANE_BULK;
+    }
+}
+
+/**
+ * Keeps a line a reader couldn't queue without waiting, after any it has
+ * already stalled, to be queued by queue_stalled_lines. Past
+ * MAX_STALLED_BYTES the line is counted and dropped instead, so a reader
+ * which can't wait still can't buffer without bound. That is well beyond
+ * what the io_uring engine can have received before it stops receiving
+ * (all of its receive buffers, a few times over).
+ *
+ * @param connection: the connection the line was read from
+ * @param line: the reader's partial line
+ * @param copy: the copy of the line to queue
+ * @param size: the size of the copy
+ * @param lane: the lane the line goes in
+ */
+static void stall_line(struct ConnectionWrapper* connection,
+        struct PartialLine* line, char* copy, size_t size, int lane) {
+
+    if (line->stalledBytes + size > MAX_STALLED_BYTES) {
+        stat_add(STAT_BUDGET_DROPS, 1);
+        budget_free(copy);
+        return;
+    }
+
+    struct StalledLine* stalled = malloc(sizeof(struct StalledLine));
+    stalled->copy = copy;
+    stalled->size = size;
+    stalled->lane = lane;
+    stalled->next = NULL;
+    if (line->stalled == NULL) {
+        line->stalled = stalled;
+    } else {
+        line->lastStalled->next = stalled;
+    }
+    line->lastStalled = stalled;
+    line->stalledBytes += size;
+
+    // stalled lines aren't queued yet, so don't hold the reader back
+    __atomic_add_fetch(&connection->lineBytes, size, __ATOMIC_RELAXED);
+    stat_add(STAT_LINES_STALLED, 1);
+}
+
+/**
+ * Queues a reader's stalled lines (see stall_line), in order. Lines are
+ * held back while the connection is over budget (see budget_blocked), as
+ * for deliver_line.
+ *
+ * @param connection: the connection the lines were read from
+ * @param line: the reader's partial line
+ * @param wait: true to wait for room, false to stop when there is none
+ * @return true if every stalled line has been queued, false otherwise
+ */
+bool queue_stalled_lines(struct ConnectionWrapper* connection,
+        struct PartialLine* line, bool wait) {
+
+    while (line->stalled != NULL) {
+        struct StalledLine* stalled = line->stalled;
+        if (wait) {
+            wait_for_budget(connection);
+            write_channel_wait(connection->channel, stalled->lane,
+                    (void*) stalled->copy);
+        } else if (budget_blocked(connection) ||
+                !write_channel(connection->channel, stalled->lane,
+                (void*) stalled->copy)) {
+            return false;
+        }
+
+        __atomic_sub_fetch(&connection->lineBytes, stalled->size,
+                __ATOMIC_RELAXED);
+        line->stalled = stalled->next;
+        line->stalledBytes -= stalled->size;
+        free(stalled);
+    }
+
+    return true;
+}
+
+/**
+ * Passes a line read from a connection (by any reader: thread, io_uring
+ * engine or shared memory link) on to the connection's channel, except for
+ * credit messages, which are handled straight away. Readers which serve only
+ * this connection wait for room in a full channel, which pushes back on the
+ * sender. The io_uring engine can't wait, so the line is stalled instead
+ * (see stall_line), along with every line after it until the action thread
+ * has made room; the engine stops receiving meanwhile. Queued lines are
+ * charged to the connection's memory budget, and readers likewise wait (or
+ * the engine stalls the line) while the connection, or the whole process,
+ * is over budget (see budget_blocked). When capturing, every line is
+ * recorded first, as it arrived (see capture.h). A Trace line isn't queued
+ * itself: its trace is kept, then queued ahead of the next line, with the
+ * time it was received (see begin_traced_message).
+ *
+ * @param connection: the connection the line was read from
+ * @param partial: the reader's partial line, which holds its stalled lines
+ * @param line: the line read, without a newline (copied if queued)
+ * @param wait: true if the reader may wait for room in the channel
+ */
+static void deliver_line(struct ConnectionWrapper* connection,
+        struct PartialLine* partial, char* line, bool wait) {
+
+    if (capturing()) {
+        capture_event(connection->captureId, CAPTURE_LINE, line,
+                strlen(line));
+    }
+
+    if (line[0] == 'C' && check_string_match("Credit:", line)) {
+        handle_credit_message(line, connection);
+        return;
+    }
+    if (line[0] == 'T' && tracing() &&
+            strncmp(line, "Trace:", strlen("Trace:")) == 0) {
+        if (sscanf(line, "Trace:%" SCNx64 ":%" SCNx64,
+                &connection->pendingTrace, &connection->pendingSpan) != 2) {
+            connection->pendingTrace = 0;
+        }
+        connection->pendingTraceNs = trace_now_ns();
+        return;
+    }
+
+    bool stall = false;
+    if (!wait) {
+        stall = partial->stalled != NULL || budget_blocked(connection);
+    } else if (budget_blocked(connection)) {
+        // stop reading until the action thread has freed enough
+        stat_add(STAT_BUDGET_PAUSES, 1);
+        wait_for_budget(connection);
+    }
+
+    char* copy;
+    size_t size = strlen(line) + 1;
+    if (connection->pendingTrace != 0) {
+        copy = budget_alloc(&connection->budget, TRACE_HEADER_LENGTH + size);
+        int header = snprintf(copy, TRACE_HEADER_LENGTH + 1,
+                "Trace:%016" PRIx64 ":%016" PRIx64 ":%lld\n",
+                connection->pendingTrace, connection->pendingSpan,
+                connection->pendingTraceNs);
+        memcpy(copy + header, line, size);
+        size += TRACE_HEADER_LENGTH;
+        connection->pendingTrace = 0;
+    } else {
+        copy = budget_strdup(&connection->budget, line);
+    }
+    int lane = message_lane(connection, line);
+    if (wait) {
+        write_channel_wait(connection->channel, lane, (void*) copy);
+    } else if (stall || !write_channel(connection->channel, lane,
+            (void*) copy)) {
+        stall_line(connection, partial, copy, size, lane);
+    }
+}
+
+/**
+ * Frees a partial line's buffer, crediting it back to the connection.
+ *
+ * @param connection: the connection the line was read from
+ * @param line: the partial line to empty
+ */
+static void release_partial_line(struct ConnectionWrapper* connection,
+        struct PartialLine* line) {
+
+    if (line->data != NULL) {
+        __atomic_sub_fetch(&connection->lineBytes, line->capacity,
+                __ATOMIC_RELAXED);
+        budget_free(line->data);
+    }
+    line->data = NULL;
+    line->capacity = 0;
+}
+
+/**
+ * Makes room in a partial line for at least a given number of bytes.
+ *
+ * @param connection: the connection the line is charged to
+ * @param line: the partial line to grow
+ * @param needed: the bytes the line must be able to hold
+ */
+static void grow_partial_line(struct ConnectionWrapper* connection,
+        struct PartialLine* line, size_t needed) {
+
+    if (needed <= line->capacity) {
+        return;
+    }
+
+    size_t capacity = line->capacity > 0 ? line->capacity : MAX_BUFFER_LENGTH;
+    while (capacity < needed) {
+        capacity *= 2;
+    }
+
+    char* data = budget_alloc(&connection->budget, capacity);
+    __atomic_add_fetch(&connection->lineBytes, capacity, __ATOMIC_RELAXED);
+    memcpy(data, line->data, line->length);
+    release_partial_line(connection, line);
+    line->data = data;
+    line->capacity = capacity;
+}
+
+/**
+ * Adds bytes read from a connection to a partial line, passing each line
+ * completed by a newline on with deliver_line. Lines longer than the
+ * configured maximum (DEPOT_MAX_LINE) are counted and dropped, so a
+ * neighbour can't make the reader buffer without bound.
+ *
+ * @param connection: the connection the bytes were read from
+ * @param line: the reader's partial line
+ * @param data: the bytes read
+ * @param length: the number of bytes read
+ * @param wait: passed on to deliver_line
+ */
+void read_into_line(struct ConnectionWrapper* connection,
+        struct PartialLine* line, const char* data, size_t length,
+        bool wait) {
+
+    size_t maxLine = (size_t)get_config()->maxLine;
+    while (length > 0) {
+        const char* newline = memchr(data, '\n', length);
+        size_t piece = newline != NULL ? (size_t)(newline - data) : length;
+
+        if (!line->discarding && line->length + piece > maxLine) {
+            stat_add(STAT_LONG_LINES, 1);
+            line->discarding = true;
+            line->length = 0;
+        }
+        if (!line->discarding) {
+            grow_partial_line(connection, line, line->length + piece + 1);
+            memcpy(line->data + line->length, data, piece);
+            line->length += piece;
+        }
+        if (newline == NULL) {
+            return;
+        }
+
+        if (!line->discarding) {
+            line->data[line->length] = '\0';
+            deliver_line(connection, line, line->data, wait);
+        }
+        line->length = 0;
+        line->discarding = false;
+        if (line->capacity > KEPT_LINE_CAPACITY) {
+            release_partial_line(connection, line);
+        }
+        data += piece + 1;
+        length -= piece + 1;
+    }
+}
+
+/**
+ * Passes on whatever is left of a partial line once its reader reaches end
+ * of file (a last line need not end with a newline), then frees it.
+ *
+ * @param connection: the connection the line was read from
+ * @param line: the reader's partial line
+ * @param wait: passed on to deliver_line
+ */
+void finish_partial_line(struct ConnectionWrapper* connection,
+        struct PartialLine* line, bool wait) {
+
+    if (line->length > 0 && !line->discarding) {
+        line->data[line->length] = '\0';
+        deliver_line(connection, line, line->data, wait);
+    }
+    line->length = 0;
+    line->discarding = false;
+    release_partial_line(connection, line);
+}
+
+/**
+ * Checks whether a connection is over a Unix domain socket, and so is
+ * between two depots on the same host.
+ *
+ * @param connection: the connection to check
+ * @return true if the connection is local, false otherwise
+ */
+static bool is_local_connection(struct ConnectionWrapper* connection) {
+
+    struct sockaddr_storage address;
+    socklen_t len = sizeof(struct sockaddr_storage);
+    if (getsockname(fileno(connection->to), (struct sockaddr*)&address,
+            &len)) {
+        return false;
+    }
+
+    return address.ss_family == AF_UNIX;
+}
+
+/**
+ * Offers the depot at the other end of a new connection a shared memory
+ * link, if enabled, and if both depots are on this host (the connection is
+ * over a Unix domain socket). Only the depot which dialed the connection
+ * makes the offer. The link's name is sent in a Ring:name message, the last
+ * message sent over the socket; every message after it is sent on the link.
+ *
+ * @param connection: the connection which has just received its IM message
+ */
+void offer_shm_link(struct ConnectionWrapper* connection) {
+
+    struct Depot* depot = &connection->connectedDepot->type.depot;
+    if (!get_config()->shmRings || !connection->dialed ||
+            connection->closing || !depot->unixCapable ||
+            depot->shm != NULL || !is_local_connection(connection)) {
+        return;
+    }
+
+    char name[MAX_SHM_NAME_LENGTH];
+    struct ShmLink* link = create_shm_link(name, MAX_SHM_NAME_LENGTH);
+    if (link == NULL) {
+        return; // keep using the socket
+    }
+    connection->readers++;
+    start_shm_reader(link, connection);
+
+    // switch over while holding the send lock, so no other message can
+    // be sent on the socket after the offer
+    char offer[MAX_LINE_LENGTH];
+    int length = snprintf(offer, MAX_LINE_LENGTH, "Ring:%s", name);
+    pthread_mutex_lock(&depot->sendLock);
+    send_line(depot, offer, length);
+    depot->shm = link;
+    pthread_mutex_unlock(&depot->sendLock);
+}
+
+/**
+ * Message handler for ring messages, of the format Ring:name, where name is
+ * the name of shared memory created by the other depot for a shared memory
+ * link. Names which the process at the other end of the socket couldn't
+ * have created are ignored (see shm_name_valid). Maps the link, reads the
+ * other depot's messages from it, and sends every later message to the
+ * other depot on it. The socket stays open.
+ *
+ * @param message: the ring message to handle
+ * @param connection: a connection wrapper containing information for this
+ *      connection between depots
+ */
+void handle_ring_message(char* message,
+        struct ConnectionWrapper* connection) {
+
+    // silently ignore faulty or unexpected ring messages
+    struct Depot* depot = &connection->connectedDepot->type.depot;
+    if (!check_ring_message(message) || connection->dialed ||
+            connection->closing || depot->shm != NULL ||
+            !is_local_connection(connection)) {
+        return;
+    }
+
+    char* name;
+    strtok_r(message, ":", &message);
+    name = strtok_r(message, ":", &message);
+
+    // only open memory the depot at the other end created
+    struct ucred peer;
+    socklen_t length = sizeof(struct ucred);
+    if (name == NULL || getsockopt(fileno(connection->to), SOL_SOCKET,
+            SO_PEERCRED, &peer, &length) == -1 ||
+            !shm_name_valid(name, peer.pid)) {
+        return;
+    }
+
+    struct ShmLink* link = open_shm_link(name);
+    if (link == NULL) {
+        return;
+    }
+    connection->readers++;
+    start_shm_reader(link, connection);
+
+    pthread_mutex_lock(&depot->sendLock);
+    depot->shm = link;
+    pthread_mutex_unlock(&depot->sendLock);
+}
+
+/**
+ * Sends an already formatted message to a connected depot (see send_line).
+ * If flow control is in use and the depot has no credits left, the message
+ * is held back, in order, until the depot grants more. The message is only
+ * read, so one buffer can be sent to many depots. Safe to call from any
+ * thread.
+ *
+ * @param depot: the depot to send to
+ * @param line: the message to send, without a newline
+ * @param length: the length of the message
+ * @return true if the message was sent (or held back), false if the
+ *      connection to the depot has been torn down
+ */
+bool send_line_to_depot(struct Depot* depot, const char* line, int length) {
+
+    pthread_mutex_lock(&depot->sendLock);
+    bool sent = !depot->closed;
+    if (!sent) {
+        // found in an old neighbour set, after the connection was torn down
+    } else if (depot->creditFlow && (depot->credits == 0 ||
+            depot->heldFirst != NULL)) {
+        struct HeldLine* held = budget_alloc(global_budget(),
+                sizeof(struct HeldLine));
+        held->line = budget_strdup(global_budget(), line);
+        held->length = length;
+        held->next = NULL;
+        if (depot->heldLast == NULL) {
+            depot->heldFirst = held;
+        } else {
+            depot->heldLast->next = held;
+        }
+        depot->heldLast = held;
+    } else {
+        send_line(depot, line, length);
+        if (depot->creditFlow) {
+            depot->credits--;
+        }
+    }
+    pthread_mutex_unlock(&depot->sendLock);
+
+    return sent;
+}
+
+/**
+ * Sends a message on behalf of the trace the calling thread is working
+ * for, preceded by a "Trace:trace:span" line naming the trace and a new
+ * send span, which is recorded. The two lines are sent as one (taking one
+ * credit), so nothing can come between them.
+ *
+ * @param depot: the depot to send to
+ * @param context: the trace the message is sent for
+ * @param line: the message to send, without a newline
+ * @param length: the length of the message
+ * @return true if sent (or held back), false if the depot has gone
+ */
+static bool send_traced_line(struct Depot* depot,
+        const struct TraceContext* context, const char* line, int length) {
+
+    uint64_t span = new_span_id();
+    long long startNs = trace_now_ns();
+
+    char* traced = malloc(TRACE_HEADER_LENGTH + length + 1);
+    int header = snprintf(traced, TRACE_HEADER_LENGTH + 1,
+            "Trace:%016" PRIx64 ":%016" PRIx64 "\n", context->trace, span);
+    memcpy(traced + header, line, length + 1);
+    bool sent = send_line_to_depot(depot, traced, header + length);
+    free(traced);
+
+    record_span(context->trace, span, context->span, SPAN_SEND, startNs,
+            trace_now_ns(), context->depot, line);
+    return sent;
+}
+
+/**
+ * Formats a message and sends it to a connected depot (see
+ * send_line_to_depot), with the trace the calling thread is working for if
+ * it has one and the depot records spans too. Safe to call from any
+ * thread.
+ *
+ * @param depot: the depot to send to
+ * @param format: printf style format of the message, without a newline
+ * @return true if sent (or held back), false if the depot has gone
+ */
+bool send_to_depot(struct Depot* depot, const char* format, ...) {
+
+    char buffer[MAX_LINE_LENGTH];
+    char* line = buffer;
+    va_list args;
+
+    va_start(args, format);
+    int length = vsnprintf(buffer, MAX_LINE_LENGTH, format, args);
+    va_end(args);
+
+    if (length >= MAX_LINE_LENGTH) { // too long for the stack buffer
+        line = malloc(length + 1);
+        va_start(args, format);
+        vsnprintf(line, length + 1, format, args);
+        va_end(args);
+    }
+
+    bool sent;
+    const struct TraceContext* context = current_trace();
+    if (context != NULL &&
+            __atomic_load_n(&depot->traced, __ATOMIC_ACQUIRE)) {
+        sent = send_traced_line(depot, context, line, length);
+    } else {
+        sent = send_line_to_depot(depot, line, length);
+    }
+
+    if (line != buffer) {
+        free(line);
+    }
+    return sent;
+}
+
+/**
+ * Message handler for query messages, of the format Query:t, where t is the
+ * type of a resource, or * for every resource. Replies with Stock:t:q, where
+ * q is this depot's quantity of t, or for * with Stock:* followed by :t:q
+ * for every good with a non-zero quantity, in lexicographic order. Stock is
+ * read from the depot's inventory without dataLock, so queries never hold
+ * up other handlers.
+ *
+ * @param message: the query message to handle
+ * @param connection: a connection wrapper containing information for this
+ *      connection between depots
+ */
+void handle_query_message(char* message,
+        struct ConnectionWrapper* connection) {
+
+    if (!check_query_message(message)) {
+        return;
+    }
+
+    char* type = message + strlen("Query:");
+    struct Inventory* inventory = connection->inventory;
+    struct Depot* depot = &connection->connectedDepot->type.depot;
+
+    if (strcmp(type, "*") != 0) {
+        // a good never interned can't have been stocked
+        uint32_t good = find_good(type);
+        send_to_depot(depot, "Stock:%s:%lld", type,
+                good == NO_GOOD ? 0 : (long long)read_stock(inventory, good));
+        return;
+    }
+
+    struct StockEntry* entries;
+    uint32_t count = list_stock(inventory, &entries);
+
+    // each entry needs at most its name, 2 colons and a quantity
+    size_t capacity = strlen("Stock:*") + 1;
+    for (uint32_t i = 0; i < count; i++) {
+        capacity += strlen(good_name(entries[i].good)) + 2 +
+                MAX_QUANTITY_LENGTH;
+    }
+
+    char* line = malloc(capacity);
+    int length = sprintf(line, "Stock:*");
+    for (uint32_t i = 0; i < count; i++) {
+        length += sprintf(line + length, ":%s:%lld",
+                good_name(entries[i].good), (long long)entries[i].quantity);
+    }
+
+    send_line_to_depot(depot, line, length);
+    free(line);
+    free(entries);
+}
+
 /**
  * Message handler for connect message, of the format Connect:port,
  * where port is the port number to try and connect to. Facilitates
  * connection to a new port, given by its port number, unless the port
- * has already been connected to or closed.
+ * has already been connected to or closed. Depots hosted by this process
+ * are linked straight away in memory; otherwise the connect itself happens
+ * in the background, so a slow or unreachable port doesn't stall this
+ * connection's messages.
  *
  * @param message: the connect message to handle
  * @param connection: a connection wrapper containing information, with
@@ -188,26 +1057,34 @@ void handle_connect_message(char* message,
     port = strtok_r(message, ":", &message);
 
     // check for duplicate port nums (if it is already connected)...
-    struct LinkedList* node = connection->thisDepot;
-    while (node != NULL) { // process all nodes
-
-        if (node->type.depot.port == NULL) {
-            continue;
-        }
-
-        if (strcmp(node->type.depot.port, port) == 0) {
+    if (strcmp(connection->thisDepot->type.depot.port, port) == 0) {
+        return;
+    }
+    rcu_read_lock();
+    const struct NeighbourSet* neighbours =
+            read_neighbours(connection->thisDepot);
+    for (int i = 0; i < neighbours->count; i++) {
+        if (neighbours->neighbours[i].port != NULL &&
+                strcmp(neighbours->neighbours[i].port, port) == 0) {
+            rcu_read_unlock();
             return;
         }
-        node = node->next;
     }
+    rcu_read_unlock();
 
-    connect_to_depot(port, connection);
+    // link depots in this process directly, otherwise connect in the
+    // background, so this connection isn't held up
+    if (!connect_local_depot(port, connection)) {
+        dial_depot(port, connection);
+    }
 }
 
 /**
  * Message handler for all received messages from the channel.
  * Detects first letter/part of new received message on a channel, and
- * decides how to deal with it by calling sub-handler functions.
+ * decides how to deal with it by calling sub-handler functions. A follower
+ * ignores messages which would change its stock (or set up changes), as it
+ * only takes changes from its primary.
  *
  * @param message: the message to handle
  * @param connection: wrapper struct containing information about this
@@ -216,9 +1093,18 @@ void handle_connect_message(char* message,
 void handle_messages(char* message, struct ConnectionWrapper* connection) {
 
     char firstLetter = message[0];
-    char* firstThreeLetters;
+
+    if (is_follower(connection->inventory) && firstLetter != '\0' &&
+            strchr("DWTBE", firstLetter) != NULL) {
+        return;
+    }
 
     switch (firstLetter) {
+        case 'A':
+            // Apply (replicated changes)
+            handle_apply_message(message, connection);
+            break;
+
         case 'C':
             // Connect
             handle_connect_message(message, connection);
@@ -226,31 +1112,40 @@ void handle_messages(char* message, struct ConnectionWrapper* connection) {
 
         case 'D':
             // Deliver or defer
-            firstThreeLetters = malloc(sizeof(char) * 3);
-            strncpy(firstThreeLetters, message, 3);
-
-            if (strcmp(firstThreeLetters, "Del") == 0) {
+            if (strncmp(message, "Del", 3) == 0) {
                 handle_deliver_withdraw_message(message,
-                        connection->firstResource, connection->dataLock,
-                        DELIVER);
+                        connection->inventory, DELIVER);
             } else {
                 handle_defer_message(message, connection);
             }
-            free(firstThreeLetters);
             break;
 
         case 'W':
             // Withdraw
             handle_deliver_withdraw_message(message,
-                    connection->firstResource, connection->dataLock,
-                    WITHDRAW);
+                    connection->inventory, WITHDRAW);
             break;
 
         case 'T':
             // Transfer
             handle_transfer_message(message,
-                    connection->firstResource,
-                    connection->thisDepot, connection->dataLock);
+                    connection->inventory, connection->thisDepot);
+            break;
+
+        case 'B':
+            // Broadcast
+            handle_broadcast_message(message,
+                    connection->inventory, connection->thisDepot);
+            break;
+
+        case 'Q':
+            // Query
+            handle_query_message(message, connection);
+            break;
+
+        case 'R':
+            // Ring (shared memory link offer)
+            handle_ring_message(message, connection);
             break;
 
         case 'E':
@@ -259,16 +1154,210 @@ void handle_messages(char* message, struct ConnectionWrapper* connection) {
                     connection->dataLock);
             break;
 
+        case 'F':
+            // Follow
+            handle_follow_message(message, connection);
+            break;
+
+        case 'S':
+            // Snapshot (replicated stock) or Sync (stock after IM), replies
+            // to queries are ignored
+            if (strncmp(message, "Snapshot:", strlen("Snapshot:")) == 0) {
+                handle_snapshot_message(message, connection);
+            } else if (strncmp(message, "Sync:", strlen("Sync:")) == 0) {
+                handle_sync_message(message, connection);
+            } else if (strncmp(message, "Subscribe:",
+                    strlen("Subscribe:")) == 0) {
+                handle_subscribe_message(message, connection);
+            }
+            break;
+
         default:
             return;
     }
 }
 
+/**
+ * Tells a connection's action thread that one of its readers has finished,
+ * by writing a NULL message to the channel. This must be the last thing the
+ * reader does with the connection, as the connection is torn down once
+ * every reader has finished.
+ *
+ * @param connection: the connection whose reader has finished
+ */
+void reader_finished(struct ConnectionWrapper* connection) {
+    write_channel_wait(connection->channel, LANE_BULK, NULL);
+}
+
+/**
+ * Thread function which finishes for a reader which can't wait (see
+ * reader_finished_nowait): queues the lines it left stalled, then tells the
+ * connection's action thread it has finished, waiting for room in the
+ * channel on its behalf.
+ *
+ * @param arg: the finished reader (freed here)
+ * @return NULL (for thread function definition)
+ */
+static void* finish_thread(void* arg) {
+
+    struct FinishedReader* reader = (struct FinishedReader*)arg;
+    queue_stalled_lines(reader->connection, &reader->line, true);
+    reader_finished(reader->connection);
+    free(reader);
+    return NULL;
+}
+
+/**
+ * Finishes a reader which can't wait for room in the channel (the io_uring
+ * engine) once its connection has ended: passes on the rest of its partial
+ * line, then tells the action thread it has finished, as reader_finished
+ * does. If lines are still stalled, or the channel is full, a thread is
+ * started to wait for room instead, so the reader never blocks. Like
+ * reader_finished, this must be the last thing the reader does with the
+ * connection.
+ *
+ * @param connection: the connection whose reader has finished
+ * @param line: the reader's partial line (its stalled lines are taken)
+ */
+void reader_finished_nowait(struct ConnectionWrapper* connection,
+        struct PartialLine* line) {
+
+    finish_partial_line(connection, line, false);
+    if (queue_stalled_lines(connection, line, false) &&
+            write_channel(connection->channel, LANE_BULK, NULL)) {
+        return;
+    }
+
+    struct FinishedReader* reader = malloc(sizeof(struct FinishedReader));
+    reader->connection = connection;
+    reader->line = *line;
+    line->stalled = NULL;
+    line->stalledBytes = 0;
+
+    pthread_t tid;
+    pthread_create(&tid, &connectionThreadAttr, finish_thread, reader);
+}
+
+/**
+ * Stops every reader of a connection: shuts down the socket, so the socket
+ * reader sees end of file, and closes any shared memory link, so its reader
+ * stops once the link is empty. Each reader then calls reader_finished.
+ *
+ * @param connection: the connection to stop reading (only called by its
+ *      action thread)
+ */
+static void stop_readers(struct ConnectionWrapper* connection) {
+
+    connection->closing = true;
+    if (connection->to != NULL) {
+        shutdown(fileno(connection->to), SHUT_RDWR);
+    }
+
+    struct Depot* depot = &connection->connectedDepot->type.depot;
+    if (depot->shm != NULL) {
+        close_shm_link(depot->shm);
+    }
+}
+
+/**
+ * Frees a connected depot's list node, once no reader of an old neighbour
+ * set can still be using it.
+ *
+ * @param arg: the list node of the depot
+ */
+static void free_depot_node(void* arg) {
+
+    struct LinkedList* node = (struct LinkedList*)arg;
+    pthread_mutex_destroy(&node->type.depot.sendLock);
+    pthread_cond_destroy(&node->type.depot.room);
+    if (node->type.depot.mirror != NULL) {
+        free_inventory(node->type.depot.mirror);
+    }
+    if (node->type.depot.coalesced != NULL) {
+        free_coalescer(node->type.depot.coalesced);
+    }
+    if (node->type.depot.subscription != NULL) {
+        free_subscription(node->type.depot.subscription);
+    }
+
+    // the name and port are only copied once the IM message is handled
+    if (node->type.depot.port != NULL) {
+        budget_free(node->name);
+        budget_free(node->type.depot.port);
+    }
+    free(node);
+}
+
+/**
+ * Tears down a connection whose readers have all finished: stops any
+ * replication to or from the connected depot, removes it from this depot's
+ * list of neighbours, drops messages held back for it, frees its shared
+ * memory link and io_uring record, closes both streams, destroys the
+ * channel and frees the depot and wrapper. Older neighbour sets may still
+ * point to the depot (and its budget, in the wrapper), so those are freed
+ * once their readers have finished.
+ *
+ * @param connection: the connection to tear down (only called by its action
+ *      thread, as it exits)
+ */
+static void teardown_connection(struct ConnectionWrapper* connection) {
+
+    struct LinkedList* node = connection->connectedDepot;
+    struct Depot* depot = &node->type.depot;
+
+    stop_follower(connection);
+    stop_state_sync(connection);
+    replica_disconnected(connection);
+    end_subscription(connection);
+
+    // once unlinked, no other thread can find the depot to send to it
+    pthread_mutex_lock(connection->dataLock);
+    remove_item(connection->thisDepot, node);
+    publish_neighbours(connection->thisDepot);
+    pthread_mutex_unlock(connection->dataLock);
+
+    // wait out any send in progress, and stop any later ones
+    pthread_mutex_lock(&depot->sendLock);
+    depot->closed = true;
+    pthread_cond_broadcast(&depot->room);
+    while (depot->heldFirst != NULL) {
+        struct HeldLine* held = depot->heldFirst;
+        depot->heldFirst = held->next;
+        budget_free(held->line);
+        budget_free(held);
+    }
+    if (depot->uring != NULL) {
+        uring_remove_connection(depot->uring);
+    }
+    if (depot->shm != NULL) {
+        free_shm_link(depot->shm);
+    }
+    pthread_mutex_unlock(&depot->sendLock);
+
+    if (depot->to != NULL) {
+        fclose(depot->to);
+        fclose(depot->from);
+    }
+    destroy_channel(connection->channel, budget_free);
+    free(connection->channel);
+    destroy_ticket(&connection->sched);
+    pthread_cond_destroy(&connection->budgetFreed);
+    pthread_mutex_destroy(&connection->budgetLock);
+    capture_event(connection->captureId, CAPTURE_CLOSE, NULL, 0);
+
+    rcu_retire(node, free_depot_node);
+    rcu_retire(connection, free);
+
+    stat_add(STAT_CONNECTIONS_RECLAIMED, 1);
+}
+
 /**
  * Thread function for reading side of each connection, reads from connection
  * FILE* and places input into a threadsafe channel. There is one reader
  * thread per connection between depots. A corresponding action thread will
- * take input from the channel and perform actions upon it.
+ * take input from the channel and perform actions upon it. Lines longer
+ * than DEPOT_MAX_LINE are dropped (see read_into_line). The thread ends when
+ * the other depot closes the connection, or reading fails.
  *
  * @param arg: connection wrapper struct containing all info relevant to a
  *      single connection
@@ -277,30 +1366,52 @@ void handle_messages(char* message, struct ConnectionWrapper* connection) {
 void* reader_thread(void* arg) {
 
     struct ConnectionWrapper* connection = (struct ConnectionWrapper*)arg;
-    char buffer[MAX_BUFFER_LENGTH];
-    char* string;
+    struct PartialLine line = {NULL, 0, 0, false, NULL, NULL, 0};
+    char buffer[READ_CHUNK_LENGTH];
+    place_thread(ROLE_IO);
+
+    // read at most a chunk at a time, stopping on EOF or error
+    while (fgets(buffer, READ_CHUNK_LENGTH, connection->from) != NULL) {
+        note_thread_cpu();
+        read_into_line(connection, &line, buffer, strlen(buffer), true);
+    }
 
-    while (1) {
-        // break on EOF
-        while ((string = fgets(buffer, MAX_BUFFER_LENGTH,
-                connection->from))) {
-            if (string[strlen(string) - 1] == '\n') {
-                string[strlen(string) - 1] = '\0';
-            }
+    finish_partial_line(connection, &line, true);
+    reader_finished(connection);
+    return NULL;
+}
 
-            // write to queue
-            write_channel(connection->channel, (void*) strdup(string));
-        }
+/**
+ * Lets a connection's readers know the action thread has freed one of its
+ * messages, making room in the channel and the budget: readers waiting for
+ * the budget are woken (see wait_for_budget), and an io_uring reader which
+ * paused for room is handed back to the engine (see uring_resume).
+ *
+ * @param connection: the connection whose message was freed
+ */
+static void message_freed(struct ConnectionWrapper* connection) {
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&connection->budgetWaiters, __ATOMIC_RELAXED) > 0) {
+        pthread_mutex_lock(&connection->budgetLock);
+        pthread_cond_broadcast(&connection->budgetFreed);
+        pthread_mutex_unlock(&connection->budgetLock);
     }
 
-    return NULL;
+    struct Depot* depot = &connection->connectedDepot->type.depot;
+    if (depot->uring != NULL) {
+        uring_resume(depot->uring);
+    }
 }
 
 /**
  * Thread function which reads from a threadsafe channel (by which data
  * is input through the reader_thread using the current connection FILE*s).
  * Messages are read from the channel, handled, and sent to a message handler
- * to determine how to treat it, and to perform actions.
+ * to determine how to treat it, and to perform actions. Once the first
+ * reader finishes (or the IM message is invalid), every reader is stopped;
+ * once they have all finished, the connection is torn down and the thread
+ * ends.
  *
  * @param arg: connection wrapper struct containing all info relevant to a
  *      single connection
@@ -313,79 +1424,259 @@ void* action_thread(void* arg) {
 
     bool expectedFirst = true;
     bool connectionOpen = true;
+    place_thread(ROLE_WORKER);
+
+    while (connection->readers > 0) {
+        if (!read_channel(connection->channel, (void**) &string)) {
+            continue;
+        }
+        note_thread_cpu();
 
-    // wait to check IM message before handling anything else
-    while (expectedFirst) {
-        if (read_channel(connection->channel, (void**) &string)) {
+        if (string == NULL) { // a reader finished
+            connection->readers--;
+            stop_readers(connection);
 
+        } else if (expectedFirst) {
+            // check IM message before handling anything else
             if (!handle_im_message(string, connection)) {
-                connectionOpen = false;
+                connectionOpen = false; // connection never opens
+                stop_readers(connection);
+            } else {
+                set_ticket_weight(&connection->sched,
+                        connection->connectedDepot->name);
+                offer_shm_link(connection);
+                send_state_sync(connection);
             }
             expectedFirst = false;
+            __atomic_store_n(&connection->greeted, true, __ATOMIC_RELEASE);
+
+        } else if (connectionOpen) {
+            // take turns with other connections (see sched.h)
+            sched_begin(&connection->sched);
+            struct TracedMessage traced;
+            char* message = begin_traced_message(string,
+                    connection->thisDepot->name, &traced);
+            handle_messages(message, connection);
+            end_traced_message(&traced);
+            return_credits(connection);
+            sched_end(&connection->sched,
+                    channel_pending(connection->channel));
         }
+        budget_free(string);
+        message_freed(connection);
     }
 
-    // if IM message not received, connection never opens
-    while (connectionOpen) {
-        if (read_channel(connection->channel, (void**) &string)) {
+    teardown_connection(connection);
+    return NULL;
+}
 
-            handle_messages(string, connection);
-        }
-    }
+/**
+ * Sets up the shared attributes for connection threads: detached (they are
+ * never joined), with a stack far smaller than the default.
+ */
+static void init_connection_thread_attr(void) {
 
-    return NULL;
+    pthread_attr_init(&connectionThreadAttr);
+    pthread_attr_setdetachstate(&connectionThreadAttr,
+            PTHREAD_CREATE_DETACHED);
+    pthread_attr_setstacksize(&connectionThreadAttr,
+            CONNECTION_STACK_SIZE);
 }
 
 /**
- * Called by the listening connection_thread, and when connect_to_depot
- * is called, sets up essential information for a new connection threads
- * to be created (in the connection wrapper struct), starts a reader_thread
- * and a writer_thread, then sends and IM connect message to the depot
- * at the other end of the connection.
+ * Sets up essential information for a new connection's threads (in the
+ * connection wrapper struct), starts reading from the other depot, sends it
+ * an IM connect message, then starts an action_thread. Connections between
+ * two depots hosted by this process have no streams, and are read from and
+ * sent on with an in-memory link instead. The threads are detached and use
+ * a small stack, to keep per connection setup cheap.
  *
  * @param connection: the connection wrapper struct containing all info
  *      to set up new reader/action threads
  * @param to: a FILE* for sending messages to the other connected depot
  * @param from: a FILE* for receiving messages from the other connected depot
+ * @param link: an in-memory link to the other depot, instead of streams
  */
-void start_communication_threads(struct ConnectionWrapper* connection,
-        int to, int from) {
+static void start_connection(struct ConnectionWrapper* connection,
+        FILE* to, FILE* from, struct ShmLink* link) {
 
     // create depot object and assign streams
     pthread_mutex_lock(connection->dataLock);
 
     struct LinkedList* newDepot = add_item(connection->thisDepot);
-    newDepot->type.depot.to = fdopen(to, "w");
-    newDepot->type.depot.from = fdopen(from, "r");
+    newDepot->type.depot.to = to;
+    newDepot->type.depot.from = from;
     newDepot->name = "new";
+    newDepot->type.depot.port = NULL;
+    newDepot->type.depot.unixCapable = false;
+    newDepot->type.depot.shm = link;
+    newDepot->type.depot.uring = NULL;
+    newDepot->type.depot.creditFlow = false;
+    newDepot->type.depot.credits = 0;
+    newDepot->type.depot.heldFirst = NULL;
+    newDepot->type.depot.heldLast = NULL;
+    newDepot->type.depot.closed = false;
+    newDepot->type.depot.traced = false;
+    newDepot->type.depot.coalesced = coalescing() ?
+            new_coalescer(connection->inventory) : NULL;
+    newDepot->type.depot.subscription = NULL;
+    init_budget(&connection->budget, get_config()->connectionMemory,
+            global_budget());
+    newDepot->type.depot.budget = &connection->budget;
+    connection->creditWindow = 0;
+    connection->consumed = 0;
+    connection->lineBytes = 0;
+    pthread_mutex_init(&connection->budgetLock, NULL);
+    pthread_cond_init(&connection->budgetFreed, NULL);
+    connection->budgetWaiters = 0;
+    connection->pendingTrace = 0;
+    connection->captureId = capturing() ? capture_id() : 0;
+    capture_event(connection->captureId, CAPTURE_OPEN, NULL, 0);
+    init_ticket(&connection->sched);
+    connection->readers = 1;
+    connection->closing = false;
+    connection->greeted = false;
+    connection->stateSync = false;
+    newDepot->type.depot.mirror = NULL;
+    newDepot->type.depot.mirrorGoods = 0;
+    newDepot->type.depot.mirrorState = MIRROR_RECEIVING;
+    connection->syncRunning = false;
+    connection->syncStopping = false;
+    pthread_cond_init(&newDepot->type.depot.room, NULL);
+    pthread_mutex_init(&newDepot->type.depot.sendLock, NULL);
     connection->connectedDepot = newDepot;
 
-    struct Channel* channel = new_channel(); // set up new channel
+    // set up new channel
+    struct Channel* channel = new_channel(get_config()->bulkLane,
+            get_config()->controlBurst);
     connection->channel = channel;
 
     connection->to = newDepot->type.depot.to;
     connection->from = newDepot->type.depot.from;
+    publish_neighbours(connection->thisDepot);
 
     pthread_mutex_unlock(connection->dataLock);
 
-    // start threads (read and action)
-    pthread_create(&newDepot->type.depot.readerId, 0, reader_thread,
-            connection); // reader thread
-    pthread_create(&newDepot->type.depot.writerId, 0, action_thread,
-            connection); // action thread
+    // start reading, the io_uring engine reads instead of a reader thread
+    // if it is in use
+    pthread_once(&threadAttrOnce, init_connection_thread_attr);
+    if (link != NULL) {
+        start_shm_reader(link, connection);
+    } else if (uring_enabled()) {
+        newDepot->type.depot.uring = uring_add_connection(dup(fileno(to)),
+                connection);
+    } else {
+        pthread_create(&newDepot->type.depot.readerId,
+                &connectionThreadAttr, reader_thread,
+                connection); // reader thread
+    }
 
-    // send IM connect message to new connected depot
-    fprintf(connection->connectedDepot->type.depot.to, "IM:%s:%s\n",
+    // send IM connect message to new connected depot, with options, before
+    // the action thread starts (and so before it could tear down the
+    // connection)
+    char options[MAX_LINE_LENGTH] = "";
+    if (get_config()->unixSockets) {
+        strcat(options, ":unix");
+    }
+    if (get_config()->stateSync) {
+        strcat(options, ":sync");
+    }
+    if (tracing()) {
+        strcat(options, ":trace");
+    }
+    if (get_config()->creditWindow > 0) {
+        snprintf(options + strlen(options), MAX_LINE_LENGTH - strlen(options),
+                ":credit=%d", get_config()->creditWindow);
+    }
+    send_to_depot(&newDepot->type.depot, "IM:%s:%s%s",
             connection->thisDepot->type.depot.port,
-            connection->thisDepot->name);
-    fflush(connection->connectedDepot->type.depot.to);
+            connection->thisDepot->name, options);
+
+    pthread_create(&newDepot->type.depot.writerId, &connectionThreadAttr,
+            action_thread, connection); // action thread
+}
+
+/**
+ * Called by the listening connection_thread, and when an outbound connect
+ * completes (see dial_depot), starts communication with the depot at the
+ * other end of a socket (see start_connection). If the process is out of
+ * file descriptors (or memory) for the connection's streams, the socket is
+ * closed and the connection dropped.
+ *
+ * @param connection: the connection wrapper struct containing all info
+ *      to set up new reader/action threads
+ * @param to: a file descriptor for sending messages to the other depot
+ * @param from: a file descriptor for receiving messages from the other
+ *      depot, or -1 if it couldn't be duplicated
+ */
+void start_communication_threads(struct ConnectionWrapper* connection,
+        int to, int from) {
+
+    FILE* toStream = fdopen(to, "w");
+    FILE* fromStream = from == -1 ? NULL : fdopen(from, "r");
+    if (toStream == NULL || fromStream == NULL) {
+        if (toStream != NULL) {
+            fclose(toStream);
+        } else {
+            close(to);
+        }
+        if (from != -1) {
+            close(from);
+        }
+        free(connection);
+        return;
+    }
+    start_connection(connection, toStream, fromStream, NULL);
+}
+
+/**
+ * Connects to a depot hosted by this process, if the port belongs to one,
+ * with an in-memory link instead of a socket. Both depots' ends of the
+ * connection are started straight away.
+ *
+ * @param port: the port to connect to
+ * @param connection: a connection wrapper for the depot connecting
+ * @return true if the port belongs to a depot hosted by this process, and
+ *      the two have been connected
+ */
+bool connect_local_depot(const char* port,
+        struct ConnectionWrapper* connection) {
+
+    struct Tenant* tenant = find_tenant(port);
+    if (tenant == NULL) {
+        return false;
+    }
+
+    struct ShmLink* theirs;
+    struct ShmLink* ours = create_memory_link(&theirs);
+    if (ours == NULL) {
+        return false;
+    }
+
+    struct ConnectionWrapper* near = new_connection_wrapper(
+            connection->thisDepot, connection->inventory,
+            connection->firstDeferral, connection->dataLock);
+    struct ConnectionWrapper* far = new_connection_wrapper(tenant->thisDepot,
+            tenant->inventory, tenant->firstDeferral, &tenant->dataLock);
+    near->dialed = true;
+
+    start_connection(near, NULL, NULL, ours);
+    start_connection(far, NULL, NULL, theirs);
+    return true;
 }
 
 /**
  * Thread function which acts as a server by listening for new connections.
- * Once a connection is received, a new connection wrapper is created for it
- * and then passed to start_communication_threads to start threads for the
- * new connection.
+ * There may be several of these threads, each with its own listening socket
+ * bound to the same port (with SO_REUSEPORT), so the kernel spreads incoming
+ * connections between them. The listening socket is non-blocking: the thread
+ * waits until it is readable, then accepts every pending connection in one
+ * batch. Each accepted connection gets a new connection wrapper, which is
+ * passed to start_communication_threads to start threads for it. The batch
+ * only ends once no connections are left (EAGAIN). While accept fails for
+ * want of file descriptors or memory, the pending connection keeps the
+ * socket readable, so the thread backs off for ACCEPT_BACKOFF_NS before
+ * trying again, rather than spinning.
  *
  * @param arg: a blank wrapper for a connection struct, to be overridden
  *      when a new connection is accepted
@@ -395,26 +1686,40 @@ void* connection_thread(void* arg) {
 
     struct ConnectionWrapper* wrapper = (struct ConnectionWrapper*)arg;
     struct ConnectionWrapper* connection;
-    int server = wrapper->serverSocket;
+    struct pollfd listener = {.fd = wrapper->serverSocket, .events = POLLIN};
     int connFd;
-    int connFd2;
+    place_thread(ROLE_ACCEPTOR);
 
     while (1) {
-        // accept connection request
-        connFd = accept(server, 0, 0);
-        connFd2 = dup(connFd);
+        if (poll(&listener, 1, -1) < 1) {
+            continue;
+        }
+        note_thread_cpu();
+
+        // accept connection requests until none are left
+        while (1) {
+            connFd = accept4(listener.fd, 0, 0, SOCK_CLOEXEC);
+            if (connFd == -1) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    break;
+                }
+                if (errno != EINTR && errno != ECONNABORTED) {
+                    struct timespec pause = {0, ACCEPT_BACKOFF_NS};
+                    nanosleep(&pause, NULL);
+                    stat_add(STAT_ACCEPT_BACKOFFS, 1);
+                }
+                continue;
+            }
 
-        // create unique connection wrapper for each new connection
-        connection = malloc(sizeof(struct ConnectionWrapper));
-        connection->thisDepot = wrapper->thisDepot;
-        connection->firstDeferral = wrapper->firstDeferral;
-        connection->dataLock = wrapper->dataLock;
-        connection->firstResource = wrapper->firstResource;
+            // create unique connection wrapper for each new connection
+            connection = new_connection_wrapper(wrapper->thisDepot,
+                    wrapper->inventory, wrapper->firstDeferral,
+                    wrapper->dataLock);
 
-        // start threads for communication between depots
-        start_communication_threads(connection, connFd, connFd2);
+            // start threads for communication between depots
+            start_communication_threads(connection, connFd, dup(connFd));
+        }
     }
-    free(connection);
     return NULL;
 }
 
@@ -423,7 +1728,7 @@ void* connection_thread(void* arg) {
  * for an individual connection. This is to be passed to threads.
  *
  * @param thisDepot: this depot, in a list of all connected depots
- * @param firstResource: first resource in this depots resource list
+ * @param inventory: this depot's inventory
  * @param firstDeferral:  first deferral message, for linked list of potential
  *      deferred message operations
  * @param dataLock: mutex protecting this depots structs and lists
@@ -431,36 +1736,102 @@ void* connection_thread(void* arg) {
  *      threads
  */
 struct ConnectionWrapper* new_connection_wrapper(struct LinkedList* thisDepot,
-        struct LinkedList* firstResource, struct LinkedList* firstDeferral,
+        struct Inventory* inventory, struct LinkedList* firstDeferral,
         pthread_mutex_t* dataLock) {
 
     struct ConnectionWrapper* connection =
             malloc(sizeof(struct ConnectionWrapper));
 
     connection->thisDepot = thisDepot;
-    connection->firstResource = firstResource;
+    connection->inventory = inventory;
     connection->firstDeferral = firstDeferral;
     connection->dataLock = dataLock;
+    connection->dialed = false;
+    connection->follower = NULL;
 
     return connection;
 }
 
+/**
+ * Creates a non-blocking listening socket bound to the given address, which
+ * other sockets may also be bound to (with SO_REUSEPORT).
+ *
+ * @param address: the address (and port) to bind to
+ * @return the listening socket, or -1 if an error occurred
+ */
+static int open_listener(struct sockaddr_in* address) {
+
+    int server = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+            0);
+    int enable = 1;
+    setsockopt(server, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(int));
+
+    // bind server socket to port
+    if (bind(server, (struct sockaddr*)address, sizeof(struct sockaddr_in))) {
+        close(server);
+        return -1;
+    }
+
+    if (listen(server, get_config()->listenBacklog)) {
+        close(server);
+        return -1;
+    }
+
+    return server;
+}
+
+/**
+ * Creates a non-blocking listening socket in the abstract Unix domain
+ * namespace, named after this depot's TCP port, so that depots on the same
+ * host can skip the loopback TCP stack.
+ *
+ * @param port: this depot's TCP port, as a string
+ * @return the listening socket, or -1 if an error occurred
+ */
+static int open_unix_listener(const char* port) {
+
+    struct sockaddr_un address;
+    socklen_t len = unix_address(port, &address);
+
+    int server = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+            0);
+    if (bind(server, (struct sockaddr*)&address, len)) {
+        close(server);
+        return -1;
+    }
+
+    if (listen(server, get_config()->listenBacklog)) {
+        close(server);
+        return -1;
+    }
+
+    return server;
+}
+
 /**
  * Starts the server for this specific depot, prints the port number,
- * and creates a thread to handle incoming connection requests from
- * other depots.
+ * and creates the configured number of acceptor threads to handle incoming
+ * connection requests from other depots. Unless disabled, another acceptor
+ * thread serves a Unix domain socket for depots on the same host. If the
+ * io_uring engine is selected (and supported), it accepts on every
+ * listening socket instead of acceptor threads.
  *
  * @param thisDepot: this depot, in a list of all connected depots
- * @param firstResource: first resource in this depots resource list
+ * @param inventory: this depot's inventory
  * @param firstDeferral:  first deferral message, for linked list of potential
  *      deferred message operations
  * @param dataLock: mutex protecting this depots structs and lists
- * @return the thread id of the server (or -1 if an error occurred)
+ * @return the thread id of the first acceptor (or -1 if an error occurred,
+ *      or the io_uring engine is accepting instead)
  */
 pthread_t start_server(struct LinkedList* thisDepot,
-        struct LinkedList* firstResource, struct LinkedList* firstDeferral,
+        struct Inventory* inventory, struct LinkedList* firstDeferral,
         pthread_mutex_t* dataLock) {
 
+    if (get_config()->ioEngine == IO_ENGINE_URING && !uring_enabled()) {
+        start_uring_engine(); // falls back to threads if unsupported
+    }
+
     struct addrinfo* ai = 0;
     struct addrinfo hints;
     memset(&hints, 0, sizeof(struct addrinfo));
@@ -470,21 +1841,20 @@ pthread_t start_server(struct LinkedList* thisDepot,
 
     int err; // start server on any ephemeral port
     if ((err = getaddrinfo("localhost", 0, &hints, &ai))) {
-        freeaddrinfo(ai);
         fprintf(stderr, "%s\n", gai_strerror(err));
         return -1;  // could not work out the address
     }
 
-    int server = socket(AF_INET, SOCK_STREAM, 0); // socket - default protocol
+    struct sockaddr_in ad;
+    memcpy(&ad, ai->ai_addr, sizeof(struct sockaddr_in));
+    freeaddrinfo(ai);
 
-    // bind server socket to port
-    if (bind(server, (struct sockaddr*)ai->ai_addr, sizeof(struct sockaddr))) {
+    int server = open_listener(&ad);
+    if (server == -1) {
         return -1;
     }
 
-    struct sockaddr_in ad; // Which port did we get?
-    memset(&ad, 0, sizeof(struct sockaddr_in));
-    socklen_t len = sizeof(struct sockaddr_in);
+    socklen_t len = sizeof(struct sockaddr_in); // Which port did we get?
     if (getsockname(server, (struct sockaddr*)&ad, &len)) {
         return -1;
     }
@@ -496,58 +1866,33 @@ pthread_t start_server(struct LinkedList* thisDepot,
 
     char portBuffer[6];
     snprintf(portBuffer, 6, "%u", port);
-    thisDepot->type.depot.port = portBuffer;
-
-    if (listen(server, MAX_CONNECTIONS)) { // listen for connections
-        return -1;
-    }
-
-    // handle connection requests with a thread
-    struct ConnectionWrapper* connection = new_connection_wrapper(thisDepot,
-            firstResource, firstDeferral, dataLock);
-    connection->serverSocket = server;
-    pthread_t tid;
-    pthread_create(&tid, 0, connection_thread, connection);
-    return tid;
-}
-
-/**
- * Connects to another depot given by the specified port number.
- * @param port: the port number to connect to
- * @param wrapper: the connection wrapper containing information to start
- *      a new connection
- * @return integer error status (0 if none detected)
- */
-int connect_to_depot(const char* port,
-        struct ConnectionWrapper* wrapper) {
-
-    struct ConnectionWrapper* connection;
-    struct addrinfo* ai = 0;
-    struct addrinfo hints;
-    memset(&hints, 0, sizeof(struct addrinfo));
-    hints.ai_family = AF_INET;  // IPv6  for generic could use AF_UNSPEC
-    hints.ai_socktype = SOCK_STREAM;
+    thisDepot->type.depot.port = strdup(portBuffer);
+
+    // handle connection requests with threads, one per listening socket
+    pthread_t firstTid = -1;
+    int acceptors = get_config()->acceptorThreads;
+    for (int i = 0; i < acceptors + 1; i++) {
+        if (i == acceptors) { // extra acceptor for the unix socket
+            if (!get_config()->unixSockets ||
+                    (server = open_unix_listener(portBuffer)) == -1) {
+                break;
+            }
+        } else if (i > 0 && (server = open_listener(&ad)) == -1) {
+            continue; // keep the acceptors which did start
+        }
 
-    if ((getaddrinfo("localhost", port, &hints, &ai))) {
-        freeaddrinfo(ai);
-        return 1;   // could not work out the address
-    }
+        struct ConnectionWrapper* connection = new_connection_wrapper(
+                thisDepot, inventory, firstDeferral, dataLock);
+        connection->serverSocket = server;
+        if (uring_watch_listener(server, connection)) {
+            continue;
+        }
 
-    int depotFd = socket(AF_INET, SOCK_STREAM, 0);
-    if (connect(depotFd, (struct sockaddr*)ai->ai_addr,
-            sizeof(struct sockaddr))) {
-        return 3;
+        pthread_t tid;
+        pthread_create(&tid, 0, connection_thread, connection);
+        if (i == 0) {
+            firstTid = tid;
+        }
     }
-    int depotFd2 = dup(depotFd);
-
-    // create new connection struct
-    connection = malloc(sizeof(struct ConnectionWrapper));
-    connection->thisDepot = wrapper->thisDepot;
-    connection->firstDeferral = wrapper->firstDeferral;
-    connection->dataLock = wrapper->dataLock;
-    connection->firstResource = wrapper->firstResource;
-
-    start_communication_threads(connection, depotFd, depotFd2);
-
-    return 0;
-}
\ No newline at end of file
+    return firstTid;
+}
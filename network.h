@@ -3,33 +3,117 @@
 
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <netdb.h>
 #include <string.h>
 #include <unistd.h>
 #include <pthread.h>
 #include <semaphore.h>
+#include "budget.h"
+#include "sched.h"
 
 struct LinkedList;
+struct Inventory;
 struct Channel;
+struct Follower;
 
 /**
  * Connection wrapper struct, which contains all integral information
  * for a single connection to be set up between two depots. This is passed
  * to threads and subsequent functions that deal with depot communications.
+ * Follower is set if the depot at the other end follows this one. State
+ * sync is set if both depots asked to send each other their stock; it is
+ * sent by the thread syncId while syncRunning, until it finishes or is told
+ * to stop with syncStopping. Readers held back for memory wait on
+ * budgetFreed, and are counted in budgetWaiters. Greeted is set once the
+ * action thread has checked the first message (the IM), and until then
+ * every line is queued in the bulk lane, in the order it was read.
  */
 struct ConnectionWrapper {
 
     struct LinkedList* thisDepot;
     struct LinkedList* connectedDepot;
-    struct LinkedList* firstResource;
+    struct Inventory* inventory;
     struct LinkedList* firstDeferral;
     struct Channel* channel;
     pthread_mutex_t* dataLock;
     int serverSocket;
+    bool dialed;
+    int creditWindow;
+    int consumed;
+    struct MemBudget budget;
+    size_t lineBytes;
+    pthread_mutex_t budgetLock;
+    pthread_cond_t budgetFreed;
+    int budgetWaiters;
+    uint32_t captureId;
+    uint64_t pendingTrace;
+    uint64_t pendingSpan;
+    long long pendingTraceNs;
+    struct SchedTicket sched;
+    int readers;
+    bool closing;
+    bool greeted;
     FILE* to;
     FILE* from;
+    struct Follower* follower;
+    bool stateSync;
+    pthread_t syncId;
+    bool syncRunning;
+    bool syncStopping;
 };
 
+struct Depot;
+
+/**
+ * A line a reader couldn't queue without waiting, kept until the channel
+ * has room: the queued copy (charged to the connection's budget, and
+ * counted in lineBytes), its size, and the lane it goes in.
+ */
+struct StalledLine {
+    char* copy;
+    size_t size;
+    int lane;
+    struct StalledLine* next;
+};
+
+/**
+ * A line being put together from the pieces a reader reads off a
+ * connection. Its buffer is charged to the connection's budget (and counted
+ * in lineBytes). A line which grows past the configured maximum is
+ * discarded up to its newline. Lines which a reader that can't wait (the
+ * io_uring engine) couldn't queue are kept in order in stalled, and every
+ * later line joins them, until queue_stalled_lines gets them all queued.
+ */
+struct PartialLine {
+    char* data;
+    size_t length;
+    size_t capacity;
+    bool discarding;
+    struct StalledLine* stalled;
+    struct StalledLine* lastStalled;
+    size_t stalledBytes;
+};
+
+/**
+ * A message held back from a depot until it grants more credits.
+ */
+struct HeldLine {
+    char* line;
+    int length;
+    struct HeldLine* next;
+};
+
+bool send_line_to_depot(struct Depot* depot, const char* line, int length);
+
+bool send_to_depot(struct Depot* depot, const char* format, ...);
+
+bool wait_for_send_room(struct Depot* depot, bool* stop);
+
+bool has_send_room(struct Depot* depot);
+
+void wake_send_waiters(struct Depot* depot);
+
 void* defer_thread(void* arg);
 
 void handle_defer_message(char* message,
@@ -38,19 +122,57 @@ void handle_defer_message(char* message,
 bool handle_im_message(char* message,
         struct ConnectionWrapper* connection);
 
+void offer_shm_link(struct ConnectionWrapper* connection);
+
+void handle_query_message(char* message,
+        struct ConnectionWrapper* connection);
+
+void handle_credit_message(char* message,
+        struct ConnectionWrapper* connection);
+
+void return_credits(struct ConnectionWrapper* connection);
+
+void handle_ring_message(char* message,
+        struct ConnectionWrapper* connection);
+
 void handle_connect_message(char* message,
         struct ConnectionWrapper* connection);
 
 void handle_messages(char* message, struct ConnectionWrapper* connection);
 
+void read_into_line(struct ConnectionWrapper* connection,
+        struct PartialLine* line, const char* data, size_t length,
+        bool wait);
+
+void finish_partial_line(struct ConnectionWrapper* connection,
+        struct PartialLine* line, bool wait);
+
+bool queue_stalled_lines(struct ConnectionWrapper* connection,
+        struct PartialLine* line, bool wait);
+
+void reader_finished(struct ConnectionWrapper* connection);
+
+void reader_finished_nowait(struct ConnectionWrapper* connection,
+        struct PartialLine* line);
+
 void* reader_thread(void* arg);
 
 void* action_thread(void* arg);
 
+void* connection_thread(void* arg);
+
 pthread_t start_server(struct LinkedList* thisDepot,
-        struct LinkedList* firstResource, struct LinkedList* firstDeferral,
+        struct Inventory* inventory, struct LinkedList* firstDeferral,
         pthread_mutex_t* dataLock);
 
-int connect_to_depot(const char* port, struct ConnectionWrapper* connection);
+bool connect_local_depot(const char* port,
+        struct ConnectionWrapper* connection);
+
+void start_communication_threads(struct ConnectionWrapper* connection,
+        int to, int from);
+
+struct ConnectionWrapper* new_connection_wrapper(struct LinkedList* thisDepot,
+        struct Inventory* inventory, struct LinkedList* firstDeferral,
+        pthread_mutex_t* dataLock);
 
 #endif //NETWORK_H
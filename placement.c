@@ -0,0 +1,309 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include "placement.h"
+#include "config.h"
+
+// How many notes a thread makes between samples of its CPU time and CPU
+#define CPU_SAMPLE_INTERVAL 64
+
+// Names of the roles as displayed, in ROLE_* order
+static const char* roleNames[THREAD_ROLES] = {
+    "io", "worker", "acceptor", "report"
+};
+
+// The CPUs each role's threads may run on, if set
+static cpu_set_t roleCpus[THREAD_ROLES];
+static bool rolePinned[THREAD_ROLES];
+
+// Every thread's record, only ever pushed to
+static struct ThreadRecord* records = NULL;
+
+// CPU time and migrations of threads which have ended, by role
+static unsigned long long endedCpuNs[THREAD_ROLES];
+static unsigned long endedMigrations[THREAD_ROLES];
+
+// Gives each thread's record back when the thread ends
+static pthread_once_t recordKeyOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t recordKey;
+static __thread struct ThreadRecord* self = NULL;
+
+/**
+ * Reads a list of CPUs, such as "0-3,8", into a CPU set.
+ *
+ * @param list: the list to read
+ * @param set: the set to fill in
+ * @return true if the list named at least one CPU, false otherwise
+ */
+static bool parse_cpu_list(const char* list, cpu_set_t* set) {
+
+    CPU_ZERO(set);
+    const char* next = list;
+    while (*next != '\0') {
+        char* end;
+        long first = strtol(next, &end, 10);
+        long last = first;
+        if (end == next || first < 0) {
+            return false;
+        }
+        if (*end == '-') {
+            next = end + 1;
+            last = strtol(next, &end, 10);
+            if (end == next || last < first) {
+                return false;
+            }
+        }
+        for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+            CPU_SET(cpu, set);
+        }
+        if (*end != ',' && *end != '\0') {
+            return false;
+        }
+        next = *end == ',' ? end + 1 : end;
+    }
+
+    return CPU_COUNT(set) > 0;
+}
+
+/**
+ * Reads the CPU sets given to each role (DEPOT_CPUS_IO, DEPOT_CPUS_WORKER,
+ * DEPOT_CPUS_ACCEPTOR and DEPOT_CPUS_REPORT). Must be called once in main,
+ * after load_config and before any threads are started.
+ */
+void init_placement(void) {
+
+    const struct Config* config = get_config();
+    const char* lists[THREAD_ROLES] = {
+        config->ioCpus, config->workerCpus, config->acceptorCpus,
+        config->reportCpus
+    };
+
+    for (int role = 0; role < THREAD_ROLES; role++) {
+        rolePinned[role] = lists[role] != NULL &&
+                parse_cpu_list(lists[role], &roleCpus[role]);
+    }
+}
+
+/**
+ * Samples the calling thread's CPU time into its record.
+ *
+ * @param record: the calling thread's record
+ */
+static void sample_cpu_time(struct ThreadRecord* record) {
+
+    struct timespec used;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &used);
+    __atomic_store_n(&record->cpuNs,
+            (unsigned long long)used.tv_sec * 1000000000 + used.tv_nsec,
+            __ATOMIC_RELAXED);
+}
+
+/**
+ * Reads how many times the kernel has moved a thread of this process
+ * between CPUs, from its scheduler statistics. These are only there if the
+ * kernel was built with CONFIG_SCHED_DEBUG.
+ *
+ * @param tid: the thread's ID
+ * @return the number of migrations, or -1 if they couldn't be read
+ */
+static long kernel_migrations(int tid) {
+
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/self/task/%d/sched", tid);
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        return -1;
+    }
+
+    static const char field[] = "se.nr_migrations";
+    long migrations = -1;
+    char line[256];
+    while (fgets(line, sizeof(line), file) != NULL) {
+        char* colon = strchr(line, ':');
+        if (strncmp(line, field, sizeof(field) - 1) == 0 && colon != NULL) {
+            migrations = strtol(colon + 1, NULL, 10);
+            break;
+        }
+    }
+    fclose(file);
+    return migrations;
+}
+
+/**
+ * Gets how many times a thread has moved CPU since it was placed: as
+ * counted by the kernel if it shows its count, otherwise as seen by the
+ * thread's samples, which miss any moves made (and undone) between them.
+ *
+ * @param record: the thread's record
+ * @return the number of migrations
+ */
+static unsigned long thread_migrations(struct ThreadRecord* record) {
+
+    long base = __atomic_load_n(&record->migrationsBase, __ATOMIC_RELAXED);
+    if (base >= 0) {
+        long migrations = kernel_migrations(record->tid);
+        if (migrations >= base) {
+            return migrations - base;
+        }
+    }
+    return __atomic_load_n(&record->migrations, __ATOMIC_RELAXED);
+}
+
+/**
+ * Adds a thread's CPU time and migrations to its role's totals, and marks
+ * its record free for another thread, once the thread ends.
+ *
+ * @param arg: the record to release
+ */
+static void release_record(void* arg) {
+
+    struct ThreadRecord* record = (struct ThreadRecord*)arg;
+    sample_cpu_time(record);
+    __atomic_add_fetch(&endedCpuNs[record->role],
+            __atomic_load_n(&record->cpuNs, __ATOMIC_RELAXED),
+            __ATOMIC_RELAXED);
+    __atomic_add_fetch(&endedMigrations[record->role],
+            thread_migrations(record), __ATOMIC_RELAXED);
+    __atomic_store_n(&record->inUse, false, __ATOMIC_RELEASE);
+}
+
+/**
+ * Creates the key which releases each thread's record when it ends.
+ */
+static void make_record_key(void) {
+    pthread_key_create(&recordKey, release_record);
+}
+
+/**
+ * Claims a record for this thread, reusing a free one if there is one.
+ *
+ * @return the claimed record, marked in use
+ */
+static struct ThreadRecord* claim_record(void) {
+
+    struct ThreadRecord* record = __atomic_load_n(&records,
+            __ATOMIC_ACQUIRE);
+    for (; record != NULL; record = record->next) {
+        bool expected = false;
+        if (__atomic_compare_exchange_n(&record->inUse, &expected, true,
+                false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            return record;
+        }
+    }
+
+    record = calloc(1, sizeof(struct ThreadRecord));
+    record->inUse = true;
+    record->next = __atomic_load_n(&records, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&records, &record->next, record,
+            false, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    }
+    return record;
+}
+
+/**
+ * Pins the calling thread to the CPUs configured for its role, if any, and
+ * starts keeping its record (see note_thread_cpu). Memory a thread touches
+ * first is placed on its NUMA node by Linux, so placing threads this way
+ * also keeps their buffers, and the inventories touched by workers, local
+ * to them. A thread may be placed again, e.g. main once setup is done.
+ *
+ * @param role: the thread's role, one of ROLE_*
+ */
+void place_thread(int role) {
+
+    if (rolePinned[role]) {
+        pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t),
+                &roleCpus[role]);
+    }
+
+    if (self == NULL) {
+        pthread_once(&recordKeyOnce, make_record_key);
+        self = claim_record();
+        pthread_setspecific(recordKey, self);
+    }
+    self->role = role;
+    self->tid = (int)syscall(SYS_gettid);
+    self->lastCpu = sched_getcpu();
+    __atomic_store_n(&self->migrationsBase, kernel_migrations(self->tid),
+            __ATOMIC_RELAXED);
+    __atomic_store_n(&self->migrations, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&self->cpuNs, 0, __ATOMIC_RELAXED);
+    self->notes = 0;
+}
+
+/**
+ * Every CPU_SAMPLE_INTERVAL notes, samples the calling thread's CPU time
+ * and the CPU it is running on, counting a migration if it has moved since
+ * the last sample (only used if the kernel doesn't count them). Called
+ * from the loops of long running threads, so most notes only count.
+ * Does nothing for threads which were never placed.
+ */
+void note_thread_cpu(void) {
+
+    if (self == NULL || self->notes++ % CPU_SAMPLE_INTERVAL != 0) {
+        return;
+    }
+
+    sample_cpu_time(self);
+    int cpu = sched_getcpu();
+    if (cpu != self->lastCpu) {
+        self->lastCpu = cpu;
+        __atomic_add_fetch(&self->migrations, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Displays where this process's threads have run. Each role has a line of
+ * the format "threads role cpus live cpu_ms migrations", cpus being the
+ * number it is pinned to (0 if not pinned) and the totals including ended
+ * threads, followed by a "thread role tid cpu cpu_ms migrations" line for
+ * each live thread, cpu being the CPU it was last seen on. Migrations are
+ * the kernel's counts where it shows them, and sampled otherwise (see
+ * thread_migrations).
+ *
+ * @param out: the stream to write to
+ */
+void display_threads(FILE* out) {
+
+    int live[THREAD_ROLES] = {0};
+    unsigned long long cpuNs[THREAD_ROLES];
+    unsigned long migrations[THREAD_ROLES];
+    for (int role = 0; role < THREAD_ROLES; role++) {
+        cpuNs[role] = __atomic_load_n(&endedCpuNs[role], __ATOMIC_RELAXED);
+        migrations[role] = __atomic_load_n(&endedMigrations[role],
+                __ATOMIC_RELAXED);
+    }
+
+    struct ThreadRecord* first = __atomic_load_n(&records, __ATOMIC_ACQUIRE);
+    for (struct ThreadRecord* record = first; record != NULL;
+            record = record->next) {
+        if (__atomic_load_n(&record->inUse, __ATOMIC_ACQUIRE)) {
+            live[record->role]++;
+            cpuNs[record->role] += __atomic_load_n(&record->cpuNs,
+                    __ATOMIC_RELAXED);
+            migrations[record->role] += thread_migrations(record);
+        }
+    }
+
+    for (int role = 0; role < THREAD_ROLES; role++) {
+        fprintf(out, "threads %s %d %d %llu %lu\n", roleNames[role],
+                rolePinned[role] ? CPU_COUNT(&roleCpus[role]) : 0,
+                live[role], cpuNs[role] / 1000000, migrations[role]);
+    }
+
+    for (struct ThreadRecord* record = first; record != NULL;
+            record = record->next) {
+        if (__atomic_load_n(&record->inUse, __ATOMIC_ACQUIRE)) {
+            fprintf(out, "thread %s %d %d %llu %lu\n",
+                    roleNames[record->role], record->tid, record->lastCpu,
+                    __atomic_load_n(&record->cpuNs, __ATOMIC_RELAXED) /
+                    1000000, thread_migrations(record));
+        }
+    }
+}
@@ -0,0 +1,41 @@
+#ifndef PLACEMENT_H
+#define PLACEMENT_H
+
+#include <stdio.h>
+#include <stdbool.h>
+
+// Roles of this process's threads, each of which may be given CPUs
+#define ROLE_IO 0
+#define ROLE_WORKER 1
+#define ROLE_ACCEPTOR 2
+#define ROLE_REPORT 3
+#define THREAD_ROLES 4
+
+/**
+ * A thread's record of where it has run: its role and thread ID, the CPU
+ * it was last seen on, the kernel's count of its migrations when it was
+ * placed (-1 if the kernel doesn't show it), how often it was seen to have
+ * moved CPU when sampled, and its CPU time as last sampled. Records are
+ * reused by later threads once a thread ends, like RCU reader records.
+ */
+struct ThreadRecord {
+    int role;
+    int tid;
+    int lastCpu;
+    long migrationsBase;
+    unsigned long migrations;
+    unsigned long long cpuNs;
+    unsigned notes;
+    bool inUse;
+    struct ThreadRecord* next;
+};
+
+void init_placement(void);
+
+void place_thread(int role);
+
+void note_thread_cpu(void);
+
+void display_threads(FILE* out);
+
+#endif //PLACEMENT_H
@@ -0,0 +1,149 @@
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include "rcu.h"
+
+// Every thread's reader record, only ever pushed to
+static struct RcuReader* readers = NULL;
+
+// The current epoch, advanced each time something is retired
+static unsigned long globalEpoch = 1;
+
+// Things retired but not yet freed, protected by retireLock
+static pthread_mutex_t retireLock = PTHREAD_MUTEX_INITIALIZER;
+static struct RcuRetired* retired = NULL;
+
+// Gives each thread's record back when the thread ends
+static pthread_once_t readerKeyOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t readerKey;
+static __thread struct RcuReader* self = NULL;
+
+/**
+ * Marks a thread's reader record free for another thread, once the thread
+ * ends.
+ *
+ * @param arg: the record to free
+ */
+static void release_reader(void* arg) {
+
+    struct RcuReader* reader = (struct RcuReader*)arg;
+    __atomic_store_n(&reader->epoch, 0, __ATOMIC_SEQ_CST);
+    reader->depth = 0;
+    __atomic_store_n(&reader->inUse, false, __ATOMIC_RELEASE);
+}
+
+/**
+ * Creates the key which releases each thread's record when it ends.
+ */
+static void make_reader_key(void) {
+    pthread_key_create(&readerKey, release_reader);
+}
+
+/**
+ * Gets this thread's reader record, claiming a free one (or adding a new
+ * one) the first time the thread reads.
+ *
+ * @return this thread's record
+ */
+static struct RcuReader* get_reader(void) {
+
+    if (self != NULL) {
+        return self;
+    }
+    pthread_once(&readerKeyOnce, make_reader_key);
+
+    struct RcuReader* reader = __atomic_load_n(&readers, __ATOMIC_ACQUIRE);
+    for (; reader != NULL; reader = reader->next) {
+        bool expected = false;
+        if (__atomic_compare_exchange_n(&reader->inUse, &expected, true,
+                false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+
+    if (reader == NULL) { // none free, add a new record
+        reader = calloc(1, sizeof(struct RcuReader));
+        reader->inUse = true;
+        reader->next = __atomic_load_n(&readers, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&readers, &reader->next, reader,
+                false, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        }
+    }
+
+    self = reader;
+    pthread_setspecific(readerKey, reader);
+    return reader;
+}
+
+/**
+ * Starts reading RCU protected data. Anything read may be used until the
+ * matching rcu_read_unlock, even if it is retired meanwhile. Never blocks,
+ * and may be nested.
+ */
+void rcu_read_lock(void) {
+
+    struct RcuReader* reader = get_reader();
+    if (reader->depth++ == 0) {
+        __atomic_store_n(&reader->epoch,
+                __atomic_load_n(&globalEpoch, __ATOMIC_SEQ_CST),
+                __ATOMIC_SEQ_CST);
+    }
+}
+
+/**
+ * Finishes reading RCU protected data, started with rcu_read_lock.
+ */
+void rcu_read_unlock(void) {
+
+    if (--self->depth == 0) {
+        __atomic_store_n(&self->epoch, 0, __ATOMIC_RELEASE);
+    }
+}
+
+/**
+ * Retires something which has just been unpublished (so no new reader can
+ * find it), to be freed once every reader which might have found it has
+ * finished. Frees anything retired earlier which no reader can still hold.
+ *
+ * @param pointer: the thing retired
+ * @param destroy: the function which frees it
+ */
+void rcu_retire(void* pointer, void (*destroy)(void*)) {
+
+    struct RcuRetired* item = malloc(sizeof(struct RcuRetired));
+    item->pointer = pointer;
+    item->destroy = destroy;
+
+    pthread_mutex_lock(&retireLock);
+
+    // readers which started after this have missed the old pointer
+    item->epoch = __atomic_fetch_add(&globalEpoch, 1, __ATOMIC_SEQ_CST);
+    item->next = retired;
+    retired = item;
+
+    // find the epoch the oldest reader started in
+    unsigned long oldest = ULONG_MAX;
+    struct RcuReader* reader = __atomic_load_n(&readers, __ATOMIC_ACQUIRE);
+    for (; reader != NULL; reader = reader->next) {
+        unsigned long epoch = __atomic_load_n(&reader->epoch,
+                __ATOMIC_SEQ_CST);
+        if (epoch != 0 && epoch < oldest) {
+            oldest = epoch;
+        }
+    }
+
+    // free everything retired before it
+    struct RcuRetired** node = &retired;
+    while (*node != NULL) {
+        item = *node;
+        if (item->epoch < oldest) {
+            *node = item->next;
+            item->destroy(item->pointer);
+            free(item);
+        } else {
+            node = &item->next;
+        }
+    }
+
+    pthread_mutex_unlock(&retireLock);
+}
@@ -0,0 +1,35 @@
+#ifndef RCU_H
+#define RCU_H
+
+#include <stdbool.h>
+
+/**
+ * A thread's record of whether it is reading RCU protected data, and if
+ * so, the epoch it started reading in (0 when not reading). Records are
+ * never freed; a thread's record is reused by a later thread once it ends.
+ */
+struct RcuReader {
+    unsigned long epoch;
+    int depth;
+    bool inUse;
+    struct RcuReader* next;
+};
+
+/**
+ * Something replaced while readers may still hold a pointer to it, with the
+ * epoch it was retired in and the function which frees it.
+ */
+struct RcuRetired {
+    void* pointer;
+    void (*destroy)(void*);
+    unsigned long epoch;
+    struct RcuRetired* next;
+};
+
+void rcu_read_lock(void);
+
+void rcu_read_unlock(void);
+
+void rcu_retire(void* pointer, void (*destroy)(void*));
+
+#endif //RCU_H
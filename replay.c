@@ -0,0 +1,507 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include "capture.h"
+
+#define USAGE_ERR 1
+#define TRACE_ERR 2
+#define CONNECT_ERR 3
+
+// Bytes waiting to be sent on a connection before replay waits for them
+#define MAX_PENDING (1024 * 1024)
+// Longest reply line looked at, longer ones are cut short
+#define MAX_REPLY_LENGTH 256
+// Milliseconds between probes, and given to finish once the trace is sent
+#define PROBE_INTERVAL_MS 10
+#define FINISH_TIMEOUT_MS 30000
+
+#define PROBE_GOOD "replayprobe"
+#define DONE_GOOD "replaydone"
+
+/**
+ * One record of a capture trace (see capture.h), with its time since the
+ * start of the trace.
+ */
+struct Event {
+    uint64_t at;
+    uint32_t connection;
+    int kind;
+    const char* line;
+    size_t length;
+};
+
+/**
+ * A connection to the depot being driven: its socket, the bytes waiting to
+ * be sent on it, and the reply line being read from it. Closing is set
+ * once the trace closes it, and done once it has answered the query sent
+ * after the last of its lines.
+ */
+struct Replayed {
+    int fd;
+    char* out;
+    size_t outLength;
+    size_t outSent;
+    size_t outCapacity;
+    char reply[MAX_REPLY_LENGTH];
+    size_t replyLength;
+    bool closing;
+    bool done;
+};
+
+// Where the depot listens
+static const char* port;
+
+// The depot's connections, by capture ID, and a connection to probe it on
+static struct Replayed* connections;
+static uint32_t connectionCount;
+static struct Replayed probe;
+
+// Latencies measured, in nanoseconds
+static long long* probeNs;
+static size_t probeCount = 0;
+static size_t probeCapacity = 0;
+static long long probeSentNs = 0;
+static long long nextProbeNs = 0;
+
+/**
+ * Gets the time from a monotonic clock.
+ * @return the time, in nanoseconds
+ */
+static long long now_ns(void) {
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * Reads the next varint of a trace record, moving past it.
+ *
+ * @param data: the trace
+ * @param size: the length of the trace
+ * @param offset: where the varint starts, moved to just after it
+ * @param value: where to store the value read
+ * @return true if read, false if the trace ends part way through it
+ */
+static bool read_varint(const uint8_t* data, size_t size, size_t* offset,
+        uint64_t* value) {
+
+    size_t read = get_varint(data + *offset, size - *offset, value);
+    *offset += read;
+    return read != 0;
+}
+
+/**
+ * Reads a capture trace into memory.
+ *
+ * @param path: the trace file
+ * @param count: where to store the number of events read
+ * @return the trace's events in order, or NULL if it couldn't be read
+ */
+static struct Event* load_trace(const char* path, size_t* count) {
+
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        return NULL;
+    }
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    uint8_t* data = malloc(size > 0 ? size : 1);
+    if (size < CAPTURE_MAGIC_LENGTH ||
+            fread(data, 1, size, file) != (size_t)size ||
+            memcmp(data, CAPTURE_MAGIC, CAPTURE_MAGIC_LENGTH) != 0) {
+        fclose(file);
+        free(data);
+        return NULL;
+    }
+    fclose(file);
+
+    size_t capacity = 1024;
+    struct Event* events = malloc(capacity * sizeof(struct Event));
+    size_t offset = CAPTURE_MAGIC_LENGTH;
+    uint64_t at = 0;
+    *count = 0;
+    while (offset < (size_t)size) {
+        uint64_t delta, connection, kind, length = 0;
+        size_t end = offset;
+        if (!read_varint(data, size, &end, &delta) ||
+                !read_varint(data, size, &end, &connection) ||
+                !read_varint(data, size, &end, &kind) ||
+                (kind == CAPTURE_LINE &&
+                !read_varint(data, size, &end, &length)) ||
+                length > size - end || connection > UINT32_MAX) {
+            break; // cut short, e.g. the depot was killed mid write
+        }
+
+        if (*count == capacity) {
+            capacity *= 2;
+            events = realloc(events, capacity * sizeof(struct Event));
+        }
+        at += delta;
+        events[*count] = (struct Event) {at, (uint32_t)connection, (int)kind,
+                (const char*)data + end, length};
+        (*count)++;
+        offset = end + length;
+    }
+
+    return events;
+}
+
+/**
+ * Connects to the depot, switching the socket to non-blocking once
+ * connected.
+ *
+ * @param replayed: the connection to open
+ * @return true if connected, false otherwise
+ */
+static bool open_replayed(struct Replayed* replayed) {
+
+    struct addrinfo hints, *info;
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo("localhost", port, &hints, &info)) {
+        return false;
+    }
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1 || connect(fd, info->ai_addr, info->ai_addrlen)) {
+        freeaddrinfo(info);
+        if (fd != -1) {
+            close(fd);
+        }
+        return false;
+    }
+    freeaddrinfo(info);
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    memset(replayed, 0, sizeof(struct Replayed));
+    replayed->fd = fd;
+    return true;
+}
+
+/**
+ * Queues a line to be sent on a connection.
+ *
+ * @param replayed: the connection to send on
+ * @param line: the line, without a newline
+ * @param length: the length of the line
+ */
+static void queue_line(struct Replayed* replayed, const char* line,
+        size_t length) {
+
+    if (replayed->outLength + length + 1 > replayed->outCapacity) {
+        replayed->outCapacity = (replayed->outLength + length + 1) * 2;
+        replayed->out = realloc(replayed->out, replayed->outCapacity);
+    }
+    memcpy(replayed->out + replayed->outLength, line, length);
+    replayed->out[replayed->outLength + length] = '\n';
+    replayed->outLength += length + 1;
+}
+
+/**
+ * Handles a reply line from the depot: a probe's answer, or the answer to
+ * the query sent after a connection's last line.
+ *
+ * @param replayed: the connection the line came from
+ * @param line: the line, cut short to MAX_REPLY_LENGTH - 1 bytes
+ */
+static void handle_reply(struct Replayed* replayed, const char* line) {
+
+    if (strncmp(line, "Stock:" DONE_GOOD ":",
+            strlen("Stock:" DONE_GOOD ":")) == 0) {
+        replayed->done = true;
+    } else if (replayed == &probe && probeSentNs != 0 && strncmp(line,
+            "Stock:" PROBE_GOOD ":", strlen("Stock:" PROBE_GOOD ":")) == 0) {
+        if (probeCount == probeCapacity) {
+            probeCapacity = probeCapacity == 0 ? 1024 : probeCapacity * 2;
+            probeNs = realloc(probeNs, probeCapacity * sizeof(long long));
+        }
+        probeNs[probeCount++] = now_ns() - probeSentNs;
+        probeSentNs = 0;
+    }
+}
+
+/**
+ * Sends what it can of a connection's queued bytes, and reads (and mostly
+ * throws away) what the depot has sent on it.
+ *
+ * @param replayed: the connection
+ * @param revents: the poll events seen on its socket
+ */
+static void service(struct Replayed* replayed, short revents) {
+
+    if ((revents & POLLOUT) && replayed->outSent < replayed->outLength) {
+        ssize_t sent = send(replayed->fd, replayed->out + replayed->outSent,
+                replayed->outLength - replayed->outSent, MSG_NOSIGNAL);
+        if (sent > 0) {
+            replayed->outSent += sent;
+        }
+        if (replayed->outSent == replayed->outLength) {
+            replayed->outSent = 0;
+            replayed->outLength = 0;
+            if (replayed->closing) {
+                shutdown(replayed->fd, SHUT_WR);
+            }
+        }
+    }
+
+    if (revents & (POLLIN | POLLHUP | POLLERR)) {
+        char data[4096];
+        ssize_t got = recv(replayed->fd, data, sizeof(data), 0);
+        if (got <= 0 && !(got == -1 && errno == EAGAIN)) {
+            close(replayed->fd);
+            replayed->fd = -1;
+            replayed->done = true;
+            return;
+        }
+        for (ssize_t i = 0; i < got; i++) {
+            if (data[i] == '\n') {
+                replayed->reply[replayed->replyLength] = '\0';
+                handle_reply(replayed, replayed->reply);
+                replayed->replyLength = 0;
+            } else if (replayed->replyLength < MAX_REPLY_LENGTH - 1) {
+                replayed->reply[replayed->replyLength++] = data[i];
+            }
+        }
+    }
+}
+
+/**
+ * Sends and reads on every connection until a deadline, sending probes as
+ * they fall due.
+ *
+ * @param untilNs: when to return, or 0 to return after one round
+ */
+static void pump(long long untilNs) {
+
+    struct pollfd* fds = malloc((connectionCount + 1) *
+            sizeof(struct pollfd));
+    struct Replayed** owners = malloc((connectionCount + 1) *
+            sizeof(struct Replayed*));
+
+    do {
+        long long now = now_ns();
+        if (now >= nextProbeNs && probeSentNs == 0) {
+            queue_line(&probe, "Query:" PROBE_GOOD,
+                    strlen("Query:" PROBE_GOOD));
+            probeSentNs = now;
+            nextProbeNs = now + PROBE_INTERVAL_MS * 1000000LL;
+        }
+
+        int count = 0;
+        for (uint32_t i = 0; i <= connectionCount; i++) {
+            struct Replayed* replayed = i == 0 ? &probe : &connections[i];
+            if (replayed->fd <= 0) {
+                continue;
+            }
+            fds[count].fd = replayed->fd;
+            fds[count].events = POLLIN |
+                    (replayed->outSent < replayed->outLength ? POLLOUT : 0);
+            owners[count++] = replayed;
+        }
+
+        long long wait = untilNs == 0 ? 0 : (untilNs - now) / 1000000;
+        wait = wait > PROBE_INTERVAL_MS ? PROBE_INTERVAL_MS : wait;
+        if (poll(fds, count, wait < 0 ? 0 : (int)wait) > 0) {
+            for (int i = 0; i < count; i++) {
+                if (fds[i].revents != 0) {
+                    service(owners[i], fds[i].revents);
+                }
+            }
+        }
+    } while (untilNs != 0 && now_ns() < untilNs);
+
+    free(fds);
+    free(owners);
+}
+
+/**
+ * Sends one line of the trace to the depot. Replayed connections don't
+ * take part in credits, shared memory links or state sync, so credit and
+ * ring messages are skipped and IM messages are sent without options.
+ *
+ * @param replayed: the connection to send on
+ * @param line: the captured line
+ * @param length: the length of the line
+ * @return true if the line was sent, false if skipped
+ */
+static bool replay_line(struct Replayed* replayed, const char* line,
+        size_t length) {
+
+    if ((length >= 7 && strncmp(line, "Credit:", 7) == 0) ||
+            (length >= 5 && strncmp(line, "Ring:", 5) == 0)) {
+        return false;
+    }
+
+    if (length >= 3 && strncmp(line, "IM:", 3) == 0) {
+        int colons = 0;
+        for (size_t i = 0; i < length; i++) {
+            if (line[i] == ':' && ++colons == 3) {
+                length = i;
+                break;
+            }
+        }
+    }
+
+    queue_line(replayed, line, length);
+    return true;
+}
+
+/**
+ * Gets a percentile of some sorted latencies, in milliseconds.
+ *
+ * @param sorted: the latencies, in nanoseconds, in increasing order
+ * @param count: the number of latencies
+ * @param percent: the percentile
+ * @return the percentile, or 0 if there are no latencies
+ */
+static double percentile(const long long* sorted, size_t count,
+        int percent) {
+
+    if (count == 0) {
+        return 0;
+    }
+    return sorted[(count - 1) * percent / 100] / 1e6;
+}
+
+/**
+ * Compares two latencies, for qsort.
+ */
+static int compare_ns(const void* a, const void* b) {
+
+    long long x = *(const long long*)a, y = *(const long long*)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Replays a capture trace (see capture.h) against a depot, one connection
+ * per captured connection, then reports how it went. Usage:
+ * 2310replay trace port [speed], where speed scales the trace's timing
+ * (1 for the original speed, 2 for twice as fast, or 0 to send as fast as
+ * possible). Reports "lines", "connections", "seconds" and "rate" (lines
+ * per second), "lateness_ms p50 p99 max" (how far behind the trace's
+ * timing lines were sent), and "probe_ms p50 p99 count", the round trip
+ * times of queries sent every 10ms on a connection of its own, which show
+ * how long the depot took to handle a message while under the load.
+ *
+ * @return 0 on success, USAGE_ERR, TRACE_ERR or CONNECT_ERR otherwise
+ */
+int main(int argc, char** argv) {
+
+    if (argc < 3 || argc > 4) {
+        fprintf(stderr, "Usage: 2310replay trace port [speed]\n");
+        return USAGE_ERR;
+    }
+    port = argv[2];
+    double speed = argc == 4 ? atof(argv[3]) : 1;
+
+    size_t count;
+    struct Event* events = load_trace(argv[1], &count);
+    if (events == NULL) {
+        fprintf(stderr, "Invalid trace\n");
+        return TRACE_ERR;
+    }
+    connectionCount = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (events[i].connection > connectionCount) {
+            connectionCount = events[i].connection;
+        }
+    }
+    connections = calloc(connectionCount + 1, sizeof(struct Replayed));
+
+    signal(SIGPIPE, SIG_IGN);
+    if (!open_replayed(&probe)) {
+        fprintf(stderr, "Failed to connect\n");
+        return CONNECT_ERR;
+    }
+    queue_line(&probe, "IM:1:replayprobe", strlen("IM:1:replayprobe"));
+
+    long long* lateness = malloc((count + 1) * sizeof(long long));
+    size_t lines = 0;
+    int opened = 0;
+    long long start = now_ns();
+    for (size_t i = 0; i < count; i++) {
+        struct Event* event = &events[i];
+        struct Replayed* replayed = &connections[event->connection];
+        long long due = speed > 0 ? start + (long long)(event->at / speed) :
+                0;
+        if (due > now_ns()) {
+            pump(due);
+        }
+
+        if (replayed->fd == 0 && event->kind != CAPTURE_CLOSE) {
+            if (!open_replayed(replayed)) {
+                fprintf(stderr, "Failed to connect\n");
+                return CONNECT_ERR;
+            }
+            opened++;
+        }
+        if (event->kind == CAPTURE_LINE && replayed->fd > 0 &&
+                replay_line(replayed, event->line, event->length)) {
+            lateness[lines++] = due == 0 ? 0 : now_ns() - due;
+        } else if (event->kind == CAPTURE_CLOSE && replayed->fd > 0) {
+            replayed->closing = true;
+            if (replayed->outLength == 0) {
+                shutdown(replayed->fd, SHUT_WR);
+            }
+        }
+
+        while (replayed->outLength - replayed->outSent > MAX_PENDING) {
+            pump(now_ns() + 1000000);
+        }
+        pump(0);
+    }
+
+    // ask every open connection for a reply, so all of its lines are known
+    // to have been handled
+    for (uint32_t i = 1; i <= connectionCount; i++) {
+        if (connections[i].fd > 0 && !connections[i].closing) {
+            queue_line(&connections[i], "Query:" DONE_GOOD,
+                    strlen("Query:" DONE_GOOD));
+        } else {
+            connections[i].done = true;
+        }
+    }
+    long long deadline = now_ns() + FINISH_TIMEOUT_MS * 1000000LL;
+    bool finished = false;
+    while (!finished && now_ns() < deadline) {
+        pump(now_ns() + 1000000);
+        finished = true;
+        for (uint32_t i = 1; i <= connectionCount; i++) {
+            finished = finished && (connections[i].done ||
+                    (connections[i].closing && connections[i].outLength ==
+                    0));
+        }
+    }
+    double seconds = (now_ns() - start) / 1e9;
+
+    qsort(lateness, lines, sizeof(long long), compare_ns);
+    qsort(probeNs, probeCount, sizeof(long long), compare_ns);
+    printf("lines %zu\n", lines);
+    printf("connections %d\n", opened);
+    printf("seconds %.3f\n", seconds);
+    printf("rate %.0f\n", seconds > 0 ? lines / seconds : 0);
+    printf("lateness_ms %.3f %.3f %.3f\n", percentile(lateness, lines, 50),
+            percentile(lateness, lines, 99),
+            percentile(lateness, lines, 100));
+    printf("probe_ms %.3f %.3f %zu\n", percentile(probeNs, probeCount, 50),
+            percentile(probeNs, probeCount, 99), probeCount);
+    if (!finished) {
+        fprintf(stderr, "Timed out waiting for the depot\n");
+    }
+
+    return 0;
+}
@@ -0,0 +1,797 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "replica.h"
+#include "network.h"
+#include "linkedLists.h"
+#include "inventory.h"
+#include "intern.h"
+#include "config.h"
+#include "dialer.h"
+#include "util.h"
+#include "sync.h"
+#include "placement.h"
+
+// Most changes sent in one line
+#define REPL_BATCH_SIZE 512
+#define MAX_SNAPSHOT_HEADER 64
+#define INITIAL_LISTED_SIZE 1024
+// How often a follower checks its primary is connected, and checkpoints
+#define KEEPER_INTERVAL_S 1
+
+// This depot's copy of its primary, or NULL if it isn't a follower
+static struct Replica* replica = NULL;
+
+/**
+ * Gets the time from a monotonic clock.
+ * @return the time, in milliseconds
+ */
+static long long now_ms(void) {
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/**
+ * Creates a replication log for an inventory, which is then kept by
+ * change_stock (see inventory.h) once set on the inventory.
+ *
+ * @param inventory: the inventory whose changes are logged
+ * @param size: the number of changes kept, a power of 2
+ * @return the new log
+ */
+struct ReplLog* new_repl_log(struct Inventory* inventory, int size) {
+
+    struct ReplLog* log = malloc(sizeof(struct ReplLog));
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    // any non-zero number unlikely to be picked by another run
+    log->incarnation = (((uint64_t)now.tv_sec << 32) ^ now.tv_nsec ^
+            ((uint64_t)getpid() << 16)) | 1;
+    log->next = 0;
+    log->mask = size - 1;
+    log->entries = calloc(size, sizeof(struct ReplEntry));
+    log->inventory = inventory;
+    log->followers = NULL;
+    log->waiters = 0;
+    pthread_mutex_init(&log->waitLock, NULL);
+    pthread_cond_init(&log->appended, NULL);
+
+    // snapshots must not be starved by a steady stream of changes
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr,
+            PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&log->lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+    pthread_mutex_init(&log->followersLock, NULL);
+
+    return log;
+}
+
+/**
+ * Adds a change to a replication log, overwriting the oldest change once
+ * the ring is full.
+ *
+ * @param log: the log to add to (its read lock must be held)
+ * @param good: the interned ID of the good changed
+ * @param amount: the amount added to the good's quantity
+ */
+void repl_append(struct ReplLog* log, uint32_t good, int64_t amount) {
+
+    uint64_t seq = __atomic_fetch_add(&log->next, 1, __ATOMIC_RELAXED);
+    struct ReplEntry* entry = &log->entries[seq & log->mask];
+
+    // mark the slot as being written before overwriting it
+    __atomic_store_n(&entry->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&entry->good, good, __ATOMIC_RELAXED);
+    __atomic_store_n(&entry->amount, amount, __ATOMIC_RELAXED);
+    __atomic_store_n(&entry->seq, seq + 1, __ATOMIC_RELEASE);
+
+    // pairs with the fence in wait_for_change, so either the stream thread
+    // sees the change, or we see it waiting
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&log->waiters, __ATOMIC_RELAXED) > 0) {
+        pthread_mutex_lock(&log->waitLock);
+        pthread_cond_broadcast(&log->appended);
+        pthread_mutex_unlock(&log->waitLock);
+    }
+}
+
+/**
+ * Wakes every stream thread waiting for a change to a log, so those told to
+ * stop or resync can see it.
+ *
+ * @param log: the log being waited on
+ */
+static void wake_streams(struct ReplLog* log) {
+
+    pthread_mutex_lock(&log->waitLock);
+    pthread_cond_broadcast(&log->appended);
+    pthread_mutex_unlock(&log->waitLock);
+}
+
+/**
+ * Waits until a follower's connection can take more messages, that is,
+ * until it has none held back for lack of credits.
+ *
+ * @param arg: the follower to wait for
+ * @return true once it can, or false if the stream is stopping
+ */
+static bool wait_for_room(void* arg) {
+
+    struct Follower* follower = (struct Follower*)arg;
+    return wait_for_send_room(
+            &follower->connection->connectedDepot->type.depot,
+            &follower->stopping);
+}
+
+/**
+ * Waits until the change at a follower's cursor has been logged (or the
+ * follower is stopping, or needs a snapshot).
+ *
+ * @param follower: the follower waiting
+ */
+static void wait_for_change(struct Follower* follower) {
+
+    struct ReplLog* log = follower->log;
+    struct ReplEntry* entry = &log->entries[follower->cursor & log->mask];
+
+    pthread_mutex_lock(&log->waitLock);
+    __atomic_fetch_add(&log->waiters, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE) <
+            follower->cursor + 1 &&
+            !__atomic_load_n(&follower->stopping, __ATOMIC_ACQUIRE) &&
+            !__atomic_load_n(&follower->resync, __ATOMIC_ACQUIRE)) {
+        pthread_cond_wait(&log->appended, &log->waitLock);
+    }
+    __atomic_fetch_sub(&log->waiters, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&log->waitLock);
+}
+
+/**
+ * Sends a follower every good its primary has a non-zero quantity of, in
+ * lines of the format Snapshot:i:s:l:t:q[:t:q...] (see send_stock_chunks),
+ * where i is the log's incarnation and s the sequence number the snapshot
+ * was taken at. The stream then carries on from s. The write lock is only
+ * held while the quantities are copied, not while they are sent.
+ *
+ * @param follower: the follower to send to
+ * @param line: a line to build messages in
+ */
+static void send_snapshot(struct Follower* follower, struct LineBuffer* line) {
+
+    struct ReplLog* log = follower->log;
+    struct Depot* depot = &follower->connection->connectedDepot->type.depot;
+    int64_t* quantities;
+
+    pthread_rwlock_wrlock(&log->lock);
+    uint64_t seq = log->next;
+    uint32_t count = snapshot_stock(log->inventory, &quantities);
+    pthread_rwlock_unlock(&log->lock);
+
+    char header[MAX_SNAPSHOT_HEADER];
+    snprintf(header, MAX_SNAPSHOT_HEADER, "Snapshot:%llu:%llu",
+            (unsigned long long)log->incarnation, (unsigned long long)seq);
+    send_stock_chunks(depot, line, header, quantities, count, wait_for_room,
+            follower);
+
+    free(quantities);
+    __atomic_store_n(&follower->cursor, seq, __ATOMIC_RELEASE);
+}
+
+/**
+ * Sends a follower the next batch of changes from its cursor, as a line of
+ * the format Apply:i:s:h:t:a[:t:a...], where i is the log's incarnation, s
+ * the sequence number of the first change, h the size of the log when the
+ * batch was sent (so the follower can tell how far behind it is), and each
+ * t:a a good and the amount added to it. Changes are read from the ring
+ * without a lock; a slot read while being overwritten is read again, or if
+ * the change the follower needs has been overwritten, it gets a snapshot.
+ *
+ * @param follower: the follower to send to
+ * @param line: a line to build the message in
+ * @param head: the size of the log, read before the batch
+ * @return 1 if a batch was sent, 0 if there was nothing to send yet, or -1
+ *      if the follower has fallen too far behind and needs a snapshot
+ */
+static int send_batch(struct Follower* follower, struct LineBuffer* line,
+        uint64_t head) {
+
+    struct ReplLog* log = follower->log;
+    uint64_t cursor = follower->cursor;
+    if (head - cursor > log->mask + 1) {
+        return -1;
+    }
+
+    line->length = 0;
+    append_line(line, "Apply:%llu:%llu:%llu",
+            (unsigned long long)log->incarnation,
+            (unsigned long long)cursor, (unsigned long long)head);
+
+    uint64_t end = head - cursor > REPL_BATCH_SIZE ?
+            cursor + REPL_BATCH_SIZE : head;
+    uint64_t seq = cursor;
+    for (; seq < end; seq++) {
+        struct ReplEntry* entry = &log->entries[seq & log->mask];
+        uint64_t published = __atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE);
+        if (published > seq + 1) {
+            return -1; // overwritten by a later lap of the ring
+        } else if (published != seq + 1) {
+            break; // still being written, send what we have
+        }
+
+        uint32_t good = __atomic_load_n(&entry->good, __ATOMIC_RELAXED);
+        int64_t amount = __atomic_load_n(&entry->amount, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&entry->seq, __ATOMIC_RELAXED) != seq + 1) {
+            return -1; // overwritten while we read it
+        }
+        append_line(line, ":%s:%lld", good_name(good), (long long)amount);
+    }
+
+    if (seq == cursor) {
+        return 0;
+    }
+    send_line_to_depot(&follower->connection->connectedDepot->type.depot,
+            line->data, line->length);
+    __atomic_store_n(&follower->cursor, seq, __ATOMIC_RELEASE);
+
+    return 1;
+}
+
+/**
+ * Thread function which streams a primary's changes to one follower, in
+ * batches, for as long as the follower is connected. Batches are sent
+ * without waiting for the follower to apply earlier ones, only for room on
+ * the connection (see wait_for_room). When the follower has every change,
+ * the thread waits for the next to be logged.
+ *
+ * @param arg: the follower to stream to
+ * @return NULL (just for thread function requirement)
+ */
+static void* stream_thread(void* arg) {
+
+    struct Follower* follower = (struct Follower*)arg;
+    struct LineBuffer line;
+    init_line(&line);
+    place_thread(ROLE_WORKER);
+
+    while (!__atomic_load_n(&follower->stopping, __ATOMIC_ACQUIRE) &&
+            wait_for_room(follower)) {
+        note_thread_cpu();
+        if (__atomic_exchange_n(&follower->resync, false, __ATOMIC_ACQ_REL)) {
+            send_snapshot(follower, &line);
+            continue;
+        }
+
+        uint64_t head = __atomic_load_n(&follower->log->next,
+                __ATOMIC_ACQUIRE);
+        int sent = head == follower->cursor ? 0 :
+                send_batch(follower, &line, head);
+        if (sent == -1) {
+            __atomic_store_n(&follower->resync, true, __ATOMIC_RELEASE);
+        } else if (sent == 0) {
+            wait_for_change(follower);
+        }
+    }
+
+    free(line.data);
+    return NULL;
+}
+
+/**
+ * Message handler for follow messages, of the format Follow:i:s, sent by a
+ * depot which wants to follow this one, where i and s are the incarnation
+ * and sequence number it has applied changes up to (both 0 if it has none).
+ * Starts streaming changes to it from s, if this depot keeps a replication
+ * log, s is from the log's current incarnation and the change is still in
+ * the log; otherwise it is sent a snapshot first. A follow message on a
+ * connection already being streamed to (sent by a follower which has lost
+ * its place) asks for a new snapshot.
+ *
+ * @param message: the follow message to handle
+ * @param connection: a connection wrapper containing information for this
+ *      connection between depots
+ */
+void handle_follow_message(char* message,
+        struct ConnectionWrapper* connection) {
+
+    struct ReplLog* log = connection->inventory->log;
+    uint64_t incarnation;
+    uint64_t seq;
+
+    strtok_r(message, ":", &message);
+    if (log == NULL ||
+            !parse_unsigned(strtok_r(message, ":", &message), &incarnation) ||
+            !parse_unsigned(strtok_r(message, ":", &message), &seq) ||
+            strtok_r(message, ":", &message) != NULL) {
+        return;
+    }
+
+    if (connection->follower != NULL) {
+        __atomic_store_n(&connection->follower->resync, true,
+                __ATOMIC_RELEASE);
+        wake_streams(log);
+        return;
+    }
+
+    struct Follower* follower = calloc(1, sizeof(struct Follower));
+    follower->connection = connection;
+    follower->log = log;
+
+    uint64_t head = __atomic_load_n(&log->next, __ATOMIC_ACQUIRE);
+    if (incarnation == log->incarnation && seq <= head &&
+            head - seq <= log->mask + 1) {
+        follower->cursor = seq;
+    } else {
+        follower->resync = true;
+    }
+
+    pthread_mutex_lock(&log->followersLock);
+    follower->next = log->followers;
+    log->followers = follower;
+    pthread_mutex_unlock(&log->followersLock);
+
+    connection->follower = follower;
+    pthread_create(&follower->threadId, NULL, stream_thread, follower);
+}
+
+/**
+ * Stops streaming to the depot at the other end of a connection, if it is a
+ * follower of this one, and waits for its stream thread to finish.
+ *
+ * @param connection: the connection being torn down
+ */
+void stop_follower(struct ConnectionWrapper* connection) {
+
+    struct Follower* follower = connection->follower;
+    if (follower == NULL) {
+        return;
+    }
+
+    __atomic_store_n(&follower->stopping, true, __ATOMIC_RELEASE);
+    wake_streams(follower->log);
+    wake_send_waiters(&connection->connectedDepot->type.depot);
+    pthread_join(follower->threadId, NULL);
+
+    struct ReplLog* log = follower->log;
+    pthread_mutex_lock(&log->followersLock);
+    struct Follower** link = &log->followers;
+    while (*link != follower) {
+        link = &(*link)->next;
+    }
+    *link = follower->next;
+    pthread_mutex_unlock(&log->followersLock);
+
+    connection->follower = NULL;
+    free(follower);
+}
+
+/**
+ * Writes a follower's checkpoint (DEPOT_FOLLOW_STATE): a line with the
+ * primary's incarnation and the sequence number applied up to, then a line
+ * per good of the format "quantity name". The file is written under
+ * another name, then renamed over the old one, so a crash mid-write leaves
+ * the old checkpoint.
+ *
+ * @param inventory: the follower's inventory (the replica's lock must be
+ *      held, so it matches the sequence number)
+ */
+static void write_checkpoint(struct Inventory* inventory) {
+
+    const char* path = get_config()->followState;
+    char* temporary = malloc(strlen(path) + strlen(".tmp") + 1);
+    sprintf(temporary, "%s.tmp", path);
+
+    FILE* file = fopen(temporary, "w");
+    if (file == NULL) {
+        free(temporary);
+        return;
+    }
+
+    int64_t* quantities;
+    uint32_t count = snapshot_stock(inventory, &quantities);
+    fprintf(file, "%llu %llu\n", (unsigned long long)replica->incarnation,
+            (unsigned long long)replica->applied);
+    for (uint32_t good = 0; good < count; good++) {
+        if (quantities[good] != 0) {
+            fprintf(file, "%lld %s\n", (long long)quantities[good],
+                    good_name(good));
+        }
+    }
+    free(quantities);
+
+    if (fclose(file) == 0 && rename(temporary, path) == 0) {
+        replica->dirty = false;
+    }
+    free(temporary);
+}
+
+/**
+ * Sets a good's quantity in a follower's inventory (which only the
+ * replica changes, so the quantity can't change in between).
+ *
+ * @param inventory: the follower's inventory
+ * @param good: the interned ID of the good
+ * @param quantity: the good's new quantity
+ */
+static void set_stock(struct Inventory* inventory, uint32_t good,
+        int64_t quantity) {
+
+    int64_t current = read_stock(inventory, good);
+    if (quantity != current) {
+        change_stock(inventory, good, quantity - current);
+    }
+}
+
+/**
+ * Loads a follower's checkpoint, if it has one, so it can resume following
+ * its primary where it left off (see write_checkpoint).
+ *
+ * @param inventory: the follower's inventory
+ */
+static void load_checkpoint(struct Inventory* inventory) {
+
+    FILE* file = fopen(get_config()->followState, "r");
+    if (file == NULL) {
+        return;
+    }
+
+    unsigned long long incarnation;
+    unsigned long long applied;
+    char* line = NULL;
+    size_t capacity = 0;
+    ssize_t length;
+    if (fscanf(file, "%llu %llu\n", &incarnation, &applied) != 2) {
+        fclose(file);
+        return;
+    }
+
+    while ((length = getline(&line, &capacity, file)) > 0) {
+        if (line[length - 1] == '\n') {
+            line[length - 1] = '\0';
+        }
+        char* name = strchr(line, ' ');
+        int64_t quantity;
+        if (name == NULL) {
+            continue;
+        }
+        *name++ = '\0';
+
+        uint32_t good = intern_good(name);
+        if (good != NO_GOOD && parse_signed(line, &quantity)) {
+            set_stock(inventory, good, quantity);
+        }
+    }
+    free(line);
+    fclose(file);
+
+    replica->incarnation = incarnation;
+    replica->applied = applied;
+    replica->head = applied;
+}
+
+/**
+ * Thread function which keeps a follower connected to its primary,
+ * connecting again (every KEEPER_INTERVAL_S seconds) while it is down, and
+ * writes a checkpoint when changes have been applied since the last one.
+ *
+ * @param arg: unused
+ * @return NULL (just for thread function requirement)
+ */
+static void* keeper_thread(void* arg) {
+
+    while (1) {
+        pthread_mutex_lock(&replica->lock);
+        bool connected = replica->source != NULL;
+        if (replica->dirty && !replica->syncing &&
+                get_config()->followState != NULL) {
+            write_checkpoint(replica->template->inventory);
+        }
+        pthread_mutex_unlock(&replica->lock);
+
+        if (!connected && !connect_local_depot(replica->port,
+                replica->template)) {
+            dial_depot(replica->port, replica->template);
+        }
+        sleep(KEEPER_INTERVAL_S);
+    }
+
+    return NULL;
+}
+
+/**
+ * Makes a depot a read-only follower of the depot on a port: its stock is
+ * then only changed by changes streamed from the primary. Resumes from the
+ * checkpoint, if there is one, and starts connecting to the primary.
+ *
+ * @param port: the primary's port
+ * @param thisDepot: this depot, in a list of all connected depots
+ * @param inventory: this depot's inventory
+ * @param firstDeferral: first deferral message, for linked list of
+ *      deferred message operations
+ * @param dataLock: mutex protecting this depots structs and lists
+ */
+void start_replica(const char* port, struct LinkedList* thisDepot,
+        struct Inventory* inventory, struct LinkedList* firstDeferral,
+        pthread_mutex_t* dataLock) {
+
+    replica = calloc(1, sizeof(struct Replica));
+    replica->port = strdup(port);
+    replica->template = new_connection_wrapper(thisDepot, inventory,
+            firstDeferral, dataLock);
+    replica->caughtUpMs = now_ms();
+    pthread_mutex_init(&replica->lock, NULL);
+
+    if (get_config()->followState != NULL) {
+        load_checkpoint(inventory);
+    }
+
+    pthread_t tid;
+    pthread_create(&tid, NULL, keeper_thread, NULL);
+    pthread_detach(tid);
+}
+
+/**
+ * Checks whether an inventory is a follower's, and so is only changed by
+ * its primary.
+ *
+ * @param inventory: the inventory to check
+ * @return true if the inventory belongs to a follower, false otherwise
+ */
+bool is_follower(struct Inventory* inventory) {
+    return replica != NULL && replica->template->inventory == inventory;
+}
+
+/**
+ * Abandons a snapshot part way through arriving.
+ * (The replica's lock must be held.)
+ */
+static void abandon_snapshot(void) {
+
+    free(replica->listed);
+    replica->listed = NULL;
+    replica->listedCount = 0;
+    replica->syncing = false;
+}
+
+/**
+ * Called once a connection has received its IM message. If this depot is a
+ * follower, and the connection is to its primary, changes are taken from
+ * it: a follow message is sent with the position the follower has reached.
+ *
+ * @param connection: the connection which has just opened
+ */
+void replica_connected(struct ConnectionWrapper* connection) {
+
+    struct Depot* depot = &connection->connectedDepot->type.depot;
+    if (!is_follower(connection->inventory) ||
+            strcmp(depot->port, replica->port) != 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&replica->lock);
+    if (replica->source == NULL) {
+        replica->source = connection;
+        abandon_snapshot();
+        send_to_depot(depot, "Follow:%llu:%llu",
+                (unsigned long long)replica->incarnation,
+                (unsigned long long)replica->applied);
+    }
+    pthread_mutex_unlock(&replica->lock);
+}
+
+/**
+ * Called as a connection is torn down. If it was to this follower's
+ * primary, the follower carries on from where it got to once reconnected.
+ *
+ * @param connection: the connection being torn down
+ */
+void replica_disconnected(struct ConnectionWrapper* connection) {
+
+    if (!is_follower(connection->inventory)) {
+        return;
+    }
+
+    pthread_mutex_lock(&replica->lock);
+    if (replica->source == connection) {
+        replica->source = NULL;
+    }
+    pthread_mutex_unlock(&replica->lock);
+}
+
+/**
+ * Asks the primary for a snapshot, once the follower finds it has missed
+ * changes. Changes are ignored until the snapshot has arrived.
+ * (The replica's lock must be held.)
+ */
+static void request_snapshot(void) {
+
+    replica->syncing = true;
+    send_to_depot(&replica->source->connectedDepot->type.depot,
+            "Follow:0:0");
+}
+
+/**
+ * Message handler for apply messages (see send_batch), sent by this
+ * follower's primary. Applies the changes in order, if they carry on from
+ * the last change applied; if not, asks for a snapshot. Messages from any
+ * other depot are ignored.
+ *
+ * @param message: the apply message to handle
+ * @param connection: a connection wrapper containing information for this
+ *      connection between depots
+ */
+void handle_apply_message(char* message,
+        struct ConnectionWrapper* connection) {
+
+    if (!is_follower(connection->inventory)) {
+        return;
+    }
+
+    pthread_mutex_lock(&replica->lock);
+    uint64_t incarnation;
+    uint64_t first;
+    uint64_t head;
+    strtok_r(message, ":", &message);
+    if (replica->source != connection || replica->syncing ||
+            !parse_unsigned(strtok_r(message, ":", &message), &incarnation) ||
+            !parse_unsigned(strtok_r(message, ":", &message), &first) ||
+            !parse_unsigned(strtok_r(message, ":", &message), &head)) {
+        pthread_mutex_unlock(&replica->lock);
+        return;
+    }
+
+    if (incarnation != replica->incarnation || first != replica->applied) {
+        request_snapshot();
+        pthread_mutex_unlock(&replica->lock);
+        return;
+    }
+
+    struct Inventory* inventory = connection->inventory;
+    char* name;
+    int64_t amount;
+    while ((name = strtok_r(message, ":", &message)) != NULL &&
+            parse_signed(strtok_r(message, ":", &message), &amount)) {
+        uint32_t good = intern_good(name);
+        if (good != NO_GOOD) {
+            change_stock(inventory, good, amount);
+        }
+        replica->applied++;
+    }
+
+    replica->head = head > replica->applied ? head : replica->applied;
+    if (replica->applied == replica->head) {
+        replica->caughtUpMs = now_ms();
+    }
+    replica->dirty = true;
+    pthread_mutex_unlock(&replica->lock);
+}
+
+/**
+ * Message handler for snapshot messages (see send_snapshot), sent by this
+ * follower's primary. Sets each listed good's quantity; once the last line
+ * has arrived, every good not listed is set to 0, and the follower carries
+ * on from the snapshot's sequence number. Messages from any other depot
+ * are ignored.
+ *
+ * @param message: the snapshot message to handle
+ * @param connection: a connection wrapper containing information for this
+ *      connection between depots
+ */
+void handle_snapshot_message(char* message,
+        struct ConnectionWrapper* connection) {
+
+    if (!is_follower(connection->inventory)) {
+        return;
+    }
+
+    pthread_mutex_lock(&replica->lock);
+    uint64_t incarnation;
+    uint64_t seq;
+    uint64_t last;
+    strtok_r(message, ":", &message);
+    if (replica->source != connection ||
+            !parse_unsigned(strtok_r(message, ":", &message), &incarnation) ||
+            !parse_unsigned(strtok_r(message, ":", &message), &seq) ||
+            !parse_unsigned(strtok_r(message, ":", &message), &last)) {
+        pthread_mutex_unlock(&replica->lock);
+        return;
+    }
+    replica->syncing = true;
+
+    struct Inventory* inventory = connection->inventory;
+    char* name;
+    int64_t quantity;
+    while ((name = strtok_r(message, ":", &message)) != NULL &&
+            parse_signed(strtok_r(message, ":", &message), &quantity)) {
+        uint32_t good = intern_good(name);
+        if (good == NO_GOOD) {
+            continue;
+        }
+        set_stock(inventory, good, quantity);
+
+        if (good >= replica->listedCount) {
+            uint32_t size = replica->listedCount == 0 ? INITIAL_LISTED_SIZE :
+                    replica->listedCount;
+            while (size <= good) {
+                size *= 2;
+            }
+            replica->listed = realloc(replica->listed, sizeof(bool) * size);
+            memset(replica->listed + replica->listedCount, 0,
+                    sizeof(bool) * (size - replica->listedCount));
+            replica->listedCount = size;
+        }
+        replica->listed[good] = true;
+    }
+
+    if (last) {
+        int64_t* quantities;
+        uint32_t count = snapshot_stock(inventory, &quantities);
+        for (uint32_t good = 0; good < count; good++) {
+            if (quantities[good] != 0 && (good >= replica->listedCount ||
+                    !replica->listed[good])) {
+                change_stock(inventory, good, -quantities[good]);
+            }
+        }
+        free(quantities);
+
+        abandon_snapshot();
+        replica->incarnation = incarnation;
+        replica->applied = seq;
+        replica->head = seq;
+        replica->caughtUpMs = now_ms();
+        replica->dirty = true;
+    }
+    pthread_mutex_unlock(&replica->lock);
+}
+
+/**
+ * Displays replication stats for a depot: if it follows a primary, a line
+ * of the format "following port applied head lag lag-ms", where lag is the
+ * number of changes the follower is behind the primary (as of the last
+ * batch), and lag-ms how long it has been behind; and if it keeps a
+ * replication log, a line of the format "follower name cursor head lag"
+ * for each depot following it.
+ *
+ * @param out: the stream to write to
+ * @param inventory: the depot's inventory
+ */
+void display_replication(FILE* out, struct Inventory* inventory) {
+
+    if (is_follower(inventory)) {
+        pthread_mutex_lock(&replica->lock);
+        fprintf(out, "following %s %llu %llu %llu %lld\n", replica->port,
+                (unsigned long long)replica->applied,
+                (unsigned long long)replica->head,
+                (unsigned long long)(replica->head - replica->applied),
+                replica->applied < replica->head ?
+                now_ms() - replica->caughtUpMs : 0);
+        pthread_mutex_unlock(&replica->lock);
+    }
+
+    struct ReplLog* log = inventory->log;
+    if (log == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&log->followersLock);
+    uint64_t head = __atomic_load_n(&log->next, __ATOMIC_ACQUIRE);
+    for (struct Follower* follower = log->followers; follower != NULL;
+            follower = follower->next) {
+        uint64_t cursor = __atomic_load_n(&follower->cursor,
+                __ATOMIC_ACQUIRE);
+        fprintf(out, "follower %s %llu %llu %llu\n",
+                follower->connection->connectedDepot->name,
+                (unsigned long long)cursor, (unsigned long long)head,
+                (unsigned long long)(head - cursor));
+    }
+    pthread_mutex_unlock(&log->followersLock);
+}
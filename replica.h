@@ -0,0 +1,115 @@
+#ifndef REPLICA_H
+#define REPLICA_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+struct ConnectionWrapper;
+struct Inventory;
+struct LinkedList;
+
+/**
+ * One change to a primary's inventory, as kept in its replication log. Seq
+ * is the change's sequence number plus 1, stored last, so a slot being
+ * written (or not yet written) can be told apart from a finished one.
+ */
+struct ReplEntry {
+    uint64_t seq;
+    uint32_t good;
+    int64_t amount;
+};
+
+/**
+ * A primary's replication log: a ring of the latest changes to its
+ * inventory, numbered in the order they were logged, which followers are
+ * streamed from. Changes are logged (with the change itself) under a read
+ * lock, without any other lock, so a snapshot taken under the write lock
+ * matches a sequence number exactly. The incarnation is picked when the
+ * log is created, so a follower of an earlier run of the primary can tell
+ * its sequence numbers no longer apply. Stream threads with nothing to
+ * send wait on appended, and count themselves in waiters, so changes only
+ * take waitLock to wake them while someone is waiting.
+ */
+struct ReplLog {
+    uint64_t incarnation;
+    uint64_t next;
+    uint64_t mask;
+    struct ReplEntry* entries;
+    struct Inventory* inventory;
+    pthread_rwlock_t lock;
+    pthread_mutex_t followersLock;
+    struct Follower* followers;
+    pthread_mutex_t waitLock;
+    pthread_cond_t appended;
+    int waiters;
+};
+
+/**
+ * A depot following a primary, as seen by the primary: the connection to
+ * it, and the stream thread sending it changes from cursor (the next
+ * sequence number to send) on. Resync asks the thread to send a full
+ * snapshot first.
+ */
+struct Follower {
+    struct ConnectionWrapper* connection;
+    struct ReplLog* log;
+    uint64_t cursor;
+    bool resync;
+    bool stopping;
+    pthread_t threadId;
+    struct Follower* next;
+};
+
+/**
+ * This depot's copy of a primary, when it follows one (DEPOT_FOLLOW): the
+ * primary's port, the connection changes arrive on (NULL while it is
+ * down), and the primary's incarnation and sequence numbers, applied being
+ * the next change expected. Head is the last seen size of the primary's
+ * log. While a snapshot is arriving, listed marks the goods it has set.
+ * Dirty is set once changes have been applied since the last checkpoint.
+ */
+struct Replica {
+    const char* port;
+    struct ConnectionWrapper* template;
+    struct ConnectionWrapper* source;
+    uint64_t incarnation;
+    uint64_t applied;
+    uint64_t head;
+    bool dirty;
+    long long caughtUpMs;
+    bool syncing;
+    bool* listed;
+    uint32_t listedCount;
+    pthread_mutex_t lock;
+};
+
+struct ReplLog* new_repl_log(struct Inventory* inventory, int size);
+
+void repl_append(struct ReplLog* log, uint32_t good, int64_t amount);
+
+void handle_follow_message(char* message,
+        struct ConnectionWrapper* connection);
+
+void stop_follower(struct ConnectionWrapper* connection);
+
+void start_replica(const char* port, struct LinkedList* thisDepot,
+        struct Inventory* inventory, struct LinkedList* firstDeferral,
+        pthread_mutex_t* dataLock);
+
+bool is_follower(struct Inventory* inventory);
+
+void replica_connected(struct ConnectionWrapper* connection);
+
+void replica_disconnected(struct ConnectionWrapper* connection);
+
+void handle_apply_message(char* message,
+        struct ConnectionWrapper* connection);
+
+void handle_snapshot_message(char* message,
+        struct ConnectionWrapper* connection);
+
+void display_replication(FILE* out, struct Inventory* inventory);
+
+#endif //REPLICA_H
@@ -0,0 +1,223 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "sched.h"
+#include "config.h"
+#include "stats.h"
+
+// Slots free for a connection to take a turn in, and the connections
+// waiting for one in the order they asked, all protected by schedLock
+static pthread_mutex_t schedLock = PTHREAD_MUTEX_INITIALIZER;
+static int freeSlots = 0;
+static int waiting = 0;
+static struct SchedTicket* firstWaiting = NULL;
+static struct SchedTicket* lastWaiting = NULL;
+
+/**
+ * Sets up the scheduler's slots. Must be called once in main, after
+ * load_config and before any connections are made.
+ */
+void init_scheduler(void) {
+    freeSlots = get_config()->schedSlots;
+}
+
+/**
+ * Sets up a connection's ticket, with a weight of 1 until the connection's
+ * name is known (see set_ticket_weight).
+ *
+ * @param ticket: the ticket to set up
+ */
+void init_ticket(struct SchedTicket* ticket) {
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&ticket->turn, &attr);
+    pthread_condattr_destroy(&attr);
+
+    ticket->weight = 1;
+    ticket->used = 0;
+    ticket->holding = false;
+    ticket->granted = false;
+    ticket->next = NULL;
+}
+
+/**
+ * Gives a connection the weight configured for its depot's name in
+ * DEPOT_SCHED_WEIGHTS ("name=weight,..."), or 1 if none is.
+ *
+ * @param ticket: the connection's ticket
+ * @param name: the name of the depot at the other end
+ */
+void set_ticket_weight(struct SchedTicket* ticket, const char* name) {
+
+    const char* weights = get_config()->schedWeights;
+    if (weights == NULL || name == NULL) {
+        return;
+    }
+
+    size_t nameLength = strlen(name);
+    const char* entry = weights;
+    while (*entry != '\0') {
+        const char* end = strchr(entry, ',');
+        if (end == NULL) {
+            end = entry + strlen(entry);
+        }
+        if (strncmp(entry, name, nameLength) == 0 &&
+                entry[nameLength] == '=') {
+            int weight = atoi(entry + nameLength + 1);
+            ticket->weight = weight > 0 ? weight : 1;
+            return;
+        }
+        entry = *end == ',' ? end + 1 : end;
+    }
+}
+
+/**
+ * Hands a slot given up by one connection to the connection which has
+ * waited longest for one, or frees it if none is waiting. Must be called
+ * with schedLock held.
+ */
+static void pass_slot(void) {
+
+    struct SchedTicket* next = firstWaiting;
+    if (next == NULL) {
+        freeSlots++;
+        return;
+    }
+
+    firstWaiting = next->next;
+    if (firstWaiting == NULL) {
+        lastWaiting = NULL;
+    }
+    waiting--;
+    next->granted = true;
+    pthread_cond_signal(&next->turn);
+}
+
+/**
+ * Takes a ticket out of the queue of waiting connections. Must be called
+ * with schedLock held.
+ *
+ * @param ticket: the ticket to remove
+ */
+static void leave_queue(struct SchedTicket* ticket) {
+
+    struct SchedTicket* previous = NULL;
+    for (struct SchedTicket* node = firstWaiting; node != NULL;
+            node = node->next) {
+        if (node == ticket) {
+            if (previous == NULL) {
+                firstWaiting = node->next;
+            } else {
+                previous->next = node->next;
+            }
+            if (lastWaiting == node) {
+                lastWaiting = previous;
+            }
+            waiting--;
+            return;
+        }
+        previous = node;
+    }
+}
+
+/**
+ * Frees a connection's ticket, giving up its slot if it holds one.
+ *
+ * @param ticket: the ticket to free
+ */
+void destroy_ticket(struct SchedTicket* ticket) {
+
+    if (ticket->holding) {
+        pthread_mutex_lock(&schedLock);
+        pass_slot();
+        pthread_mutex_unlock(&schedLock);
+        ticket->holding = false;
+    }
+    pthread_cond_destroy(&ticket->turn);
+}
+
+/**
+ * Waits for a connection's turn at handling messages, before its action
+ * thread handles one. Turns are handed out first come, first served, to
+ * DEPOT_SCHED_SLOTS connections at once. A connection which waits more than
+ * DEPOT_SCHED_MAX_WAIT_MS handles its message anyway (counted as an
+ * overrun), so a turn holder blocked on a connection which is itself
+ * waiting for a turn can't hold both up for good. Does nothing if
+ * scheduling is off (DEPOT_SCHED_QUANTUM is 0).
+ *
+ * @param ticket: the connection's ticket
+ */
+void sched_begin(struct SchedTicket* ticket) {
+
+    const struct Config* config = get_config();
+    if (config->schedQuantum == 0 || ticket->holding) {
+        return;
+    }
+
+    pthread_mutex_lock(&schedLock);
+    if (freeSlots > 0 && firstWaiting == NULL) {
+        freeSlots--;
+        ticket->holding = true;
+    } else {
+        ticket->granted = false;
+        ticket->next = NULL;
+        if (lastWaiting == NULL) {
+            firstWaiting = ticket;
+        } else {
+            lastWaiting->next = ticket;
+        }
+        lastWaiting = ticket;
+        waiting++;
+        stat_add(STAT_SCHED_WAITS, 1);
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        long long ns = deadline.tv_nsec +
+                (long long)config->schedMaxWaitMs * 1000000;
+        deadline.tv_sec += ns / 1000000000;
+        deadline.tv_nsec = ns % 1000000000;
+        while (!ticket->granted) {
+            if (pthread_cond_timedwait(&ticket->turn, &schedLock,
+                    &deadline) == ETIMEDOUT && !ticket->granted) {
+                leave_queue(ticket);
+                stat_add(STAT_SCHED_OVERRUNS, 1);
+                break;
+            }
+        }
+        ticket->holding = ticket->granted;
+    }
+    ticket->used = 0;
+    pthread_mutex_unlock(&schedLock);
+}
+
+/**
+ * Counts a message handled in a connection's turn, ending the turn once it
+ * has run for quantum * weight messages while others are waiting, or the
+ * connection has nothing more to handle.
+ *
+ * @param ticket: the connection's ticket
+ * @param more: true if the connection has more messages waiting
+ */
+void sched_end(struct SchedTicket* ticket, bool more) {
+
+    if (!ticket->holding) {
+        return;
+    }
+
+    int quantum = get_config()->schedQuantum * ticket->weight;
+    ticket->used++;
+    if (more && (ticket->used < quantum ||
+            __atomic_load_n(&waiting, __ATOMIC_RELAXED) == 0)) {
+        return;
+    }
+
+    pthread_mutex_lock(&schedLock);
+    pass_slot();
+    pthread_mutex_unlock(&schedLock);
+    ticket->holding = false;
+    stat_add(STAT_SCHED_TURNS, 1);
+}
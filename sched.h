@@ -0,0 +1,35 @@
+#ifndef SCHED_H
+#define SCHED_H
+
+#include <stdbool.h>
+#include <pthread.h>
+
+/**
+ * A connection's place in the scheduler, which shares out turns at
+ * handling messages between connections' action threads. A turn lasts for
+ * up to quantum * weight messages, or until the connection has nothing left
+ * to handle. Holding is set while the connection has one of the scheduler's
+ * slots, and granted once a waiting connection has been handed one.
+ */
+struct SchedTicket {
+    int weight;
+    int used;
+    bool holding;
+    bool granted;
+    pthread_cond_t turn;
+    struct SchedTicket* next;
+};
+
+void init_scheduler(void);
+
+void init_ticket(struct SchedTicket* ticket);
+
+void set_ticket_weight(struct SchedTicket* ticket, const char* name);
+
+void destroy_ticket(struct SchedTicket* ticket);
+
+void sched_begin(struct SchedTicket* ticket);
+
+void sched_end(struct SchedTicket* ticket, bool more);
+
+#endif //SCHED_H
@@ -0,0 +1,343 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include "shmring.h"
+#include "network.h"
+#include "placement.h"
+
+#define RING_MASK (SHM_RING_SIZE - 1)
+#define LINKS_SIZE (2 * sizeof(struct ShmRing))
+#define SHM_NAME_PREFIX "/2310depot-"
+
+// Makes each shared memory name created by this process unique
+static uint32_t linkCounter = 0;
+
+/**
+ * Sleeps until the futex word no longer holds the expected value (or until
+ * woken by the other process).
+ *
+ * @param word: the shared futex word
+ * @param expected: the value the word held when the caller decided to sleep
+ */
+static void futex_wait(uint32_t* word, uint32_t expected) {
+    syscall(SYS_futex, word, FUTEX_WAIT, expected, NULL, NULL, 0);
+}
+
+/**
+ * Wakes the other process, if it is sleeping on the futex word.
+ * @param word: the shared futex word
+ */
+static void futex_wake(uint32_t* word) {
+    syscall(SYS_futex, word, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+/**
+ * Creates one end of a link over the two rings in some mapped memory, and
+ * chooses which one this end sends on. The creating end sends on the first
+ * ring.
+ *
+ * @param memory: the mapped memory holding both rings
+ * @param creator: true if this end created the link
+ * @return the new link
+ */
+static struct ShmLink* new_shm_link(void* memory, bool creator) {
+
+    struct ShmLink* link = malloc(sizeof(struct ShmLink));
+    link->rings = memory;
+    link->out = &link->rings[creator ? 0 : 1];
+    link->in = &link->rings[creator ? 1 : 0];
+    link->connection = NULL;
+    link->closing = false;
+    link->users = NULL;
+
+    return link;
+}
+
+/**
+ * Maps the two rings of a link from a shared memory file.
+ *
+ * @param fd: the shared memory file, closed once mapped
+ * @param creator: true if this end created the link
+ * @return the new link, or NULL if the memory could not be mapped
+ */
+static struct ShmLink* map_shm_link(int fd, bool creator) {
+
+    void* memory = mmap(NULL, LINKS_SIZE, PROT_READ | PROT_WRITE,
+            MAP_SHARED, fd, 0);
+    close(fd);
+    if (memory == MAP_FAILED) {
+        return NULL;
+    }
+
+    return new_shm_link(memory, creator);
+}
+
+/**
+ * Creates the shared memory for a new link, to be opened by the depot at
+ * the other end of a connection using the returned name, of the format
+ * /2310depot-pid-n (see shm_name_valid).
+ *
+ * @param name: where the name of the shared memory is written
+ * @param nameSize: the size of the name buffer
+ * @return the new link, or NULL if it could not be created
+ */
+struct ShmLink* create_shm_link(char* name, size_t nameSize) {
+
+    snprintf(name, nameSize, SHM_NAME_PREFIX "%d-%u", (int)getpid(),
+            __atomic_fetch_add(&linkCounter, 1, __ATOMIC_RELAXED));
+
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        return NULL;
+    }
+
+    // new shared memory is zero filled, so both rings start out empty
+    if (ftruncate(fd, LINKS_SIZE)) {
+        close(fd);
+        shm_unlink(name);
+        return NULL;
+    }
+
+    return map_shm_link(fd, true);
+}
+
+/**
+ * Checks that a link's name is one create_shm_link would have made in the
+ * given process: /2310depot-pid-n, and nothing else. A depot only opens
+ * (and removes) shared memory named by its neighbour's own process, so it
+ * can't be made to map or remove anything else.
+ *
+ * @param name: the name of the shared memory, as sent by the other end
+ * @param creator: the process at the other end of the connection
+ * @return true if the name is one the process could have created, false
+ *      otherwise
+ */
+bool shm_name_valid(const char* name, pid_t creator) {
+
+    size_t prefix = strlen(SHM_NAME_PREFIX);
+    if (strncmp(name, SHM_NAME_PREFIX, prefix) != 0) {
+        return false;
+    }
+    const char* pid = name + prefix;
+    size_t pidLength = strspn(pid, "0123456789");
+    const char* counter = pid + pidLength + 1;
+    size_t counterLength = strspn(counter, "0123456789");
+    if (pidLength == 0 || pid[pidLength] != '-' || counterLength == 0 ||
+            counter[counterLength] != '\0') {
+        return false;
+    }
+
+    return atol(pid) == (long)creator;
+}
+
+/**
+ * Opens the shared memory of a link created by the other end of a
+ * connection. The name is removed once opened, as nothing else needs it.
+ * The memory must be the size of a link, and belong to this user.
+ *
+ * @param name: the name of the shared memory, as sent by the other end
+ * @return the opened link, or NULL if it could not be opened
+ */
+struct ShmLink* open_shm_link(const char* name) {
+
+    int fd = shm_open(name, O_RDWR | O_CLOEXEC, 0600);
+    shm_unlink(name);
+    if (fd == -1) {
+        return NULL;
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) == -1 || info.st_size != (off_t)LINKS_SIZE ||
+            info.st_uid != geteuid()) {
+        close(fd);
+        return NULL;
+    }
+
+    return map_shm_link(fd, false);
+}
+
+/**
+ * Creates both ends of a link between two depots hosted by this process,
+ * in private memory, so messages between them skip sockets entirely.
+ *
+ * @param other: where the other end of the link is written
+ * @return this end of the link, or NULL if the memory could not be mapped
+ */
+struct ShmLink* create_memory_link(struct ShmLink** other) {
+
+    // new anonymous memory is zero filled, so both rings start out empty
+    void* memory = mmap(NULL, LINKS_SIZE, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        return NULL;
+    }
+
+    struct ShmLink* link = new_shm_link(memory, true);
+    *other = new_shm_link(memory, false);
+    link->users = malloc(sizeof(int));
+    *link->users = 2;
+    (*other)->users = link->users;
+
+    return link;
+}
+
+/**
+ * Writes a message (and a terminating newline) to this end's outgoing
+ * ring, waiting for the other end to make room if the ring is full. A
+ * message longer than the ring is written a ring's worth at a time, as the
+ * other end makes room (its reader drops lines longer than DEPOT_MAX_LINE
+ * anyway, see read_into_line). Only one thread may send on a link at once.
+ * The rest of the message is dropped if the link is closed while waiting.
+ *
+ * @param link: the link to send on
+ * @param line: the message to send, without a newline
+ * @param length: the length of the message
+ */
+void shm_send(struct ShmLink* link, const char* line, size_t length) {
+
+    struct ShmRing* ring = link->out;
+    uint64_t tail = ring->tail;
+    size_t total = length + 1;
+    size_t sent = 0;
+
+    while (sent < total) {
+        // wait until there is room for the rest of the message and its
+        // newline, or for a whole ring of it
+        size_t wanted = total - sent < SHM_RING_SIZE ? total - sent :
+                SHM_RING_SIZE;
+        while (tail + wanted - __atomic_load_n(&ring->head,
+                __ATOMIC_SEQ_CST) > SHM_RING_SIZE) {
+            uint32_t seq = __atomic_load_n(&ring->spaceSeq,
+                    __ATOMIC_SEQ_CST);
+            __atomic_store_n(&ring->producerWaiting, 1, __ATOMIC_SEQ_CST);
+            if (tail + wanted - __atomic_load_n(&ring->head,
+                    __ATOMIC_SEQ_CST) > SHM_RING_SIZE &&
+                    !__atomic_load_n(&link->closing, __ATOMIC_SEQ_CST)) {
+                futex_wait(&ring->spaceSeq, seq);
+            }
+            __atomic_store_n(&ring->producerWaiting, 0, __ATOMIC_SEQ_CST);
+
+            if (__atomic_load_n(&link->closing, __ATOMIC_SEQ_CST)) {
+                return; // the other end is gone
+            }
+        }
+
+        for (uint64_t end = tail + wanted; tail < end; tail++, sent++) {
+            ring->data[tail & RING_MASK] = sent < length ? line[sent] : '\n';
+        }
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_SEQ_CST);
+
+        // only wake the reader if it went to sleep
+        if (__atomic_load_n(&ring->consumerWaiting, __ATOMIC_SEQ_CST)) {
+            __atomic_add_fetch(&ring->dataSeq, 1, __ATOMIC_SEQ_CST);
+            futex_wake(&ring->dataSeq);
+        }
+    }
+}
+
+/**
+ * Thread function which reads messages from a link's incoming ring and
+ * passes them to the connection, exactly as reader_thread does for
+ * messages arriving on the socket (see read_into_line). Each stretch of
+ * the ring read is handed back to the writer straight away. Once the link
+ * is closed, the thread stops when the ring is empty, and tells the
+ * connection it has finished.
+ *
+ * @param arg: the link to read from
+ * @return NULL (just for thread function requirement)
+ */
+static void* shm_reader_thread(void* arg) {
+
+    struct ShmLink* link = (struct ShmLink*)arg;
+    struct ShmRing* ring = link->in;
+    struct PartialLine line = {NULL, 0, 0, false, NULL, NULL, 0};
+    place_thread(ROLE_IO);
+
+    while (1) {
+        note_thread_cpu();
+        uint64_t head = ring->head;
+        uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST);
+
+        if (head == tail) { // empty, sleep until the writer wakes us
+            uint32_t seq = __atomic_load_n(&ring->dataSeq, __ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&link->closing, __ATOMIC_SEQ_CST)) {
+                break;
+            }
+            __atomic_store_n(&ring->consumerWaiting, 1, __ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) == head) {
+                futex_wait(&ring->dataSeq, seq);
+            }
+            __atomic_store_n(&ring->consumerWaiting, 0, __ATOMIC_SEQ_CST);
+            continue;
+        }
+
+        // read up to the end of the data, or of the ring if it wraps
+        size_t offset = head & RING_MASK;
+        size_t length = tail - head < SHM_RING_SIZE - offset ?
+                tail - head : SHM_RING_SIZE - offset;
+        read_into_line(link->connection, &line, ring->data + offset, length,
+                true);
+
+        __atomic_store_n(&ring->head, head + length, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&ring->producerWaiting, __ATOMIC_SEQ_CST)) {
+            __atomic_add_fetch(&ring->spaceSeq, 1, __ATOMIC_SEQ_CST);
+            futex_wake(&ring->spaceSeq);
+        }
+    }
+
+    finish_partial_line(link->connection, &line, true);
+    reader_finished(link->connection);
+    return NULL;
+}
+
+/**
+ * Starts the thread which receives messages on a link.
+ *
+ * @param link: the link to receive on
+ * @param connection: the connection received messages are passed to
+ */
+void start_shm_reader(struct ShmLink* link,
+        struct ConnectionWrapper* connection) {
+
+    link->connection = connection;
+    pthread_create(&link->readerId, 0, shm_reader_thread, link);
+    pthread_detach(link->readerId);
+}
+
+/**
+ * Closes a link, once the other end has gone: wakes this end's reader so
+ * it can finish, and any sender waiting for room so it gives up.
+ *
+ * @param link: the link to close
+ */
+void close_shm_link(struct ShmLink* link) {
+
+    __atomic_store_n(&link->closing, true, __ATOMIC_SEQ_CST);
+
+    __atomic_add_fetch(&link->in->dataSeq, 1, __ATOMIC_SEQ_CST);
+    futex_wake(&link->in->dataSeq);
+    __atomic_add_fetch(&link->out->spaceSeq, 1, __ATOMIC_SEQ_CST);
+    futex_wake(&link->out->spaceSeq);
+}
+
+/**
+ * Frees a closed link, once its reader has finished and nothing is sending
+ * on it. The memory is unmapped once neither end of the link uses it.
+ *
+ * @param link: the link to free
+ */
+void free_shm_link(struct ShmLink* link) {
+
+    if (link->users == NULL ||
+            __atomic_sub_fetch(link->users, 1, __ATOMIC_SEQ_CST) == 0) {
+        munmap(link->rings, LINKS_SIZE);
+        free(link->users);
+    }
+    free(link);
+}
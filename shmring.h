@@ -0,0 +1,72 @@
+#ifndef SHM_RING_H
+#define SHM_RING_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+// Bytes of message data held by each ring (a power of two)
+#define SHM_RING_SIZE (1 << 20)
+
+struct ConnectionWrapper;
+
+/**
+ * A single producer, single consumer ring of newline terminated messages,
+ * living in memory shared between two depot processes. Positions only ever
+ * increase, and are taken modulo SHM_RING_SIZE to index data. The waiting
+ * flags and sequence numbers are used as futex words, so a side only makes
+ * a system call when the other side is asleep.
+ */
+struct ShmRing {
+    // written by the producer
+    uint64_t tail;
+    uint32_t dataSeq;
+    uint32_t producerWaiting;
+    char producerPad[48];
+
+    // written by the consumer
+    uint64_t head;
+    uint32_t spaceSeq;
+    uint32_t consumerWaiting;
+    char consumerPad[48];
+
+    char data[SHM_RING_SIZE];
+};
+
+/**
+ * One depot's end of a shared memory link: the ring it sends on, the ring
+ * it receives on, and the connection received messages are passed to.
+ * Once closing is set, the reader stops when its ring is empty and sending
+ * gives up rather than wait for room. Users counts the ends of an in-process
+ * link still using its memory (NULL for links between processes).
+ */
+struct ShmLink {
+    struct ShmRing* rings;
+    struct ShmRing* out;
+    struct ShmRing* in;
+    struct ConnectionWrapper* connection;
+    pthread_t readerId;
+    bool closing;
+    int* users;
+};
+
+struct ShmLink* create_shm_link(char* name, size_t nameSize);
+
+bool shm_name_valid(const char* name, pid_t creator);
+
+struct ShmLink* open_shm_link(const char* name);
+
+struct ShmLink* create_memory_link(struct ShmLink** other);
+
+void start_shm_reader(struct ShmLink* link,
+        struct ConnectionWrapper* connection);
+
+void shm_send(struct ShmLink* link, const char* line, size_t length);
+
+void close_shm_link(struct ShmLink* link);
+
+void free_shm_link(struct ShmLink* link);
+
+#endif //SHM_RING_H
@@ -0,0 +1,324 @@
+#include <stdint.h>
+#include "simd.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS
+#endif
+
+// Sets larger than this are checked a byte at a time
+#define MAX_VECTOR_SET 8
+
+/**
+ * The kernels used for scanning strings, chosen for this CPU when the
+ * program starts.
+ */
+struct ScanKernels {
+    size_t (*countByte)(const char*, size_t, char);
+    bool (*hasAnyByte)(const char*, size_t, const char*, size_t);
+    bool (*allDigits)(const char*, size_t);
+};
+
+/**
+ * Counts the instances of a byte in a string, one byte at a time.
+ *
+ * @param string: the string to scan
+ * @param length: the number of bytes to scan
+ * @param symbol: the byte to count
+ * @return the number of instances found
+ */
+static size_t count_byte_scalar(const char* string, size_t length,
+        char symbol) {
+
+    size_t count = 0;
+    for (size_t i = 0; i < length; i++) {
+        count += string[i] == symbol;
+    }
+
+    return count;
+}
+
+/**
+ * Checks a string for any byte of a set, one byte at a time, looking each
+ * byte up in a bitmap of the set.
+ *
+ * @param string: the string to scan
+ * @param length: the number of bytes to scan
+ * @param set: the bytes to look for
+ * @param setLength: the number of bytes in the set
+ * @return true if any byte of the set is found
+ */
+static bool has_any_byte_scalar(const char* string, size_t length,
+        const char* set, size_t setLength) {
+
+    uint64_t bitmap[4] = {0, 0, 0, 0};
+    for (size_t j = 0; j < setLength; j++) {
+        unsigned char byte = set[j];
+        bitmap[byte >> 6] |= (uint64_t)1 << (byte & 63);
+    }
+
+    for (size_t i = 0; i < length; i++) {
+        unsigned char byte = string[i];
+        if (bitmap[byte >> 6] & ((uint64_t)1 << (byte & 63))) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Checks that every byte of a string is a digit, one byte at a time.
+ *
+ * @param string: the string to scan
+ * @param length: the number of bytes to scan
+ * @return true if all bytes are digits
+ */
+static bool all_digits_scalar(const char* string, size_t length) {
+
+    for (size_t i = 0; i < length; i++) {
+        if (string[i] < '0' || string[i] > '9') {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+#ifdef HAVE_X86_KERNELS
+
+/**
+ * Counts the instances of a byte in a string, 16 bytes at a time.
+ * See count_byte_scalar.
+ */
+__attribute__((target("sse2")))
+static size_t count_byte_sse2(const char* string, size_t length,
+        char symbol) {
+
+    if (length < 16) { // too short to be worth setting up
+        return count_byte_scalar(string, length, symbol);
+    }
+
+    __m128i needle = _mm_set1_epi8(symbol);
+    size_t count = 0;
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i*)(string + i));
+        count += __builtin_popcount(
+                _mm_movemask_epi8(_mm_cmpeq_epi8(block, needle)));
+    }
+
+    return count + count_byte_scalar(string + i, length - i, symbol);
+}
+
+/**
+ * Checks a string for any byte of a set, 16 bytes at a time.
+ * See has_any_byte_scalar.
+ */
+__attribute__((target("sse2")))
+static bool has_any_byte_sse2(const char* string, size_t length,
+        const char* set, size_t setLength) {
+
+    if (setLength > MAX_VECTOR_SET || length < 16) {
+        return has_any_byte_scalar(string, length, set, setLength);
+    }
+
+    __m128i needles[MAX_VECTOR_SET];
+    for (size_t j = 0; j < setLength; j++) {
+        needles[j] = _mm_set1_epi8(set[j]);
+    }
+
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i*)(string + i));
+        __m128i hits = _mm_setzero_si128();
+        for (size_t j = 0; j < setLength; j++) {
+            hits = _mm_or_si128(hits, _mm_cmpeq_epi8(block, needles[j]));
+        }
+        if (_mm_movemask_epi8(hits) != 0) {
+            return true;
+        }
+    }
+
+    return has_any_byte_scalar(string + i, length - i, set, setLength);
+}
+
+/**
+ * Checks that every byte of a string is a digit, 16 bytes at a time.
+ * See all_digits_scalar.
+ */
+__attribute__((target("sse2")))
+static bool all_digits_sse2(const char* string, size_t length) {
+
+    if (length < 16) {
+        return all_digits_scalar(string, length);
+    }
+
+    // bytes above 127 compare as negative, so fail the lower bound
+    __m128i low = _mm_set1_epi8('0' - 1);
+    __m128i high = _mm_set1_epi8('9' + 1);
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i*)(string + i));
+        __m128i digits = _mm_and_si128(_mm_cmpgt_epi8(block, low),
+                _mm_cmplt_epi8(block, high));
+        if (_mm_movemask_epi8(digits) != 0xFFFF) {
+            return false;
+        }
+    }
+
+    return all_digits_scalar(string + i, length - i);
+}
+
+/**
+ * Counts the instances of a byte in a string, 32 bytes at a time.
+ * See count_byte_scalar.
+ */
+__attribute__((target("avx2")))
+static size_t count_byte_avx2(const char* string, size_t length,
+        char symbol) {
+
+    if (length < 32) { // too short to be worth setting up
+        return count_byte_scalar(string, length, symbol);
+    }
+
+    __m256i needle = _mm256_set1_epi8(symbol);
+    size_t count = 0;
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i*)(string + i));
+        count += __builtin_popcount((unsigned)
+                _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, needle)));
+    }
+
+    // the tail is scanned a byte at a time, as SSE code run before clearing
+    // the upper halves of the AVX registers is slowed down
+    _mm256_zeroupper();
+    return count + count_byte_scalar(string + i, length - i, symbol);
+}
+
+/**
+ * Checks a string for any byte of a set, 32 bytes at a time.
+ * See has_any_byte_scalar.
+ */
+__attribute__((target("avx2")))
+static bool has_any_byte_avx2(const char* string, size_t length,
+        const char* set, size_t setLength) {
+
+    if (setLength > MAX_VECTOR_SET || length < 32) {
+        return has_any_byte_scalar(string, length, set, setLength);
+    }
+
+    __m256i needles[MAX_VECTOR_SET];
+    for (size_t j = 0; j < setLength; j++) {
+        needles[j] = _mm256_set1_epi8(set[j]);
+    }
+
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i*)(string + i));
+        __m256i hits = _mm256_setzero_si256();
+        for (size_t j = 0; j < setLength; j++) {
+            hits = _mm256_or_si256(hits,
+                    _mm256_cmpeq_epi8(block, needles[j]));
+        }
+        if (_mm256_movemask_epi8(hits) != 0) {
+            return true;
+        }
+    }
+
+    _mm256_zeroupper();
+    return has_any_byte_scalar(string + i, length - i, set, setLength);
+}
+
+/**
+ * Checks that every byte of a string is a digit, 32 bytes at a time.
+ * See all_digits_scalar.
+ */
+__attribute__((target("avx2")))
+static bool all_digits_avx2(const char* string, size_t length) {
+
+    if (length < 32) {
+        return all_digits_scalar(string, length);
+    }
+
+    // bytes above 127 compare as negative, so fail the lower bound
+    __m256i low = _mm256_set1_epi8('0' - 1);
+    __m256i high = _mm256_set1_epi8('9' + 1);
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i*)(string + i));
+        __m256i digits = _mm256_and_si256(_mm256_cmpgt_epi8(block, low),
+                _mm256_cmpgt_epi8(high, block));
+        if (_mm256_movemask_epi8(digits) != -1) {
+            return false;
+        }
+    }
+
+    _mm256_zeroupper();
+    return all_digits_scalar(string + i, length - i);
+}
+
+#endif
+
+// The kernels in use, byte at a time until the CPU has been checked
+static struct ScanKernels kernels = {count_byte_scalar, has_any_byte_scalar,
+        all_digits_scalar};
+
+/**
+ * Chooses the widest kernels this CPU supports, before main runs.
+ */
+__attribute__((constructor))
+static void select_kernels(void) {
+
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        kernels.countByte = count_byte_avx2;
+        kernels.hasAnyByte = has_any_byte_avx2;
+        kernels.allDigits = all_digits_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        kernels.countByte = count_byte_sse2;
+        kernels.hasAnyByte = has_any_byte_sse2;
+        kernels.allDigits = all_digits_sse2;
+    }
+#endif
+}
+
+/**
+ * Counts the instances of a byte in a string.
+ *
+ * @param string: the string to scan
+ * @param length: the number of bytes to scan
+ * @param symbol: the byte to count
+ * @return the number of instances found
+ */
+size_t scan_count_byte(const char* string, size_t length, char symbol) {
+    return kernels.countByte(string, length, symbol);
+}
+
+/**
+ * Checks a string for any byte of a set.
+ *
+ * @param string: the string to scan
+ * @param length: the number of bytes to scan
+ * @param set: the bytes to look for
+ * @param setLength: the number of bytes in the set
+ * @return true if any byte of the set is found, false otherwise
+ */
+bool scan_has_any_byte(const char* string, size_t length, const char* set,
+        size_t setLength) {
+    return kernels.hasAnyByte(string, length, set, setLength);
+}
+
+/**
+ * Checks that every byte of a string is a digit (0-9).
+ *
+ * @param string: the string to scan
+ * @param length: the number of bytes to scan
+ * @return true if all bytes are digits (or there are none), false
+ *      otherwise
+ */
+bool scan_all_digits(const char* string, size_t length) {
+    return kernels.allDigits(string, length);
+}
@@ -0,0 +1,14 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+size_t scan_count_byte(const char* string, size_t length, char symbol);
+
+bool scan_has_any_byte(const char* string, size_t length, const char* set,
+        size_t setLength);
+
+bool scan_all_digits(const char* string, size_t length);
+
+#endif //SIMD_H
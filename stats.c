@@ -0,0 +1,125 @@
+#include "stats.h"
+#include "budget.h"
+#include "linkedLists.h"
+#include "tenant.h"
+#include "rcu.h"
+#include "neighbours.h"
+#include "intern.h"
+#include "inventory.h"
+#include "replica.h"
+#include "sync.h"
+#include "placement.h"
+
+// Counter values, updated atomically from any thread
+static unsigned long counters[STAT_COUNT];
+
+// Names of the states of a state sync, in MIRROR_* order
+static const char* mirrorStates[] = {"receiving", "complete", "rejected"};
+
+// Names of the counters as displayed, in enum StatCounter order
+static const char* counterNames[STAT_COUNT] = {
+    "budget_pauses",
+    "budget_drops",
+    "connections_reclaimed",
+    "long_lines",
+    "sched_turns",
+    "sched_waits",
+    "sched_overruns",
+    "transfers_coalesced",
+    "coalesced_delivers",
+    "feed_updates",
+    "feed_held",
+    "accept_backoffs",
+    "lines_stalled",
+};
+
+/**
+ * Adds to one of this depot's counters. Safe to call from any thread.
+ *
+ * @param counter: the counter to add to
+ * @param amount: the amount to add
+ */
+void stat_add(enum StatCounter counter, unsigned long amount) {
+    __atomic_add_fetch(&counters[counter], amount, __ATOMIC_RELAXED);
+}
+
+/**
+ * Gets the current value of one of this depot's counters.
+ *
+ * @param counter: the counter to read
+ * @return the counter's value
+ */
+unsigned long stat_get(enum StatCounter counter) {
+    return __atomic_load_n(&counters[counter], __ATOMIC_RELAXED);
+}
+
+/**
+ * Displays this process's counters and memory use: the process wide budget,
+ * then each neighbour's connection budget. Memory lines are of the format
+ * "memory name used peak limit", in bytes, with a limit of 0 meaning no
+ * limit. Goods are reported as "goods count bytes per-good" for the names
+ * interned by the process, and "inventory count bytes per-good" for each
+ * depot's inventory, followed by its replication stats (see
+ * display_replication). Neighbours which sent their stock on connecting
+ * (state sync) have a "mirror name goods state" line, state being
+ * receiving, complete or rejected (for listing too many goods). Where
+ * threads have run is shown as by display_threads. If this
+ * process hosts several depots, each depot's inventory and neighbours
+ * follow a "Depot:name" line.
+ *
+ * @param out: the stream to write to
+ */
+void display_stats(FILE* out) {
+
+    fprintf(out, "Stats:\n");
+    for (int i = 0; i < STAT_COUNT; i++) {
+        fprintf(out, "%s %lu\n", counterNames[i], stat_get(i));
+    }
+
+    struct MemBudget* budget = global_budget();
+    fprintf(out, "memory * %zu %zu %zu\n",
+            __atomic_load_n(&budget->used, __ATOMIC_RELAXED),
+            budget->peak, budget->limit);
+
+    uint32_t goods;
+    size_t bytes = intern_memory(&goods);
+    fprintf(out, "goods %u %zu %zu\n", goods, bytes,
+            goods == 0 ? 0 : bytes / goods);
+    display_threads(out);
+
+    for (struct Tenant* tenant = first_tenant(); tenant != NULL;
+            tenant = tenant->next) {
+        if (count_tenants() > 1) {
+            fprintf(out, "Depot:%s\n", tenant->thisDepot->name);
+        }
+
+        bytes = inventory_memory(tenant->inventory, &goods);
+        fprintf(out, "inventory %u %zu %zu\n", goods, bytes,
+                goods == 0 ? 0 : bytes / goods);
+        display_replication(out, tenant->inventory);
+
+        rcu_read_lock();
+        const struct NeighbourSet* set = read_neighbours(tenant->thisDepot);
+        for (int i = 0; i < set->count; i++) {
+            budget = set->neighbours[i].depot->budget;
+            fprintf(out, "memory %s %zu %zu %zu\n", set->neighbours[i].name,
+                    __atomic_load_n(&budget->used, __ATOMIC_RELAXED),
+                    budget->peak, budget->limit);
+
+            struct Depot* depot = set->neighbours[i].depot;
+            struct Inventory* mirror = __atomic_load_n(&depot->mirror,
+                    __ATOMIC_ACQUIRE);
+            if (mirror != NULL) {
+                goods = __atomic_load_n(&depot->mirrorGoods,
+                        __ATOMIC_RELAXED);
+                int state = __atomic_load_n(&depot->mirrorState,
+                        __ATOMIC_ACQUIRE);
+                fprintf(out, "mirror %s %u %s\n", set->neighbours[i].name,
+                        goods, mirrorStates[state]);
+            }
+        }
+        rcu_read_unlock();
+    }
+
+    fflush(out);
+}
@@ -0,0 +1,32 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+
+/**
+ * Counters kept by this depot, shown (with memory use) on SIGUSR1.
+ */
+enum StatCounter {
+    STAT_BUDGET_PAUSES,
+    STAT_BUDGET_DROPS,
+    STAT_CONNECTIONS_RECLAIMED,
+    STAT_LONG_LINES,
+    STAT_SCHED_TURNS,
+    STAT_SCHED_WAITS,
+    STAT_SCHED_OVERRUNS,
+    STAT_TRANSFERS_COALESCED,
+    STAT_COALESCED_DELIVERS,
+    STAT_FEED_UPDATES,
+    STAT_FEED_HELD,
+    STAT_ACCEPT_BACKOFFS,
+    STAT_LINES_STALLED,
+    STAT_COUNT
+};
+
+void stat_add(enum StatCounter counter, unsigned long amount);
+
+unsigned long stat_get(enum StatCounter counter);
+
+void display_stats(FILE* out);
+
+#endif //STATS_H
@@ -0,0 +1,200 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sync.h"
+#include "network.h"
+#include "linkedLists.h"
+#include "inventory.h"
+#include "intern.h"
+#include "util.h"
+#include "config.h"
+#include "placement.h"
+
+// Most goods sent in one line of a chunked snapshot
+#define STOCK_CHUNK_SIZE 512
+
+/**
+ * Sends a copy of a depot's stock in chunks, as lines of the format
+ * header:l:t:q[:t:q...], where l is 1 on the last line (and 0 otherwise),
+ * and each t:q a good with a non-zero quantity and its quantity. At least
+ * one line is sent, even if there are no goods. Lines are sent one at a
+ * time, as they are built, so only one is held at once.
+ *
+ * @param depot: the depot to send to
+ * @param line: a buffer to build lines in
+ * @param header: the start of each line
+ * @param quantities: the quantities to send, indexed by good ID
+ * @param count: the number of quantities
+ * @param ready: called before each line is sent, to wait until the depot
+ *      can take it (returning false to stop sending), or NULL
+ * @param arg: passed to ready
+ * @return true once every line has been sent, false if stopped early
+ */
+bool send_stock_chunks(struct Depot* depot, struct LineBuffer* line,
+        const char* header, const int64_t* quantities, uint32_t count,
+        bool (*ready)(void*), void* arg) {
+
+    uint32_t good = 0;
+    bool last = false;
+    while (!last) {
+        // find where this line's goods end, to know if it is the last
+        uint32_t end = good;
+        for (int listed = 0; end < count && listed < STOCK_CHUNK_SIZE;
+                end++) {
+            listed += quantities[end] != 0;
+        }
+        uint32_t rest = end;
+        while (rest < count && quantities[rest] == 0) {
+            rest++;
+        }
+        last = rest == count;
+
+        line->length = 0;
+        append_line(line, "%s:%d", header, last);
+        for (; good < end; good++) {
+            if (quantities[good] != 0) {
+                append_line(line, ":%s:%lld", good_name(good),
+                        (long long)quantities[good]);
+            }
+        }
+        good = rest;
+
+        if (ready != NULL && !ready(arg)) {
+            return false;
+        }
+        send_line_to_depot(depot, line->data, line->length);
+    }
+
+    return true;
+}
+
+/**
+ * Waits until a connection can take the next line of a state sync.
+ *
+ * @param arg: the connection the sync is sent on
+ * @return true once it can, false if the sync is stopping
+ */
+static bool sync_ready(void* arg) {
+
+    struct ConnectionWrapper* connection = (struct ConnectionWrapper*)arg;
+    return wait_for_send_room(&connection->connectedDepot->type.depot,
+            &connection->syncStopping);
+}
+
+/**
+ * Thread function which sends a state sync (see send_state_sync).
+ *
+ * @param arg: the connection to send it on
+ * @return NULL (just for thread function requirement)
+ */
+static void* sync_thread(void* arg) {
+
+    struct ConnectionWrapper* connection = (struct ConnectionWrapper*)arg;
+    place_thread(ROLE_WORKER);
+    int64_t* quantities;
+    uint32_t count = snapshot_stock(connection->inventory, &quantities);
+    struct LineBuffer line;
+    init_line(&line);
+
+    send_stock_chunks(&connection->connectedDepot->type.depot, &line, "Sync",
+            quantities, count, sync_ready, connection);
+
+    free(line.data);
+    free(quantities);
+    return NULL;
+}
+
+/**
+ * Sends the depot at the other end of a new connection this depot's stock,
+ * as lines of the format Sync:l:t:q[:t:q...] (see send_stock_chunks), if
+ * both depots asked for state sync in their IM messages. The stock is
+ * copied from the inventory without a lock, and sent by a thread of its
+ * own, which only adds a line once the last has been sent (see
+ * wait_for_send_room), so the sync stays within the connection's credits
+ * and budgets, and the action thread carries on handling messages.
+ *
+ * @param connection: the connection which has just received its IM message
+ */
+void send_state_sync(struct ConnectionWrapper* connection) {
+
+    if (!connection->stateSync) {
+        return;
+    }
+
+    connection->syncRunning = true;
+    pthread_create(&connection->syncId, NULL, sync_thread, connection);
+}
+
+/**
+ * Stops a state sync being sent on a connection, if there is one, and waits
+ * for its thread to finish.
+ *
+ * @param connection: the connection being torn down
+ */
+void stop_state_sync(struct ConnectionWrapper* connection) {
+
+    if (!connection->syncRunning) {
+        return;
+    }
+
+    __atomic_store_n(&connection->syncStopping, true, __ATOMIC_RELEASE);
+    wake_send_waiters(&connection->connectedDepot->type.depot);
+    pthread_join(connection->syncId, NULL);
+    connection->syncRunning = false;
+}
+
+/**
+ * Message handler for sync messages (see send_state_sync), which copies the
+ * connected depot's stock into a mirror of it, kept with the depot. Once the
+ * last line has arrived the mirror is complete, and holds the depot's stock
+ * as it was when the connection opened. A sync listing more goods than
+ * DEPOT_SYNC_MAX_GOODS is rejected before the extra goods are interned.
+ * Sync messages are ignored unless this depot asked for them, or once the
+ * mirror is complete (or rejected).
+ *
+ * @param message: the sync message to handle
+ * @param connection: a connection wrapper containing information for this
+ *      connection between depots
+ */
+void handle_sync_message(char* message,
+        struct ConnectionWrapper* connection) {
+
+    struct Depot* depot = &connection->connectedDepot->type.depot;
+    uint64_t last;
+
+    strtok_r(message, ":", &message);
+    if (!connection->stateSync || depot->mirrorState != MIRROR_RECEIVING ||
+            !parse_unsigned(strtok_r(message, ":", &message), &last)) {
+        return;
+    }
+
+    struct Inventory* mirror = depot->mirror;
+    if (mirror == NULL) {
+        mirror = new_inventory();
+        __atomic_store_n(&depot->mirror, mirror, __ATOMIC_RELEASE);
+    }
+
+    char* name;
+    int64_t quantity;
+    while ((name = strtok_r(message, ":", &message)) != NULL &&
+            parse_signed(strtok_r(message, ":", &message), &quantity)) {
+        // each good is listed once, so this bounds what is interned
+        if (depot->mirrorGoods == (uint32_t)get_config()->syncMaxGoods) {
+            __atomic_store_n(&depot->mirrorState, MIRROR_REJECTED,
+                    __ATOMIC_RELEASE);
+            return;
+        }
+        __atomic_store_n(&depot->mirrorGoods, depot->mirrorGoods + 1,
+                __ATOMIC_RELAXED);
+
+        uint32_t good = intern_good(name);
+        if (good != NO_GOOD) {
+            change_stock(mirror, good, quantity);
+        }
+    }
+
+    if (last) {
+        __atomic_store_n(&depot->mirrorState, MIRROR_COMPLETE,
+                __ATOMIC_RELEASE);
+    }
+}
@@ -0,0 +1,27 @@
+#ifndef SYNC_H
+#define SYNC_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Where a neighbour's state sync has got to (see Depot.mirrorState)
+#define MIRROR_RECEIVING 0
+#define MIRROR_COMPLETE 1
+#define MIRROR_REJECTED 2
+
+struct ConnectionWrapper;
+struct Depot;
+struct LineBuffer;
+
+bool send_stock_chunks(struct Depot* depot, struct LineBuffer* line,
+        const char* header, const int64_t* quantities, uint32_t count,
+        bool (*ready)(void*), void* arg);
+
+void send_state_sync(struct ConnectionWrapper* connection);
+
+void stop_state_sync(struct ConnectionWrapper* connection);
+
+void handle_sync_message(char* message,
+        struct ConnectionWrapper* connection);
+
+#endif //SYNC_H
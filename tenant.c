@@ -0,0 +1,108 @@
+#include <stdlib.h>
+#include <string.h>
+#include "tenant.h"
+#include "linkedLists.h"
+#include "inventory.h"
+#include "replica.h"
+#include "config.h"
+#include "feed.h"
+
+// Depots hosted by this process, in the order they were started
+static pthread_mutex_t tenantLock = PTHREAD_MUTEX_INITIALIZER;
+static struct Tenant* firstTenant = NULL;
+static int tenantCount = 0;
+
+/**
+ * Creates a new tenant, with empty lists for its depot, resources and
+ * deferrals, ready for set_args. If replication is on, its inventory keeps
+ * a replication log, so other depots can follow it. If feeds are on, its
+ * inventory has a change feed, so neighbours can subscribe to it.
+ *
+ * @return a pointer to the new tenant, to be added with add_tenant once
+ *      its server has started
+ */
+struct Tenant* new_tenant(void) {
+
+    struct Tenant* tenant = calloc(1, sizeof(struct Tenant));
+    tenant->thisDepot = calloc(1, sizeof(struct LinkedList));
+    tenant->inventory = new_inventory();
+    if (get_config()->replLog > 0) {
+        tenant->inventory->log = new_repl_log(tenant->inventory,
+                get_config()->replLog);
+    }
+    if (get_config()->feedMs > 0) {
+        tenant->inventory->feed = new_change_feed(tenant->thisDepot);
+    }
+    tenant->firstDeferral = calloc(1, sizeof(struct LinkedList));
+    pthread_mutex_init(&tenant->dataLock, NULL);
+
+    return tenant;
+}
+
+/**
+ * Adds a tenant to the end of this process's list of hosted depots, so
+ * that other hosted depots can find it by its port.
+ *
+ * @param tenant: the tenant to add, whose port has been assigned
+ */
+void add_tenant(struct Tenant* tenant) {
+
+    pthread_mutex_lock(&tenantLock);
+    struct Tenant** last = &firstTenant;
+    while (*last != NULL) {
+        last = &(*last)->next;
+    }
+    tenant->next = NULL;
+    *last = tenant;
+    tenantCount++;
+    pthread_mutex_unlock(&tenantLock);
+}
+
+/**
+ * Gets the first depot hosted by this process (the one named on the
+ * command line). Tenants are never removed, so the list may be walked
+ * without a lock.
+ *
+ * @return the first tenant, or NULL if none have been added
+ */
+struct Tenant* first_tenant(void) {
+
+    pthread_mutex_lock(&tenantLock);
+    struct Tenant* tenant = firstTenant;
+    pthread_mutex_unlock(&tenantLock);
+
+    return tenant;
+}
+
+/**
+ * Counts the depots hosted by this process.
+ * @return the number of tenants added
+ */
+int count_tenants(void) {
+
+    pthread_mutex_lock(&tenantLock);
+    int count = tenantCount;
+    pthread_mutex_unlock(&tenantLock);
+
+    return count;
+}
+
+/**
+ * Finds the depot hosted by this process which listens on a port.
+ *
+ * @param port: the port to search for
+ * @return the tenant listening on the port, or NULL if the port belongs to
+ *      another process
+ */
+struct Tenant* find_tenant(const char* port) {
+
+    pthread_mutex_lock(&tenantLock);
+    struct Tenant* tenant = firstTenant;
+    while (tenant != NULL &&
+            strcmp(tenant->thisDepot->type.depot.port, port) != 0) {
+        tenant = tenant->next;
+    }
+    pthread_mutex_unlock(&tenantLock);
+
+    return tenant;
+}
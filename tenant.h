@@ -0,0 +1,35 @@
+#ifndef TENANT_H
+#define TENANT_H
+
+#include <stdbool.h>
+#include <pthread.h>
+
+struct LinkedList;
+struct Inventory;
+
+/**
+ * A depot hosted by this process, with its own inventory, neighbours,
+ * deferrals and lock. A process hosts the depot named on its command line,
+ * and any more named in DEPOT_TENANTS. Hosted depots share this process's
+ * I/O engine, dialer and budgets, and connect to each other through memory
+ * rather than sockets.
+ */
+struct Tenant {
+    struct LinkedList* thisDepot;
+    struct Inventory* inventory;
+    struct LinkedList* firstDeferral;
+    pthread_mutex_t dataLock;
+    struct Tenant* next;
+};
+
+struct Tenant* new_tenant(void);
+
+void add_tenant(struct Tenant* tenant);
+
+struct Tenant* first_tenant(void);
+
+int count_tenants(void);
+
+struct Tenant* find_tenant(const char* port);
+
+#endif //TENANT_H
@@ -0,0 +1,181 @@
+// the kernels are static, so they are tested from inside simd.c
+#include "../simd.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Longest string checked, and how far its start is moved along the buffer,
+// so every tail length and alignment is covered
+#define MAX_TEST_LENGTH 64
+#define MAX_TEST_OFFSET 32
+#define BUFFER_LENGTH (MAX_TEST_LENGTH + MAX_TEST_OFFSET)
+
+// Random fills of the buffer checked
+#define RANDOM_ROUNDS 50
+
+/**
+ * A set of kernels to check against the byte at a time ones.
+ */
+struct KernelSet {
+    const char* name;
+    struct ScanKernels kernels;
+};
+
+// Failures found so far
+static int failures = 0;
+
+/**
+ * Reports a kernel giving a different answer to the byte at a time one.
+ *
+ * @param set: the kernels which failed
+ * @param what: the kernel which failed
+ * @param offset: where the string started in the buffer
+ * @param length: the length of the string
+ * @param got: the kernel's answer
+ * @param expected: the byte at a time kernel's answer
+ */
+static void report(const struct KernelSet* set, const char* what,
+        size_t offset, size_t length, size_t got, size_t expected) {
+
+    if (failures++ < 20) {
+        fprintf(stderr, "%s %s: offset %zu length %zu gave %zu, not %zu\n",
+                set->name, what, offset, length, got, expected);
+    }
+}
+
+/**
+ * Checks every kernel of a set against the byte at a time kernels, for
+ * every string of the buffer up to MAX_TEST_LENGTH long.
+ *
+ * @param set: the kernels to check
+ * @param buffer: the bytes to scan (BUFFER_LENGTH of them)
+ * @param symbols: bytes to count
+ * @param symbolCount: the number of bytes to count
+ */
+static void check_buffer(const struct KernelSet* set, const char* buffer,
+        const char* symbols, size_t symbolCount) {
+
+    // sets of every size up to past MAX_VECTOR_SET (checked bytewise)
+    static const char sets[] = ":\n\r \x80\xff\x7f" "0ab\xb0\x01zZ9.";
+    size_t setCount = sizeof(sets) - 1;
+
+    for (size_t offset = 0; offset < MAX_TEST_OFFSET; offset++) {
+        for (size_t length = 0; length <= MAX_TEST_LENGTH; length++) {
+            const char* string = buffer + offset;
+
+            for (size_t i = 0; i < symbolCount; i++) {
+                size_t got = set->kernels.countByte(string, length,
+                        symbols[i]);
+                size_t expected = count_byte_scalar(string, length,
+                        symbols[i]);
+                if (got != expected) {
+                    report(set, "count_byte", offset, length, got,
+                            expected);
+                }
+            }
+
+            for (size_t size = 0; size <= setCount; size++) {
+                bool got = set->kernels.hasAnyByte(string, length, sets,
+                        size);
+                bool expected = has_any_byte_scalar(string, length, sets,
+                        size);
+                if (got != expected) {
+                    report(set, "has_any_byte", offset, length, got,
+                            expected);
+                }
+            }
+
+            bool got = set->kernels.allDigits(string, length);
+            bool expected = all_digits_scalar(string, length);
+            if (got != expected) {
+                report(set, "all_digits", offset, length, got, expected);
+            }
+        }
+    }
+}
+
+/**
+ * Checks all_digits against the byte at a time kernel for every string of
+ * the buffer up to MAX_TEST_LENGTH long.
+ *
+ * @param set: the kernels to check
+ * @param buffer: the bytes to scan (BUFFER_LENGTH of them)
+ */
+static void check_digits(const struct KernelSet* set, const char* buffer) {
+
+    for (size_t offset = 0; offset < MAX_TEST_OFFSET; offset++) {
+        for (size_t length = 0; length <= MAX_TEST_LENGTH; length++) {
+            bool got = set->kernels.allDigits(buffer + offset, length);
+            bool expected = all_digits_scalar(buffer + offset, length);
+            if (got != expected) {
+                report(set, "all_digits", offset, length, got, expected);
+            }
+        }
+    }
+}
+
+/**
+ * Checks a set of kernels on random bytes (of every value, including those
+ * of 0x80 and above), and all_digits on digit strings with one byte wrong
+ * at each position, by bytes just outside the digits and their high bit
+ * twins.
+ *
+ * @param set: the kernels to check
+ */
+static void check_kernels(const struct KernelSet* set) {
+
+    static const char symbols[] = {':', '\n', '0', '\x80', '\xff', '\0'};
+    static const char wrong[] = {'0' - 1, '9' + 1, '\x80', '\xb0', '\xb9',
+            '\xff', '\0'};
+    char buffer[BUFFER_LENGTH];
+
+    srand(2310);
+    for (int round = 0; round < RANDOM_ROUNDS; round++) {
+        for (size_t i = 0; i < BUFFER_LENGTH; i++) {
+            // mostly from a few bytes, so counts and matches are common
+            buffer[i] = round % 2 ? (char)(rand() & 0xff) :
+                    symbols[rand() % sizeof(symbols)];
+        }
+        check_buffer(set, buffer, symbols, sizeof(symbols));
+    }
+
+    for (size_t i = 0; i < BUFFER_LENGTH; i++) {
+        buffer[i] = '0' + i % 10;
+    }
+    check_buffer(set, buffer, symbols, sizeof(symbols));
+    for (size_t at = 0; at < BUFFER_LENGTH; at++) {
+        for (size_t w = 0; w < sizeof(wrong); w++) {
+            buffer[at] = wrong[w];
+            check_digits(set, buffer);
+        }
+        buffer[at] = '0' + at % 10;
+    }
+}
+
+int main(void) {
+
+    struct KernelSet sets[2];
+    int count = 0;
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+        sets[count++] = (struct KernelSet){"sse2", {count_byte_sse2,
+                has_any_byte_sse2, all_digits_sse2}};
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        sets[count++] = (struct KernelSet){"avx2", {count_byte_avx2,
+                has_any_byte_avx2, all_digits_avx2}};
+    }
+#endif
+
+    for (int i = 0; i < count; i++) {
+        check_kernels(&sets[i]);
+        printf("%s: %s\n", sets[i].name, failures ? "FAILED" : "ok");
+    }
+    if (count == 0) {
+        printf("no vector kernels on this CPU\n");
+    }
+
+    return failures ? 1 : 0;
+}
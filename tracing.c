@@ -0,0 +1,337 @@
+#define _GNU_SOURCE
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "tracing.h"
+#include "config.h"
+#include "placement.h"
+
+// Names of the kinds of span as written, in SPAN_* order
+static const char* spanKinds[SPAN_KINDS] = {
+    "receive", "queue", "apply", "send"
+};
+
+// The file spans are flushed to, if tracing
+static FILE* spanFile = NULL;
+
+// Finished spans waiting to be flushed, the oldest at ringStart, and how
+// many were overwritten before they could be, protected by ringLock
+static pthread_mutex_t ringLock = PTHREAD_MUTEX_INITIALIZER;
+static struct Span* ring = NULL;
+static int ringSize = 0;
+static int ringStart = 0;
+static int ringCount = 0;
+static unsigned long overwritten = 0;
+
+// Source of span and trace IDs, and of sampling decisions
+static uint64_t lastId = 0;
+static unsigned long traceables = 0;
+
+// The trace the calling thread is working for, if any
+static __thread struct TraceContext current;
+
+/**
+ * Gets the time from the wall clock, which (unlike a monotonic clock) can
+ * be compared between depots on different hosts, give or take clock skew.
+ * @return the time, in nanoseconds since the epoch
+ */
+long long trace_now_ns(void) {
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (long long)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * Writes every span in the ring to the span file, one per line, as
+ * "span trace id parent depot kind start_ns duration_ns what", with IDs in
+ * hex, then a "dropped n" line if spans were overwritten before they could
+ * be written.
+ */
+static void flush_spans(void) {
+
+    pthread_mutex_lock(&ringLock);
+    int count = ringCount;
+    struct Span* spans = malloc((count > 0 ? count : 1) *
+            sizeof(struct Span));
+    for (int i = 0; i < count; i++) {
+        spans[i] = ring[(ringStart + i) % ringSize];
+    }
+    ringStart = (ringStart + count) % ringSize;
+    ringCount = 0;
+    unsigned long dropped = overwritten;
+    overwritten = 0;
+    pthread_mutex_unlock(&ringLock);
+
+    for (int i = 0; i < count; i++) {
+        fprintf(spanFile, "span %016" PRIx64 " %016" PRIx64 " %016" PRIx64
+                " %s %s %lld %lld %s\n", spans[i].trace, spans[i].span,
+                spans[i].parent, spans[i].depot, spanKinds[spans[i].kind],
+                spans[i].startNs, spans[i].endNs - spans[i].startNs,
+                spans[i].what);
+    }
+    if (dropped > 0) {
+        fprintf(spanFile, "dropped %lu\n", dropped);
+    }
+    fflush(spanFile);
+    free(spans);
+}
+
+/**
+ * Thread function which flushes the span ring to the span file every
+ * DEPOT_TRACE_FLUSH_MS.
+ *
+ * @param arg: unused
+ * @return NULL (for thread function definition)
+ */
+static void* flush_thread(void* arg) {
+
+    place_thread(ROLE_REPORT);
+    int flushMs = get_config()->traceFlushMs;
+    struct timespec pause = {flushMs / 1000, (flushMs % 1000) * 1000000L};
+    while (1) {
+        nanosleep(&pause, NULL);
+        flush_spans();
+    }
+    return NULL;
+}
+
+/**
+ * Starts recording spans, if DEPOT_TRACE_FILE is set: opens the file
+ * (appending, so restarts don't lose earlier spans) and starts the thread
+ * which flushes the ring to it. Span IDs are seeded from the clock and
+ * process ID, so depots' IDs don't collide. Must be called once in main,
+ * before any connections are made.
+ */
+void start_tracing(void) {
+
+    const struct Config* config = get_config();
+    if (config->traceFile == NULL) {
+        return;
+    }
+    spanFile = fopen(config->traceFile, "a");
+    if (spanFile == NULL) {
+        return;
+    }
+
+    ringSize = config->traceRing;
+    ring = malloc(ringSize * sizeof(struct Span));
+    lastId = ((uint64_t)trace_now_ns() << 16) ^ ((uint64_t)getpid() << 40);
+
+    pthread_t tid;
+    pthread_create(&tid, 0, flush_thread, NULL);
+    pthread_detach(tid);
+}
+
+/**
+ * Checks whether spans are being recorded.
+ * @return true if tracing, false otherwise
+ */
+bool tracing(void) {
+    return spanFile != NULL;
+}
+
+/**
+ * Gives out an ID for a new span or trace.
+ * @return the new ID (never 0)
+ */
+uint64_t new_span_id(void) {
+
+    uint64_t id;
+    do {
+        // spread consecutive IDs out, so they are easier to tell apart
+        id = __atomic_add_fetch(&lastId, 1, __ATOMIC_RELAXED) *
+                0x9e3779b97f4a7c15ULL;
+    } while (id == 0);
+    return id;
+}
+
+/**
+ * Decides whether a message which could start a trace should, keeping one
+ * in every DEPOT_TRACE_SAMPLE. Never starts one if not tracing.
+ * @return true if a trace should be started, false otherwise
+ */
+bool sample_trace(void) {
+
+    if (!tracing()) {
+        return false;
+    }
+    unsigned long count = __atomic_fetch_add(&traceables, 1,
+            __ATOMIC_RELAXED);
+    return count % get_config()->traceSample == 0;
+}
+
+/**
+ * Gets the trace the calling thread is working for.
+ * @return the thread's trace context, or NULL if it has none
+ */
+const struct TraceContext* current_trace(void) {
+    return current.trace != 0 ? &current : NULL;
+}
+
+/**
+ * Sets the trace the calling thread is working for, until
+ * clear_current_trace is called.
+ *
+ * @param trace: the trace's ID
+ * @param span: the span the thread is working in
+ * @param depot: the name of the depot doing the work
+ */
+void set_current_trace(uint64_t trace, uint64_t span, const char* depot) {
+
+    current.trace = trace;
+    current.span = span;
+    current.depot = depot;
+}
+
+/**
+ * Stops the calling thread working for a trace.
+ */
+void clear_current_trace(void) {
+    current.trace = 0;
+}
+
+/**
+ * Copies a name into a span, up to the first ':' (so a message's name is
+ * kept, without its arguments), cut short to fit.
+ *
+ * @param out: where to copy to (SPAN_WHAT_LENGTH bytes)
+ * @param name: the name to copy, or NULL for none
+ */
+static void copy_name(char* out, const char* name) {
+
+    int length = 0;
+    while (name != NULL && name[length] != '\0' && name[length] != ':' &&
+            name[length] != '\n' && length < SPAN_WHAT_LENGTH - 1) {
+        out[length] = name[length];
+        length++;
+    }
+    if (length == 0) {
+        out[length++] = '-';
+    }
+    out[length] = '\0';
+}
+
+/**
+ * Adds a finished span to the ring, to be flushed to the span file. If the
+ * ring is full, its oldest span is overwritten (and counted as dropped).
+ * Does nothing if not tracing.
+ *
+ * @param trace: the trace's ID
+ * @param span: the span's ID
+ * @param parent: the parent span's ID, or 0 for a trace's first span
+ * @param kind: one of SPAN_*
+ * @param startNs: when the span started (see trace_now_ns)
+ * @param endNs: when the span ended
+ * @param depot: the name of the depot the span was in
+ * @param what: the message the span was for
+ */
+void record_span(uint64_t trace, uint64_t span, uint64_t parent, int kind,
+        long long startNs, long long endNs, const char* depot,
+        const char* what) {
+
+    if (!tracing()) {
+        return;
+    }
+
+    struct Span record = {trace, span, parent, kind, startNs, endNs, "", ""};
+    copy_name(record.depot, depot);
+    copy_name(record.what, what);
+
+    pthread_mutex_lock(&ringLock);
+    if (ringCount == ringSize) {
+        ringStart = (ringStart + 1) % ringSize;
+        ringCount--;
+        overwritten++;
+    }
+    ring[(ringStart + ringCount) % ringSize] = record;
+    ringCount++;
+    pthread_mutex_unlock(&ringLock);
+}
+
+/**
+ * Starts handling a message from a neighbour's channel. A message sent on
+ * behalf of a trace is queued with a "Trace:trace:parent:received\n"
+ * header (see deliver_line), in which case its receive and queue spans are
+ * recorded and the calling thread works for the trace until
+ * end_traced_message.
+ *
+ * @param string: the message as queued
+ * @param depot: the name of the depot handling it
+ * @param traced: filled in with the message's trace, if it has one
+ * @return the message itself, after any header
+ */
+char* begin_traced_message(char* string, const char* depot,
+        struct TracedMessage* traced) {
+
+    traced->trace = 0;
+    if (strncmp(string, "Trace:", strlen("Trace:")) != 0) {
+        return string;
+    }
+
+    char* message = strchr(string, '\n');
+    uint64_t trace, parent;
+    long long receivedNs;
+    if (message == NULL || sscanf(string, "Trace:%" SCNx64 ":%" SCNx64
+            ":%lld", &trace, &parent, &receivedNs) != 3) {
+        return message == NULL ? string : message + 1;
+    }
+    message++;
+
+    traced->trace = trace;
+    traced->parent = parent;
+    traced->span = new_span_id();
+    traced->startNs = trace_now_ns();
+    traced->depot = depot;
+    copy_name(traced->what, message);
+    record_span(trace, new_span_id(), parent, SPAN_RECEIVE, receivedNs,
+            receivedNs, depot, message);
+    record_span(trace, new_span_id(), parent, SPAN_QUEUE, receivedNs,
+            traced->startNs, depot, message);
+    set_current_trace(trace, traced->span, depot);
+
+    return message;
+}
+
+/**
+ * Starts a new trace for a message this depot is handling (which didn't
+ * arrive with one), the calling thread working for it until
+ * end_traced_message.
+ *
+ * @param traced: filled in with the new trace
+ * @param depot: the name of the depot handling the message
+ * @param what: the message's name
+ */
+void begin_root_trace(struct TracedMessage* traced, const char* depot,
+        const char* what) {
+
+    traced->trace = new_span_id();
+    traced->parent = 0;
+    traced->span = new_span_id();
+    traced->startNs = trace_now_ns();
+    traced->depot = depot;
+    copy_name(traced->what, what);
+    set_current_trace(traced->trace, traced->span, depot);
+}
+
+/**
+ * Finishes handling a traced message, recording its apply span. Does
+ * nothing if the message wasn't traced.
+ *
+ * @param traced: the message, as set up by begin_traced_message or
+ *      begin_root_trace
+ */
+void end_traced_message(struct TracedMessage* traced) {
+
+    if (traced->trace == 0) {
+        return;
+    }
+    record_span(traced->trace, traced->span, traced->parent, SPAN_APPLY,
+            traced->startNs, trace_now_ns(), traced->depot, traced->what);
+    clear_current_trace();
+    traced->trace = 0;
+}
@@ -0,0 +1,87 @@
+#ifndef TRACING_H
+#define TRACING_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Kinds of span, in the order a message passes through them
+#define SPAN_RECEIVE 0
+#define SPAN_QUEUE 1
+#define SPAN_APPLY 2
+#define SPAN_SEND 3
+#define SPAN_KINDS 4
+
+// Longest message name kept with a span
+#define SPAN_WHAT_LENGTH 16
+
+/**
+ * The trace a thread is working on behalf of: the trace's ID, the span
+ * being worked in (the parent of any spans it starts), and the name of the
+ * depot doing the work.
+ */
+struct TraceContext {
+    uint64_t trace;
+    uint64_t span;
+    const char* depot;
+};
+
+/**
+ * A finished span, as kept in the span ring until it is flushed: which
+ * trace it belongs to, its own and its parent's IDs, its kind, when it
+ * started and ended (wall clock nanoseconds, so different depots' spans
+ * can be lined up), and the depot and message it was for.
+ */
+struct Span {
+    uint64_t trace;
+    uint64_t span;
+    uint64_t parent;
+    int kind;
+    long long startNs;
+    long long endNs;
+    char depot[SPAN_WHAT_LENGTH];
+    char what[SPAN_WHAT_LENGTH];
+};
+
+/**
+ * A message being handled on behalf of a trace: the trace, the span it
+ * arrived in (its parent), its apply span, when handling started, and its
+ * name. Trace is 0 if the message isn't traced.
+ */
+struct TracedMessage {
+    uint64_t trace;
+    uint64_t parent;
+    uint64_t span;
+    long long startNs;
+    const char* depot;
+    char what[SPAN_WHAT_LENGTH];
+};
+
+void start_tracing(void);
+
+bool tracing(void);
+
+long long trace_now_ns(void);
+
+uint64_t new_span_id(void);
+
+bool sample_trace(void);
+
+const struct TraceContext* current_trace(void);
+
+void set_current_trace(uint64_t trace, uint64_t span, const char* depot);
+
+void clear_current_trace(void);
+
+void record_span(uint64_t trace, uint64_t span, uint64_t parent, int kind,
+        long long startNs, long long endNs, const char* depot,
+        const char* what);
+
+char* begin_traced_message(char* string, const char* depot,
+        struct TracedMessage* traced);
+
+void begin_root_trace(struct TracedMessage* traced, const char* depot,
+        const char* what);
+
+void end_traced_message(struct TracedMessage* traced);
+
+#endif //TRACING_H
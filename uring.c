@@ -0,0 +1,768 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include "uring.h"
+#include "network.h"
+#include "placement.h"
+
+#define URING_ENTRIES 256
+#define RECV_BUFFERS 256
+#define RECV_BUFFER_SIZE 4096
+#define RECV_GROUP 0
+
+// Kinds of operation, kept in the low bits of each operation's user_data
+// (listeners and connections are malloc'd, so their low bits are free)
+#define OP_WAKE 0
+#define OP_ACCEPT 1
+#define OP_RECV 2
+#define OP_SEND 3
+#define OP_CANCEL 4
+#define OP_MASK 7
+
+/**
+ * A listener or connection waiting for the engine thread to start
+ * operations on it (only the engine thread may touch the submission queue).
+ */
+struct UringArm {
+    int kind;
+    void* target;
+    struct UringArm* next;
+};
+
+// The ring itself, only used by the engine thread once started
+static int ringFd = -1;
+static unsigned* sqHead;
+static unsigned* sqTail;
+static unsigned sqMask;
+static unsigned sqEntries;
+static unsigned* sqArray;
+static struct io_uring_sqe* sqes;
+static unsigned* cqHead;
+static unsigned* cqTail;
+static unsigned cqMask;
+static struct io_uring_cqe* cqes;
+static unsigned localTail;
+static unsigned toSubmit;
+
+// Provided buffers which multishot receives pick from
+static struct io_uring_buf_ring* bufRing;
+static char* recvBuffers;
+static unsigned short bufTail;
+
+// Wakeups for the engine thread, when it is sleeping in io_uring_enter
+static int wakeFd = -1;
+static uint64_t wakeValue;
+static int engineSleeping = 0;
+
+// Work handed to the engine thread by other threads
+static pthread_mutex_t engineLock = PTHREAD_MUTEX_INITIALIZER;
+static struct UringArm* armList = NULL;
+static struct UringConn* readyList = NULL;
+static struct UringConn* resumeList = NULL;
+
+static bool engineRunning = false;
+
+/**
+ * Gets a free submission queue entry, submitting what has been queued so
+ * far if the queue is full.
+ *
+ * @return a cleared submission queue entry
+ */
+static struct io_uring_sqe* get_sqe(void) {
+
+    while (localTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) ==
+            sqEntries) {
+        __atomic_store_n(sqTail, localTail, __ATOMIC_RELEASE);
+        syscall(__NR_io_uring_enter, ringFd, toSubmit, 0, 0, NULL, 0);
+        toSubmit = 0;
+    }
+
+    unsigned index = localTail & sqMask;
+    sqArray[index] = index;
+    localTail++;
+    toSubmit++;
+
+    struct io_uring_sqe* sqe = &sqes[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    return sqe;
+}
+
+/**
+ * Queues a read of the wakeup eventfd, which completes when another thread
+ * wakes the engine.
+ */
+static void arm_wake(void) {
+
+    struct io_uring_sqe* sqe = get_sqe();
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = wakeFd;
+    sqe->addr = (uint64_t)(uintptr_t)&wakeValue;
+    sqe->len = sizeof(uint64_t);
+    sqe->user_data = OP_WAKE;
+}
+
+/**
+ * Queues a multishot accept on a listening socket.
+ * @param listener: the listener to accept on
+ */
+static void arm_accept(struct UringListener* listener) {
+
+    struct io_uring_sqe* sqe = get_sqe();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listener->fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = (uint64_t)(uintptr_t)listener | OP_ACCEPT;
+}
+
+/**
+ * Queues a multishot receive on a neighbour socket, using provided buffers.
+ * @param conn: the connection to receive on
+ */
+static void arm_recv(struct UringConn* conn) {
+
+    struct io_uring_sqe* sqe = get_sqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = RECV_GROUP;
+    sqe->user_data = (uint64_t)(uintptr_t)conn | OP_RECV;
+    conn->receiving = true;
+    conn->cancelling = false;
+}
+
+/**
+ * Queues the cancellation of a connection's multishot receive, which then
+ * completes (without IORING_CQE_F_MORE) once any data already received has
+ * been handed over.
+ *
+ * @param conn: the connection to stop receiving on
+ */
+static void arm_cancel(struct UringConn* conn) {
+
+    struct io_uring_sqe* sqe = get_sqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = (uint64_t)(uintptr_t)conn | OP_RECV;
+    sqe->user_data = (uint64_t)(uintptr_t)conn | OP_CANCEL;
+    conn->cancelling = true;
+}
+
+/**
+ * Queues a send of the rest of a connection's in flight data.
+ * @param conn: the connection to send on
+ */
+static void arm_send(struct UringConn* conn) {
+
+    struct io_uring_sqe* sqe = get_sqe();
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = conn->fd;
+    sqe->addr = (uint64_t)(uintptr_t)(conn->inflight + conn->inflightOffset);
+    sqe->len = conn->inflightLength - conn->inflightOffset;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (uint64_t)(uintptr_t)conn | OP_SEND;
+}
+
+/**
+ * Gives a receive buffer back to the kernel once its data has been used.
+ * @param bid: the id of the buffer
+ */
+static void recycle_buffer(unsigned short bid) {
+
+    struct io_uring_buf* buf = &bufRing->bufs[bufTail & (RECV_BUFFERS - 1)];
+    buf->addr = (uint64_t)(uintptr_t)(recvBuffers + bid * RECV_BUFFER_SIZE);
+    buf->len = RECV_BUFFER_SIZE;
+    buf->bid = bid;
+    bufTail++;
+    __atomic_store_n(&bufRing->tail, bufTail, __ATOMIC_RELEASE);
+}
+
+/**
+ * Starts sending a connection's pending lines, if nothing is in flight for
+ * it. The pending and in flight buffers are swapped, so lines can keep
+ * being queued while the send happens.
+ *
+ * @param conn: the connection to send on (its send lock must be held)
+ */
+static void start_send(struct UringConn* conn) {
+
+    if (conn->sending || conn->pendingLength == 0) {
+        return;
+    }
+
+    char* buffer = conn->inflight;
+    size_t capacity = conn->inflightCapacity;
+    conn->inflight = conn->pending;
+    conn->inflightCapacity = conn->pendingCapacity;
+    conn->inflightLength = conn->pendingLength;
+    conn->inflightOffset = 0;
+    conn->pending = buffer;
+    conn->pendingCapacity = capacity;
+    conn->pendingLength = 0;
+    conn->sending = true;
+
+    arm_send(conn);
+}
+
+/**
+ * Frees a connection the engine no longer has any operations for, closing
+ * the engine's descriptor for its socket.
+ *
+ * @param conn: the connection to free (its send lock must not be held)
+ */
+static void free_conn(struct UringConn* conn) {
+
+    close(conn->fd);
+    pthread_mutex_destroy(&conn->sendLock);
+    free(conn->pending);
+    free(conn->inflight);
+    free(conn);
+}
+
+/**
+ * Marks a connection as paused (waiting for the action thread to make room
+ * for its stalled lines) or not. Once unpaused, it is taken off the list of
+ * connections to resume, so a connection which has since finished is never
+ * resumed. Only called by the engine thread.
+ *
+ * @param conn: the connection to mark
+ * @param paused: true if it is paused, false otherwise
+ */
+static void set_paused(struct UringConn* conn, bool paused) {
+
+    if (conn->paused == paused) {
+        return;
+    }
+
+    pthread_mutex_lock(&engineLock);
+    __atomic_store_n(&conn->paused, paused, __ATOMIC_RELAXED);
+    if (!paused && conn->resuming) {
+        struct UringConn** link = &resumeList;
+        while (*link != conn) {
+            link = &(*link)->nextResume;
+        }
+        *link = conn->nextResume;
+        conn->resuming = false;
+    }
+    pthread_mutex_unlock(&engineLock);
+}
+
+/**
+ * Carries on receiving on a connection once its data has been passed on.
+ * If lines are stalled for want of room in the channel (see
+ * queue_stalled_lines), the receive is cancelled rather than re-armed, and
+ * the connection paused until the action thread has made room (see
+ * uring_resume), so the engine never waits and nothing is dropped.
+ *
+ * @param conn: the connection to carry on with
+ */
+static void keep_receiving(struct UringConn* conn) {
+
+    if (!queue_stalled_lines(conn->connection, &conn->line, false)) {
+        set_paused(conn, true);
+
+        // the action thread may have made room before it saw the pause
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (!queue_stalled_lines(conn->connection, &conn->line, false)) {
+            if (conn->receiving && !conn->cancelling) {
+                arm_cancel(conn);
+            }
+            return;
+        }
+    }
+
+    set_paused(conn, false);
+    if (!conn->receiving) {
+        arm_recv(conn);
+    }
+}
+
+/**
+ * Handles the completion of a receive on a neighbour socket, splitting the
+ * data into lines as reader_thread does (see read_into_line), then
+ * receiving more (see keep_receiving). The kernel may stop a multishot
+ * receive (e.g. out of buffers, or cancelled), in which case it is
+ * re-armed. When the other end closes the socket (or it fails), any
+ * unterminated last line is passed on, then the connection is told its
+ * reader has finished, without blocking the engine (see
+ * reader_finished_nowait).
+ *
+ * @param conn: the connection the receive was on
+ * @param cqe: the completion
+ */
+static void complete_recv(struct UringConn* conn, struct io_uring_cqe* cqe) {
+
+    if (cqe->res == -EINVAL) { // no multishot receives, use a thread
+        pthread_t tid;
+        pthread_create(&tid, 0, reader_thread, conn->connection);
+        pthread_detach(tid);
+        return;
+    }
+
+    if (cqe->res > 0) {
+        unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        read_into_line(conn->connection, &conn->line,
+                recvBuffers + bid * RECV_BUFFER_SIZE, cqe->res, false);
+        recycle_buffer(bid);
+    }
+
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        conn->receiving = false;
+        if (cqe->res <= 0 && cqe->res != -ENOBUFS &&
+                cqe->res != -ECANCELED) {
+            set_paused(conn, false);
+            reader_finished_nowait(conn->connection, &conn->line);
+            return;
+        }
+    }
+    keep_receiving(conn);
+}
+
+/**
+ * Handles the completion of a send on a neighbour socket, sending the rest
+ * if only part was sent, then starting the next batch of pending lines.
+ *
+ * @param conn: the connection the send was on
+ * @param cqe: the completion
+ */
+static void complete_send(struct UringConn* conn, struct io_uring_cqe* cqe) {
+
+    pthread_mutex_lock(&conn->sendLock);
+    if (cqe->res > 0 && !conn->closing) {
+        conn->inflightOffset += cqe->res;
+        if (conn->inflightOffset < conn->inflightLength) {
+            arm_send(conn); // short send
+            pthread_mutex_unlock(&conn->sendLock);
+            return;
+        }
+    }
+
+    // sent (or the socket failed, and the data is dropped)
+    conn->sending = false;
+    bool closing = conn->closing;
+    start_send(conn);
+    pthread_mutex_unlock(&conn->sendLock);
+
+    if (closing) {
+        free_conn(conn);
+    }
+}
+
+/**
+ * Handles the completion of an accept on a listening socket, starting
+ * communication with the depot which connected.
+ *
+ * @param listener: the listener the accept was on
+ * @param cqe: the completion
+ */
+static void complete_accept(struct UringListener* listener,
+        struct io_uring_cqe* cqe) {
+
+    if (cqe->res == -EINVAL) { // no multishot accepts, use a thread
+        pthread_t tid;
+        pthread_create(&tid, 0, connection_thread, listener->wrapper);
+        pthread_detach(tid);
+        return;
+    }
+
+    if (cqe->res >= 0) {
+        struct ConnectionWrapper* wrapper = listener->wrapper;
+        start_communication_threads(new_connection_wrapper(
+                wrapper->thisDepot, wrapper->inventory,
+                wrapper->firstDeferral, wrapper->dataLock),
+                cqe->res, dup(cqe->res));
+    }
+
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        arm_accept(listener);
+    }
+}
+
+/**
+ * Starts operations for everything handed over by other threads: new
+ * listeners and connections to arm, connections with lines to send, and
+ * paused connections the action thread has made room for.
+ */
+static void take_work(void) {
+
+    pthread_mutex_lock(&engineLock);
+    struct UringArm* arms = armList;
+    struct UringConn* ready = readyList;
+    struct UringConn* resume = resumeList;
+    armList = NULL;
+    readyList = NULL;
+    resumeList = NULL;
+    for (struct UringConn* conn = resume; conn != NULL;
+            conn = conn->nextResume) {
+        conn->resuming = false;
+    }
+    pthread_mutex_unlock(&engineLock);
+
+    while (arms != NULL) {
+        struct UringArm* arm = arms;
+        arms = arm->next;
+        if (arm->kind == OP_ACCEPT) {
+            arm_accept(arm->target);
+        } else {
+            arm_recv(arm->target);
+        }
+        free(arm);
+    }
+
+    while (ready != NULL) {
+        struct UringConn* conn = ready;
+        ready = conn->nextReady;
+
+        pthread_mutex_lock(&conn->sendLock);
+        conn->ready = false;
+        bool closing = conn->closing;
+        if (!closing) {
+            start_send(conn);
+        }
+        pthread_mutex_unlock(&conn->sendLock);
+
+        if (closing) {
+            free_conn(conn);
+        }
+    }
+
+    while (resume != NULL) {
+        struct UringConn* conn = resume;
+        resume = conn->nextResume;
+        keep_receiving(conn);
+    }
+}
+
+/**
+ * Thread function for the io_uring engine. Each loop submits every queued
+ * operation and reaps every completion with a single io_uring_enter call,
+ * so many messages are handled per system call.
+ *
+ * @param arg: unused
+ * @return NULL (for thread function definition)
+ */
+static void* uring_thread(void* arg) {
+
+    place_thread(ROLE_IO);
+    arm_wake();
+
+    while (1) {
+        note_thread_cpu();
+        take_work();
+
+        // only sleep if no other thread handed over work meanwhile
+        __atomic_store_n(&engineSleeping, 1, __ATOMIC_SEQ_CST);
+        unsigned wait = 1;
+        if (__atomic_load_n(&armList, __ATOMIC_SEQ_CST) != NULL ||
+                __atomic_load_n(&readyList, __ATOMIC_SEQ_CST) != NULL ||
+                __atomic_load_n(&resumeList, __ATOMIC_SEQ_CST) != NULL) {
+            __atomic_store_n(&engineSleeping, 0, __ATOMIC_SEQ_CST);
+            wait = 0;
+        }
+
+        __atomic_store_n(sqTail, localTail, __ATOMIC_RELEASE);
+        syscall(__NR_io_uring_enter, ringFd, toSubmit, wait,
+                IORING_ENTER_GETEVENTS, NULL, 0);
+        toSubmit = 0;
+        __atomic_store_n(&engineSleeping, 0, __ATOMIC_SEQ_CST);
+
+        unsigned head = __atomic_load_n(cqHead, __ATOMIC_ACQUIRE);
+        unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            struct io_uring_cqe* cqe = &cqes[head & cqMask];
+            void* target = (void*)(uintptr_t)(cqe->user_data & ~OP_MASK);
+
+            switch (cqe->user_data & OP_MASK) {
+                case OP_WAKE:
+                    arm_wake();
+                    break;
+
+                case OP_ACCEPT:
+                    complete_accept(target, cqe);
+                    break;
+
+                case OP_RECV:
+                    complete_recv(target, cqe);
+                    break;
+
+                case OP_SEND:
+                    complete_send(target, cqe);
+                    break;
+
+                default: // a cancellation, seen through its receive
+                    break;
+            }
+        }
+        __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+    }
+
+    return NULL;
+}
+
+/**
+ * Wakes the engine thread, only making a system call if it is asleep.
+ */
+static void wake_engine(void) {
+
+    if (__atomic_exchange_n(&engineSleeping, 0, __ATOMIC_SEQ_CST)) {
+        uint64_t wakeup = 1;
+        if (write(wakeFd, &wakeup, sizeof(uint64_t)) == -1) {
+            return; // a wakeup is already pending
+        }
+    }
+}
+
+/**
+ * Hands a listener or connection to the engine thread to be armed.
+ *
+ * @param kind: OP_ACCEPT or OP_RECV
+ * @param target: the listener or connection
+ */
+static void queue_arm(int kind, void* target) {
+
+    struct UringArm* arm = malloc(sizeof(struct UringArm));
+    arm->kind = kind;
+    arm->target = target;
+
+    pthread_mutex_lock(&engineLock);
+    arm->next = armList;
+    armList = arm;
+    pthread_mutex_unlock(&engineLock);
+
+    wake_engine();
+}
+
+/**
+ * Registers the ring of provided buffers which multishot receives use.
+ * @return true if the kernel accepted the buffer ring
+ */
+static bool setup_buffers(void) {
+
+    bufRing = mmap(NULL, RECV_BUFFERS * sizeof(struct io_uring_buf),
+            PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (bufRing == MAP_FAILED) {
+        return false;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(struct io_uring_buf_reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)bufRing;
+    reg.ring_entries = RECV_BUFFERS;
+    reg.bgid = RECV_GROUP;
+    if (syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_PBUF_RING,
+            &reg, 1) < 0) {
+        return false;
+    }
+
+    recvBuffers = malloc((size_t)RECV_BUFFERS * RECV_BUFFER_SIZE);
+    for (unsigned short bid = 0; bid < RECV_BUFFERS; bid++) {
+        recycle_buffer(bid);
+    }
+
+    return true;
+}
+
+/**
+ * Sets up an io_uring instance and starts the engine thread. Fails cleanly
+ * (leaving the thread per connection engine in use) if the kernel doesn't
+ * support io_uring, or lacks the features the engine needs.
+ *
+ * @return true if the engine was started, false otherwise
+ */
+bool start_uring_engine(void) {
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(struct io_uring_params));
+    ringFd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (ringFd < 0) {
+        return false;
+    }
+
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        close(ringFd);
+        return false;
+    }
+
+    size_t sqSize = params.sq_off.array +
+            params.sq_entries * sizeof(unsigned);
+    size_t cqSize = params.cq_off.cqes +
+            params.cq_entries * sizeof(struct io_uring_cqe);
+    size_t ringSize = sqSize > cqSize ? sqSize : cqSize;
+
+    char* ring = mmap(NULL, ringSize, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+    sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd,
+            IORING_OFF_SQES);
+    if (ring == MAP_FAILED || sqes == MAP_FAILED || !setup_buffers()) {
+        close(ringFd);
+        return false;
+    }
+
+    sqHead = (unsigned*)(ring + params.sq_off.head);
+    sqTail = (unsigned*)(ring + params.sq_off.tail);
+    sqMask = *(unsigned*)(ring + params.sq_off.ring_mask);
+    sqEntries = *(unsigned*)(ring + params.sq_off.ring_entries);
+    sqArray = (unsigned*)(ring + params.sq_off.array);
+    cqHead = (unsigned*)(ring + params.cq_off.head);
+    cqTail = (unsigned*)(ring + params.cq_off.tail);
+    cqMask = *(unsigned*)(ring + params.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe*)(ring + params.cq_off.cqes);
+    localTail = *sqTail;
+
+    wakeFd = eventfd(0, EFD_CLOEXEC);
+
+    pthread_t tid;
+    pthread_create(&tid, 0, uring_thread, NULL);
+    pthread_detach(tid);
+    engineRunning = true;
+
+    return true;
+}
+
+/**
+ * Checks whether the io_uring engine is running.
+ * @return true if the engine was started successfully
+ */
+bool uring_enabled(void) {
+    return engineRunning;
+}
+
+/**
+ * Has the engine accept connections on a listening socket, instead of an
+ * acceptor thread.
+ *
+ * @param fd: the listening socket
+ * @param wrapper: the wrapper accepted connections are created from
+ * @return true if the engine will accept on the socket
+ */
+bool uring_watch_listener(int fd, struct ConnectionWrapper* wrapper) {
+
+    if (!engineRunning) {
+        return false;
+    }
+
+    struct UringListener* listener = malloc(sizeof(struct UringListener));
+    listener->fd = fd;
+    listener->wrapper = wrapper;
+    queue_arm(OP_ACCEPT, listener);
+
+    return true;
+}
+
+/**
+ * Has the engine receive on a neighbour socket, instead of a reader
+ * thread. Received lines are written to the connection's channel.
+ *
+ * @param fd: the neighbour socket (the engine's own descriptor for it,
+ *      closed when the connection is freed)
+ * @param connection: the connection the socket belongs to
+ * @return the engine's record of the connection, used to send on it
+ */
+struct UringConn* uring_add_connection(int fd,
+        struct ConnectionWrapper* connection) {
+
+    struct UringConn* conn = calloc(1, sizeof(struct UringConn));
+    conn->fd = fd;
+    conn->connection = connection;
+    pthread_mutex_init(&conn->sendLock, NULL);
+    queue_arm(OP_RECV, conn);
+
+    return conn;
+}
+
+/**
+ * Queues a line to be sent on a neighbour socket by the engine. Lines
+ * queued while a send is in flight are sent together once it completes.
+ *
+ * @param conn: the connection to send on
+ * @param line: the line to send, without a newline
+ * @param length: the length of the line
+ */
+void uring_send(struct UringConn* conn, const char* line, size_t length) {
+
+    pthread_mutex_lock(&conn->sendLock);
+    if (conn->closing) {
+        pthread_mutex_unlock(&conn->sendLock);
+        return;
+    }
+    if (conn->pendingLength + length + 1 > conn->pendingCapacity) {
+        conn->pendingCapacity = (conn->pendingLength + length + 1) * 2;
+        conn->pending = realloc(conn->pending, conn->pendingCapacity);
+    }
+    memcpy(conn->pending + conn->pendingLength, line, length);
+    conn->pending[conn->pendingLength + length] = '\n';
+    conn->pendingLength += length + 1;
+
+    // a send in flight picks up the new line when it completes
+    bool queue = !conn->ready && !conn->sending;
+    if (queue) {
+        conn->ready = true;
+    }
+    pthread_mutex_unlock(&conn->sendLock);
+
+    if (queue) {
+        pthread_mutex_lock(&engineLock);
+        conn->nextReady = readyList;
+        readyList = conn;
+        pthread_mutex_unlock(&engineLock);
+        wake_engine();
+    }
+}
+
+/**
+ * Hands a paused connection (see keep_receiving) back to the engine, once
+ * the action thread has freed one of its messages, making room for its
+ * stalled lines. Does nothing (without taking a lock) if it isn't paused.
+ *
+ * @param conn: the connection the action thread freed a message for
+ */
+void uring_resume(struct UringConn* conn) {
+
+    // pairs with the fence in keep_receiving, so room isn't missed
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(&conn->paused, __ATOMIC_RELAXED)) {
+        return;
+    }
+
+    pthread_mutex_lock(&engineLock);
+    bool queue = conn->paused && !conn->resuming;
+    if (queue) {
+        conn->resuming = true;
+        conn->nextResume = resumeList;
+        resumeList = conn;
+    }
+    pthread_mutex_unlock(&engineLock);
+
+    if (queue) {
+        wake_engine();
+    }
+}
+
+/**
+ * Removes a connection from the engine, once its receive has finished.
+ * Lines not yet sent are dropped. The connection is freed here if the
+ * engine has nothing in flight for it, otherwise by the engine thread once
+ * it has.
+ *
+ * @param conn: the connection to remove
+ */
+void uring_remove_connection(struct UringConn* conn) {
+
+    pthread_mutex_lock(&conn->sendLock);
+    conn->closing = true;
+    conn->pendingLength = 0;
+    bool idle = !conn->sending && !conn->ready;
+    pthread_mutex_unlock(&conn->sendLock);
+
+    if (idle) {
+        free_conn(conn);
+    }
+}
@@ -0,0 +1,75 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+#include "network.h"
+
+struct ConnectionWrapper;
+
+/**
+ * A neighbour socket served by the io_uring engine. Received data is split
+ * into lines and passed to the connection, as reader_thread would. Lines
+ * to send are gathered in pending until the previous send on the socket
+ * has completed, then sent together in one operation. The engine has its
+ * own descriptor for the socket, and frees the connection once it is
+ * closing and no send is in flight or waiting to start.
+ */
+struct UringConn {
+    int fd;
+    struct ConnectionWrapper* connection;
+
+    // received data not yet ending in a newline, and lines stalled for
+    // want of room in the channel, and whether a receive is armed or being
+    // cancelled (engine thread only)
+    struct PartialLine line;
+    bool receiving;
+    bool cancelling;
+
+    // set while stalled lines wait for the action thread, which then puts
+    // the connection on the engine's resume list (protected by engineLock)
+    bool paused;
+    bool resuming;
+    struct UringConn* nextResume;
+
+    // lines waiting to be sent, and the send in flight
+    pthread_mutex_t sendLock;
+    char* pending;
+    size_t pendingLength;
+    size_t pendingCapacity;
+    char* inflight;
+    size_t inflightLength;
+    size_t inflightOffset;
+    size_t inflightCapacity;
+    bool sending;
+    bool ready;
+    bool closing;
+    struct UringConn* nextReady;
+};
+
+/**
+ * A listening socket served by the io_uring engine, with the wrapper
+ * accepted connections are created from.
+ */
+struct UringListener {
+    int fd;
+    struct ConnectionWrapper* wrapper;
+};
+
+bool start_uring_engine(void);
+
+bool uring_enabled(void);
+
+bool uring_watch_listener(int fd, struct ConnectionWrapper* wrapper);
+
+struct UringConn* uring_add_connection(int fd,
+        struct ConnectionWrapper* connection);
+
+void uring_send(struct UringConn* conn, const char* line, size_t length);
+
+void uring_resume(struct UringConn* conn);
+
+void uring_remove_connection(struct UringConn* conn);
+
+#endif //URING_H
@@ -1,4 +1,10 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
 #include "util.h"
+#include "simd.h"
+
+#define INITIAL_LINE_SIZE 256
 
 /**
  * Counts and returns the number of a specific symbol in
@@ -11,13 +17,7 @@
  */
 int count_symbol(char* string, char symbol) {
 
-    int numSymbol = 0;
-    for (int i = 0; i < strlen(string); i++) {
-        if (string[i] == symbol) {
-            numSymbol++;
-        }
-    }
-    return numSymbol;
+    return scan_count_byte(string, strlen(string), symbol);
 }
 
 /**
@@ -49,18 +49,12 @@ int string_compare(const void* v1, const void* v2) {
  */
 bool check_string_match(char* string, char* msg) {
 
-    if (strlen(msg) < strlen(string)) {
+    size_t length = strlen(string);
+    if (strlen(msg) < length) {
         return false;
     }
 
-    for (int i = 0; i < strlen(string); i++) {
-
-        if (msg[i] != string[i]) {
-            return false;
-        }
-    }
-
-    return true;
+    return memcmp(msg, string, length) == 0;
 }
 
 /**
@@ -74,18 +68,8 @@ bool check_string_match(char* string, char* msg) {
  */
 bool check_characters(char* string, char* invalidChars) {
 
-    for (int i = 0; i < strlen(string); i++) {
-
-        for (int j = 0; j < strlen(invalidChars); j++) {
-
-            if (string[i] == invalidChars[j]) {
-                return false;
-            }
-
-        }
-    }
-
-    return true;
+    return !scan_has_any_byte(string, strlen(string), invalidChars,
+            strlen(invalidChars));
 }
 
 /**
@@ -97,11 +81,79 @@ bool check_characters(char* string, char* invalidChars) {
  */
 bool is_a_number(char* arg) {
 
-    for (int i = 0; i < strlen(arg); i++) {
-        if (!isdigit(arg[i])) {
-            return false;
-        }
+    return scan_all_digits(arg, strlen(arg));
+}
+
+/**
+ * Sets up an empty line buffer (freed with free(line->data)).
+ *
+ * @param line: the buffer to set up
+ */
+void init_line(struct LineBuffer* line) {
+
+    line->data = malloc(INITIAL_LINE_SIZE);
+    line->data[0] = '\0';
+    line->length = 0;
+    line->capacity = INITIAL_LINE_SIZE;
+}
+
+/**
+ * Adds formatted text to the end of a line buffer, growing it if needed.
+ *
+ * @param line: the buffer to add to
+ * @param format: printf style format of the text
+ */
+void append_line(struct LineBuffer* line, const char* format, ...) {
+
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(line->data + line->length,
+            line->capacity - line->length, format, args);
+    va_end(args);
+
+    if (line->length + length >= line->capacity) {
+        line->capacity = (line->length + length + 1) * 2;
+        line->data = realloc(line->data, line->capacity);
+        va_start(args, format);
+        vsnprintf(line->data + line->length, line->capacity - line->length,
+                format, args);
+        va_end(args);
+    }
+    line->length += length;
+}
+
+/**
+ * Parses a message field as an unsigned number.
+ *
+ * @param field: the field to parse, or NULL if the message ran out
+ * @param value: where the number is written
+ * @return true if the field is a number, false otherwise
+ */
+bool parse_unsigned(const char* field, uint64_t* value) {
+
+    char* end;
+    if (field == NULL || *field < '0' || *field > '9') {
+        return false;
     }
+    *value = strtoull(field, &end, 10);
 
-    return true;
-}
\ No newline at end of file
+    return *end == '\0';
+}
+
+/**
+ * Parses a message field as a (possibly negative) number.
+ *
+ * @param field: the field to parse, or NULL if the message ran out
+ * @param value: where the number is written
+ * @return true if the field is a number, false otherwise
+ */
+bool parse_signed(const char* field, int64_t* value) {
+
+    char* end;
+    if (field == NULL || *field == '\0') {
+        return false;
+    }
+    *value = strtoll(field, &end, 10);
+
+    return *end == '\0';
+}
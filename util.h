@@ -4,6 +4,16 @@
 #include <stdbool.h>
 #include <string.h>
 #include <ctype.h>
+#include <stdint.h>
+
+/**
+ * A line being built up for sending, which grows as needed.
+ */
+struct LineBuffer {
+    char* data;
+    size_t length;
+    size_t capacity;
+};
 
 int count_symbol(char* string, char symbol);
 
@@ -15,4 +25,12 @@ bool check_characters(char* string, char* invalidChars);
 
 bool is_a_number(char* arg);
 
+void init_line(struct LineBuffer* line);
+
+void append_line(struct LineBuffer* line, const char* format, ...);
+
+bool parse_unsigned(const char* field, uint64_t* value);
+
+bool parse_signed(const char* field, int64_t* value);
+
 #endif //UTIL_H